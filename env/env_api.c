@@ -12,9 +12,11 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <fnmatch.h>
 #include "env_api.h"
 #include "ebgenv.h"
 #include "uservars.h"
+#include "env_config_partitions.h"
 
 /* UEFI uses 16-bit wide unicode strings.
  * However, wchar_t support functions are fixed to 32-bit wide
@@ -61,6 +63,66 @@ void ebg_beverbose(ebgenv_t *e, bool v)
 	bgenv_be_verbose(v);
 }
 
+void ebg_env_compress(ebgenv_t *e, bool v)
+{
+	bgenv_be_compressing(v);
+}
+
+void ebg_env_raw_io(ebgenv_t *e, bool v)
+{
+	bgenv_use_raw_io(v);
+}
+
+void ebg_env_parallel_reads(ebgenv_t *e, bool v)
+{
+	bgenv_use_parallel_reads(v);
+}
+
+void ebg_env_lazy_load(ebgenv_t *e, bool v)
+{
+	bgenv_use_lazy_loading(v);
+}
+
+void ebg_env_probe_timeouts(ebgenv_t *e, unsigned int device_ms,
+			    unsigned int total_ms)
+{
+	bgenv_set_probe_timeouts(device_ms, total_ms);
+}
+
+void ebg_env_rescan(ebgenv_t *e)
+{
+	bgenv_drop_discovery_cache();
+}
+
+int ebg_env_list(ebgenv_t *e, ebgenv_summary_t *list, uint32_t *count)
+{
+	bool opened = e->bgenv != NULL;
+
+	if (!count) {
+		return EINVAL;
+	}
+	if (!list || *count < ENV_NUM_CONFIG_PARTS) {
+		*count = ENV_NUM_CONFIG_PARTS;
+		return ENOBUFS;
+	}
+	if (!opened && !bgenv_init()) {
+		return EIO;
+	}
+	for (uint32_t i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		(void)bgenv_get_summary(i, &list[i]);
+	}
+	*count = ENV_NUM_CONFIG_PARTS;
+	if (!opened) {
+		bgenv_release_mounts();
+	}
+	return 0;
+}
+
+uint32_t ebg_env_skipped_writes(ebgenv_t *e)
+{
+	return bgenv_get_skipped_writes();
+}
+
 int ebg_env_create_new(ebgenv_t *e)
 {
 	if (!bgenv_init()) {
@@ -81,11 +143,26 @@ int ebg_env_create_new(ebgenv_t *e)
 			return errno;
 		}
 		BG_ENVDATA *new_data = ((BGENV *)e->bgenv)->data;
+		/* files of blobs of the replaced data become unreferenced */
+		bool had_blobs = bgenv_has_blobs((BGENV *)e->bgenv);
 		uint32_t new_rev = new_data->revision;
 		uint8_t new_in_progress = new_data->in_progress;
 		memcpy(new_data, latest_env->data, sizeof(BG_ENVDATA));
 		new_data->revision = new_rev;
 		new_data->in_progress = new_in_progress;
+		(void)bgenv_build_uservar_index(new_data->userdata);
+		bgenv_mark_dirty((BGENV *)e->bgenv, new_data,
+				 sizeof(BG_ENVDATA));
+		/* blob files live on the config partition of each env */
+		if (!bgenv_copy_blobs((BGENV *)e->bgenv, latest_env)) {
+			bgenv_close(latest_env);
+			bgenv_close((BGENV *)e->bgenv);
+			e->bgenv = NULL;
+			return EIO;
+		}
+		if (had_blobs) {
+			((BGENV *)e->bgenv)->blobs_changed = true;
+		}
 		bgenv_close(latest_env);
 	} else {
 		e->bgenv = latest_env;
@@ -130,6 +207,25 @@ int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t usertype, uint8_t *value,
 	return bgenv_set((BGENV *)e->bgenv, key, usertype, value, datalen);
 }
 
+int ebg_env_set_many(ebgenv_t *e, ebgenv_var_t *vars, uint32_t count)
+{
+	return bgenv_set_many((BGENV *)e->bgenv, vars, count);
+}
+
+int ebg_env_get_view(ebgenv_t *e, char *key, uint64_t *datatype,
+		     const uint8_t **value, uint32_t *datalen)
+{
+	return bgenv_get_view((BGENV *)e->bgenv, key, datatype,
+			      (uint8_t **)value, datalen, false);
+}
+
+int ebg_env_get_view_rw(ebgenv_t *e, char *key, uint64_t *datatype,
+			uint8_t **value, uint32_t *datalen)
+{
+	return bgenv_get_view((BGENV *)e->bgenv, key, datatype, value,
+			      datalen, true);
+}
+
 uint32_t ebg_env_user_free(ebgenv_t *e)
 {
 	if (!e->bgenv) {
@@ -141,41 +237,134 @@ uint32_t ebg_env_user_free(ebgenv_t *e)
 	return bgenv_user_free(((BGENV *)e->bgenv)->data->userdata);
 }
 
+int ebg_env_set_capacity(ebgenv_t *e, uint32_t capacity)
+{
+	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
+		return EIO;
+	}
+	if (!bgenv_set_capacity((BGENV *)e->bgenv, capacity)) {
+		return errno;
+	}
+	return 0;
+}
+
+int ebg_env_defer_compaction(ebgenv_t *e, bool defer)
+{
+	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
+		return EIO;
+	}
+	if (!bgenv_defer_uservar_compaction(
+		((BGENV *)e->bgenv)->data->userdata, defer)) {
+		return ENOTSUP;
+	}
+	return 0;
+}
+
+int ebg_env_use_compact_records(ebgenv_t *e, bool compact)
+{
+	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
+		return EIO;
+	}
+	if (!bgenv_use_compact_uservars(((BGENV *)e->bgenv)->data->userdata,
+					compact)) {
+		return ENOTSUP;
+	}
+	return 0;
+}
+
+int ebg_env_user_stats(ebgenv_t *e, ebgenv_user_stats_t *stats)
+{
+	if (!stats) {
+		return EINVAL;
+	}
+	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
+		return EIO;
+	}
+	bgenv_uservar_stats(((BGENV *)e->bgenv)->data->userdata, stats);
+	return 0;
+}
+
+int ebg_env_iter_begin(ebgenv_t *e, ebgenv_iter_t *it, char *prefix)
+{
+	if (!it) {
+		return -EINVAL;
+	}
+	memset(it, 0, sizeof(ebgenv_iter_t));
+	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
+		return -EIO;
+	}
+	if (prefix) {
+		it->prefix = strdup(prefix);
+		if (!it->prefix) {
+			return -ENOMEM;
+		}
+	}
+	it->bgenv = e->bgenv;
+	return 0;
+}
+
+int ebg_env_iter_next(ebgenv_iter_t *it, char **key, uint64_t *datatype,
+		      uint8_t **value, uint32_t *datalen)
+{
+	uint8_t *var;
+
+	if (!it) {
+		return -EINVAL;
+	}
+	if (!it->bgenv || !((BGENV *)it->bgenv)->data) {
+		return -EIO;
+	}
+	var = bgenv_iter_uservar(((BGENV *)it->bgenv)->data->userdata,
+				 it->prefix, &it->pos);
+	if (!var) {
+		return -ENOENT;
+	}
+	bgenv_map_uservar(var, key, datatype, value, NULL, datalen);
+	return 0;
+}
+
+void ebg_env_iter_end(ebgenv_iter_t *it)
+{
+	if (!it) {
+		return;
+	}
+	free(it->prefix);
+	memset(it, 0, sizeof(ebgenv_iter_t));
+}
+
 uint16_t ebg_env_getglobalstate(ebgenv_t *e)
 {
-	BGENV *env;
+	ebgenv_summary_t summary;
 	int res = 4;
 
-	/* find all environments with revision 0 */
+	/* find all environments with revision 0, looking at the fixed fields
+	 * first, so that in lazy mode only environments deciding the state
+	 * are loaded to verify them */
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		BGENV *env = bgenv_open_by_index(i);
-
-		if (!env) {
+		if (!bgenv_get_summary(i, &summary)) {
 			continue;
 		}
+		if (summary.revision == REVISION_FAILED &&
+		    summary.ustate == USTATE_FAILED && !summary.verified) {
+			/* cleared if invalid */
+			(void)bgenv_verify(i);
+			(void)bgenv_get_summary(i, &summary);
+		}
 		/* update was unsuccessful if there is a config,
 		 * with revision == REVISION_FAILED and
 		 * with ustate == USTATE_FAILED */
-		if (env->data->revision == REVISION_FAILED &&
-		    env->data->ustate == USTATE_FAILED) {
-			res = 3;
-		}
-		(void)bgenv_close(env);
-		if (res == 3) {
-			return res;
+		if (summary.revision == REVISION_FAILED &&
+		    summary.ustate == USTATE_FAILED) {
+			return 3;
 		}
 	}
 
-	env = bgenv_open_latest();
-	if (!env) {
+	if (!bgenv_get_summary(bgenv_select_verified(true), &summary)) {
 		errno = EIO;
 		return res;
 	}
 
-	res = env->data->ustate;
-	bgenv_close(env);
-
-	return res;
+	return summary.ustate;
 }
 
 int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
@@ -202,6 +391,8 @@ int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
 		}
 		if (env->data->ustate != ustate) {
 			env->data->ustate = ustate;
+			bgenv_mark_dirty(env, &env->data->ustate,
+					 sizeof(env->data->ustate));
 			env->data->crc32 = crc32(0, (Bytef *)env->data,
 				sizeof(BG_ENVDATA) - sizeof(env->data->crc32));
 			if (!bgenv_write(env)) {
@@ -226,6 +417,8 @@ int ebg_env_close(ebgenv_t *e)
 	BGENV *env_current;
 	env_current = (BGENV *)e->bgenv;
 
+	/* drop tombstones left by deferred compaction */
+	bgenv_compact_uservars(env_current->data->userdata);
 	/* recalculate checksum */
 	env_current->data->crc32 =
 	    crc32(0, (Bytef *)env_current->data,
@@ -233,8 +426,11 @@ int ebg_env_close(ebgenv_t *e)
 	/* save */
 	if (!bgenv_write(env_current)) {
 		(void)bgenv_close(env_current);
+		bgenv_release_mounts();
 		return EIO;
 	}
+	/* the session ends here, release temporary mounts */
+	bgenv_release_mounts();
 	if (!bgenv_close(env_current)) {
 		return EIO;
 	}
@@ -242,54 +438,195 @@ int ebg_env_close(ebgenv_t *e)
 	return 0;
 }
 
+static GC_SET *gc_set_get(ebgenv_t *e)
+{
+	if (!e->gc_registry) {
+		e->gc_registry = calloc(1, sizeof(GC_SET));
+	}
+	return e->gc_registry;
+}
+
+static void gc_set_free(ebgenv_t *e)
+{
+	GC_SET *gc = e->gc_registry;
+	GC_ITEM *item, *next;
+
+	if (!gc) {
+		return;
+	}
+	for (uint32_t i = 0; i < gc->num_buckets; i++) {
+		for (item = gc->buckets[i]; item; item = next) {
+			next = item->next;
+			free(item->key);
+			free(item);
+		}
+	}
+	for (item = gc->patterns; item; item = next) {
+		next = item->next;
+		free(item->key);
+		free(item);
+	}
+	free(gc->buckets);
+	free(gc);
+	e->gc_registry = NULL;
+}
+
+static bool gc_set_grow(GC_SET *gc)
+{
+	uint32_t num_buckets = gc->num_buckets ? gc->num_buckets * 2 : 64;
+	GC_ITEM **buckets, *item, *next;
+
+	buckets = calloc(num_buckets, sizeof(GC_ITEM *));
+	if (!buckets) {
+		return false;
+	}
+	for (uint32_t i = 0; i < gc->num_buckets; i++) {
+		for (item = gc->buckets[i]; item; item = next) {
+			next = item->next;
+			item->next = buckets[item->hash & (num_buckets - 1)];
+			buckets[item->hash & (num_buckets - 1)] = item;
+		}
+	}
+	free(gc->buckets);
+	gc->buckets = buckets;
+	gc->num_buckets = num_buckets;
+	return true;
+}
+
+static bool gc_set_contains(GC_SET *gc, char *key, uint32_t hash)
+{
+	GC_ITEM *item;
+
+	if (!gc->num_buckets) {
+		return false;
+	}
+	for (item = gc->buckets[hash & (gc->num_buckets - 1)]; item;
+	     item = item->next) {
+		if (item->hash == hash && strcmp(item->key, key) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
 int ebg_env_register_gc_var(ebgenv_t *e, char *key)
 {
-	GC_ITEM **pgci;
-	pgci = (GC_ITEM **)&e->gc_registry;
+	GC_ITEM *item, **bucket;
+	uint32_t hash;
+	GC_SET *gc;
 
 	if (!key) {
 		return EINVAL;
 	}
-	while (*pgci) {
-		pgci = &((*pgci)->next);
+	gc = gc_set_get(e);
+	if (!gc) {
+		return ENOMEM;
+	}
+	hash = bgenv_uservar_hash(key);
+	if (gc_set_contains(gc, key, hash)) {
+		return 0;
+	}
+	/* keep the load factor below 1 */
+	if (gc->num_keys >= gc->num_buckets && !gc_set_grow(gc)) {
+		return ENOMEM;
 	}
-	*pgci = (GC_ITEM *)calloc(1, sizeof(GC_ITEM));
-	if (!*pgci) {
+	item = (GC_ITEM *)calloc(1, sizeof(GC_ITEM));
+	if (!item) {
 		return ENOMEM;
 	}
-	if (asprintf(&((*pgci)->key), "%s", key) == -1) {
-		free(*pgci);
-		*pgci = NULL;
+	if (asprintf(&item->key, "%s", key) == -1) {
+		free(item);
 		return ENOMEM;
 	}
+	item->hash = hash;
+	bucket = &gc->buckets[hash & (gc->num_buckets - 1)];
+	item->next = *bucket;
+	*bucket = item;
+	gc->num_keys++;
 	return 0;
 }
 
+int ebg_env_register_gc_pattern(ebgenv_t *e, char *pattern)
+{
+	GC_ITEM *item;
+	size_t len;
+	GC_SET *gc;
+
+	if (!pattern || !*pattern) {
+		return EINVAL;
+	}
+	gc = gc_set_get(e);
+	if (!gc) {
+		return ENOMEM;
+	}
+	item = (GC_ITEM *)calloc(1, sizeof(GC_ITEM));
+	if (!item) {
+		return ENOMEM;
+	}
+	if (asprintf(&item->key, "%s", pattern) == -1) {
+		free(item);
+		return ENOMEM;
+	}
+	/* a trailing '*' as the only wildcard is matched as a prefix */
+	len = strlen(pattern);
+	if (pattern[len - 1] == '*' &&
+	    strcspn(pattern, "*?[\\") == len - 1) {
+		item->prefix_len = len - 1;
+	}
+	item->next = gc->patterns;
+	gc->patterns = item;
+	return 0;
+}
+
+typedef struct {
+	GC_SET *gc;
+	bool blobs;
+} GC_SWEEP;
+
+static bool gc_matches(char *key, uint64_t type, void *ctx)
+{
+	GC_SWEEP *sweep = ctx;
+	GC_ITEM *item;
+	bool match;
+
+	match = gc_set_contains(sweep->gc, key, bgenv_uservar_hash(key));
+	for (item = sweep->gc->patterns; item && !match; item = item->next) {
+		if (item->prefix_len) {
+			match = strncmp(key, item->key, item->prefix_len) == 0;
+		} else {
+			match = fnmatch(item->key, key, 0) == 0;
+		}
+	}
+	if (match && (type & USERVAR_TYPE_BLOB)) {
+		sweep->blobs = true;
+	}
+	return match;
+}
+
 int ebg_env_finalize_update(ebgenv_t *e)
 {
 	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
 		return EIO;
 	}
 
-	GC_ITEM **pgci, *tmp;
-	uint8_t *udata;
+	GC_SWEEP sweep = { .gc = e->gc_registry };
 
-	pgci = (GC_ITEM **)&e->gc_registry;
-	udata = ((BGENV *)e->bgenv)->data->userdata;
-	while (*pgci) {
-		uint8_t *var;
-		var = bgenv_find_uservar(udata, (*pgci)->key);
-		if (var) {
-			bgenv_del_uservar(udata, var);
+	if (sweep.gc) {
+		/* remove all registered variables in a single pass */
+		(void)bgenv_del_uservars_matching(
+			((BGENV *)e->bgenv)->data->userdata, gc_matches,
+			&sweep);
+		if (sweep.blobs) {
+			((BGENV *)e->bgenv)->blobs_changed = true;
 		}
-		free((*pgci)->key);
-		tmp = (*pgci)->next;
-		free(*pgci);
-		*pgci = NULL;
-		pgci = &tmp;
+		gc_set_free(e);
 	}
 
 	((BGENV *)e->bgenv)->data->in_progress = 0;
 	((BGENV *)e->bgenv)->data->ustate = USTATE_INSTALLED;
+	/* both fields are adjacent */
+	bgenv_mark_dirty((BGENV *)e->bgenv,
+			 &((BGENV *)e->bgenv)->data->in_progress, 2);
+	((BGENV *)e->bgenv)->dirty = true;
 	return 0;
 }
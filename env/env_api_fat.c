@@ -12,15 +12,32 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <pthread.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 #include "env_config_partitions.h"
 #include "env_config_file.h"
+#include "env_fat_raw.h"
 #include "uservars.h"
 #include "test-interface.h"
 #include "ebgpart.h"
 
 bool bgenv_verbosity = false;
+bool bgenv_compression = false;
+bool bgenv_raw_io = false;
+bool bgenv_parallel_reads = false;
+bool bgenv_lazy_loading = false;
+uint32_t bgenv_skipped_writes = 0;
+
+/* set by read_env if the file held compressed user variables, per thread
+ * as bgenv_init may read in parallel */
+static __thread bool env_read_compressed;
+
+/* set by read_env to the user variable capacity recorded in a file of
+ * variable size, 0 for files of fixed size */
+static __thread uint32_t env_read_capacity;
+
+static uint32_t env_file_capacity(BG_ENVDATA *env);
 
 EBGENVKEY bgenv_str2enum(char *key)
 {
@@ -52,11 +69,151 @@ void bgenv_be_verbose(bool v)
 	ebgpart_beverbose(v);
 }
 
-bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
+void bgenv_be_compressing(bool v)
 {
-	if (!part) {
+	bgenv_compression = v;
+}
+
+void bgenv_use_raw_io(bool v)
+{
+	bgenv_raw_io = v;
+}
+
+void bgenv_use_parallel_reads(bool v)
+{
+	bgenv_parallel_reads = v;
+}
+
+void bgenv_use_lazy_loading(bool v)
+{
+	bgenv_lazy_loading = v;
+}
+
+void bgenv_set_probe_timeouts(unsigned int device_ms, unsigned int total_ms)
+{
+	ped_device_set_probe_timeouts(device_ms, total_ms);
+}
+
+static uint32_t env_crc32(BG_ENVDATA *env)
+{
+	return crc32(0, (Bytef *)env, sizeof(BG_ENVDATA) - sizeof(env->crc32));
+}
+
+/* Compressed user variables are stored as
+ * |--------------------------|----------------|-----------------|---------|
+ * | uint8_t USERDATA_ZLIB    | uint32_t size  | zlib stream     | 0 ...   |
+ * |--------------------------|----------------|-----------------|---------|
+ * where size is the length of the zlib stream. They are only written to
+ * files of variable size ending right behind the stream, with a footer
+ * marked by ENV_FOOTER_MAGIC_ZLIB, see envdata.h. Readers not knowing that
+ * magic reject the file rather than taking the stream for user variables.
+ * The boot loader, which does not interpret user variables, keeps the magic
+ * when rewriting the file. Decompressed user variables still have to fit
+ * into ENV_MEM_USERVARS, so compression shrinks the file, not the space
+ * for user variables.
+ */
+bool compress_env(BG_ENVDATA *env)
+{
+	uint8_t *buffer;
+	uLongf size;
+	uint32_t len, stream_size;
+	bool result = false;
+
+	len = ENV_MEM_USERVARS;
+	while (len && !env->userdata[len - 1]) {
+		len--;
+	}
+	size = compressBound(len);
+	buffer = malloc(size);
+	if (!buffer) {
+		return false;
+	}
+	if (compress2(buffer, &size, env->userdata, len,
+		      Z_BEST_COMPRESSION) != Z_OK) {
+		VERBOSE(stderr, "Error compressing user variables.\n");
+		goto compress_env_out;
+	}
+	if (size + USERDATA_ZLIB_HEADER_SIZE >= len) {
+		/* does not pay off, keep plain user variables */
+		goto compress_env_out;
+	}
+	stream_size = size;
+	env->userdata[0] = USERDATA_ZLIB;
+	memcpy(env->userdata + 1, &stream_size, sizeof(uint32_t));
+	memcpy(env->userdata + USERDATA_ZLIB_HEADER_SIZE, buffer, size);
+	memset(env->userdata + USERDATA_ZLIB_HEADER_SIZE + size, 0,
+	       ENV_MEM_USERVARS - USERDATA_ZLIB_HEADER_SIZE - size);
+	env->crc32 = env_crc32(env);
+	result = true;
+
+compress_env_out:
+	free(buffer);
+	return result;
+}
+
+bool decompress_env(BG_ENVDATA *env)
+{
+	uint8_t *buffer;
+	uLongf size;
+	uint32_t stream_size;
+	bool result = false;
+
+	if (env->userdata[0] != USERDATA_ZLIB) {
+		return true;
+	}
+	memcpy(&stream_size, env->userdata + 1, sizeof(uint32_t));
+	if (stream_size > ENV_MEM_USERVARS - USERDATA_ZLIB_HEADER_SIZE) {
+		VERBOSE(stderr, "Invalid size of compressed user variables.\n");
 		return false;
 	}
+	buffer = malloc(ENV_MEM_USERVARS);
+	if (!buffer) {
+		return false;
+	}
+	size = ENV_MEM_USERVARS;
+	if (uncompress(buffer, &size, env->userdata + USERDATA_ZLIB_HEADER_SIZE,
+		       stream_size) != Z_OK) {
+		VERBOSE(stderr, "Error decompressing user variables.\n");
+		goto decompress_env_out;
+	}
+	memcpy(env->userdata, buffer, size);
+	memset(env->userdata + size, 0, ENV_MEM_USERVARS - size);
+	env->crc32 = env_crc32(env);
+	result = true;
+
+decompress_env_out:
+	free(buffer);
+	return result;
+}
+
+/* Decompress the user variables of a file marked as compressed, bgenv_init
+ * drops environments failing here. */
+static bool read_env_decompress(BG_ENVDATA *env)
+{
+	if (!env_read_compressed) {
+		return true;
+	}
+	if (env->userdata[0] != USERDATA_ZLIB || !decompress_env(env)) {
+		memset(env, 0, sizeof(BG_ENVDATA));
+		return false;
+	}
+	return true;
+}
+
+/* Read at most *len bytes of the environment file of a config partition,
+ * *len is set to the bytes read */
+static bool read_env_file(CONFIG_PART *part, void *buffer, uint32_t *len)
+{
+	if (part->raw) {
+		if (!fat_raw_read_file(part->devpath, FAT_ENV_FILENAME, buffer,
+				       len)) {
+			VERBOSE(stderr,
+				"Error reading environment data from %s\n",
+				part->devpath);
+			return false;
+		}
+		return true;
+	}
 	if (part->not_mounted) {
 		/* mount partition before reading config file */
 		if (!mount_partition(part)) {
@@ -71,30 +228,146 @@ bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 		return false;
 	}
 	bool result = true;
-	if (!(fread(env, sizeof(BG_ENVDATA), 1, config) == 1)) {
+	*len = fread(buffer, 1, *len, config);
+	if (ferror(config)) {
 		VERBOSE(stderr, "Error reading environment data from %s\n",
 			part->devpath);
-		if (feof(config)) {
-			VERBOSE(stderr, "End of file encountered.\n");
-		}
 		result = false;
 	}
 	if (close_config_file(config)) {
 		VERBOSE(stderr,
 			"Error closing environment file after reading.\n");
 	};
-	if (part->not_mounted) {
-		unmount_partition(part);
-	}
 	return result;
 }
 
+/* Fill env from an environment file of len bytes, in either format, see
+ * envdata.h. A file padded to sizeof(BG_ENVDATA) also passes the checksum
+ * of the fixed format, so the footer is checked first. Files of fixed size
+ * are taken as they are, an invalid checksum is detected by the caller. */
+static bool env_from_file(BG_ENVDATA *env, uint8_t *file, uint32_t len)
+{
+	BG_ENVFOOTER footer;
+	uint32_t used;
+
+	env_read_capacity = 0;
+	env_read_compressed = false;
+	if (len < ENV_HEADER_SIZE + sizeof(BG_ENVFOOTER)) {
+		goto env_from_file_fixed;
+	}
+	memcpy(&footer, file + len - sizeof(BG_ENVFOOTER), sizeof(footer));
+	used = len - ENV_HEADER_SIZE - sizeof(BG_ENVFOOTER);
+	if ((footer.magic != ENV_FOOTER_MAGIC &&
+	     footer.magic != ENV_FOOTER_MAGIC_ZLIB) ||
+	    footer.used != used ||
+	    used > ENV_MEM_USERVARS || footer.capacity == 0 ||
+	    used > footer.capacity ||
+	    footer.crc32 != crc32(0, file, len - sizeof(footer.crc32))) {
+		goto env_from_file_fixed;
+	}
+	memset(env, 0, sizeof(BG_ENVDATA));
+	memcpy(env, file, ENV_HEADER_SIZE);
+	memcpy(env->userdata, file + ENV_HEADER_SIZE, used);
+	env->crc32 = env_crc32(env);
+	env_read_capacity = footer.capacity < ENV_MEM_USERVARS
+				    ? footer.capacity
+				    : ENV_MEM_USERVARS;
+	env_read_compressed = footer.magic == ENV_FOOTER_MAGIC_ZLIB;
+	return true;
+
+env_from_file_fixed:
+	if (len != sizeof(BG_ENVDATA)) {
+		VERBOSE(stderr, "Invalid environment file of %u bytes.\n", len);
+		memset(env, 0, sizeof(BG_ENVDATA));
+		return false;
+	}
+	memcpy(env, file, sizeof(BG_ENVDATA));
+	return true;
+}
+
+/* Files of variable size are read with the user variables they hold only */
+bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	uint32_t len = sizeof(BG_ENVDATA) + sizeof(BG_ENVFOOTER);
+	uint8_t *buffer;
+	bool result;
+
+	env_read_capacity = 0;
+	env_read_compressed = false;
+	if (!part) {
+		return false;
+	}
+	if (!(buffer = malloc(len))) {
+		return false;
+	}
+	result = read_env_file(part, buffer, &len) &&
+		 env_from_file(env, buffer, len);
+	free(buffer);
+	if (!result) {
+		return false;
+	}
+	return read_env_decompress(env);
+}
+
+/* Read only the fixed fields in front of the user variables, which are
+ * never compressed and lead files of both formats. */
+static bool read_env_header(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	uint32_t len = ENV_HEADER_SIZE;
+
+	if (!part) {
+		return false;
+	}
+	return read_env_file(part, env, &len) && len == ENV_HEADER_SIZE;
+}
+
+/* Build the file of variable size holding env with the given user variable
+ * capacity, see envdata.h. If *len is not 0, the file is padded to *len
+ * bytes and must fit into them. Otherwise, *len is set to its size. */
+static uint8_t *env_to_file(BG_ENVDATA *env, uint32_t capacity,
+			    bool compressed, uint32_t *len)
+{
+	BG_ENVFOOTER footer;
+	uint32_t used = ENV_MEM_USERVARS;
+	uint8_t *file;
+
+	while (used > 0 && env->userdata[used - 1] == 0) {
+		used--;
+	}
+	if (*len) {
+		if (*len < ENV_HEADER_SIZE + used + sizeof(BG_ENVFOOTER) ||
+		    *len > ENV_HEADER_SIZE + ENV_MEM_USERVARS +
+			       sizeof(BG_ENVFOOTER)) {
+			VERBOSE(stderr, "Environment does not fit into file "
+					"of %u bytes.\n", *len);
+			return NULL;
+		}
+		used = *len - ENV_HEADER_SIZE - sizeof(BG_ENVFOOTER);
+	}
+	*len = ENV_HEADER_SIZE + used + sizeof(BG_ENVFOOTER);
+	if (!(file = malloc(*len))) {
+		return NULL;
+	}
+	memcpy(file, env, ENV_HEADER_SIZE + used);
+	footer.capacity = capacity > used ? capacity : used;
+	footer.used = used;
+	footer.magic = compressed ? ENV_FOOTER_MAGIC_ZLIB : ENV_FOOTER_MAGIC;
+	memcpy(file + ENV_HEADER_SIZE + used, &footer, sizeof(footer));
+	footer.crc32 = crc32(0, file, *len - sizeof(footer.crc32));
+	memcpy(file + *len - sizeof(footer.crc32), &footer.crc32,
+	       sizeof(footer.crc32));
+	return file;
+}
+
 bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
 {
 	if (!part) {
 		return false;
 	}
-	if (part->not_mounted) {
+	if (part->raw) {
+		VERBOSE(stdout, "Write config file: raw access to %s\n",
+			part->devpath);
+	} else if (part->not_mounted) {
 		/* mount partition before reading config file */
 		if (!mount_partition(part)) {
 			return false;
@@ -103,33 +376,379 @@ bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
 		VERBOSE(stdout, "Read config file: mounted to %s\n",
 			part->mountpoint);
 	}
+	uint32_t capacity = env_file_capacity(env);
+	BG_ENVDATA *compressed = NULL;
+	if (bgenv_compression && (compressed = malloc(sizeof(BG_ENVDATA)))) {
+		memcpy(compressed, env, sizeof(BG_ENVDATA));
+		if (compress_env(compressed)) {
+			env = compressed;
+			/* only files of variable size hold compressed data */
+			if (!capacity) {
+				capacity = ENV_MEM_USERVARS;
+			}
+		} else {
+			free(compressed);
+			compressed = NULL;
+		}
+	}
+	uint8_t *file = (uint8_t *)env;
+	uint32_t len = sizeof(BG_ENVDATA);
+	if (capacity) {
+		/* raw access cannot resize the file */
+		len = 0;
+		if ((part->raw && !fat_raw_probe_file(part->devpath,
+						      FAT_ENV_FILENAME,
+						      &len)) ||
+		    !(file = env_to_file(env, capacity, compressed != NULL,
+					 &len))) {
+			VERBOSE(stderr, "Error saving environment data to %s\n",
+				part->devpath);
+			free(compressed);
+			return false;
+		}
+	}
+	if (part->raw) {
+		bool result = fat_raw_write_file(part->devpath,
+						 FAT_ENV_FILENAME, file, len);
+		if (!result) {
+			VERBOSE(stderr, "Error saving environment data to %s\n",
+				part->devpath);
+		}
+		if (file != (uint8_t *)env) {
+			free(file);
+		}
+		free(compressed);
+		return result;
+	}
 	FILE *config;
 	if (!(config = open_config_file(part, "wb"))) {
 		VERBOSE(stderr, "Could not open config file for writing.\n");
+		if (file != (uint8_t *)env) {
+			free(file);
+		}
+		free(compressed);
 		return false;
 	}
 	bool result = true;
-	if (!(fwrite(env, sizeof(BG_ENVDATA), 1, config) == 1)) {
+	if (!(fwrite(file, len, 1, config) == 1)) {
 		VERBOSE(stderr, "Error saving environment data to %s\n",
 			part->devpath);
 		result = false;
 	}
+	/* the partition stays mounted, so unmounting does not flush */
+	if (result && (fflush(config) || fsync(fileno(config)))) {
+		VERBOSE(stderr, "Error syncing environment data to %s\n",
+			part->devpath);
+		result = false;
+	}
 	if (close_config_file(config)) {
 		VERBOSE(stderr,
 			"Error closing environment file after writing.\n");
 		result = false;
 	};
-	if (part->not_mounted) {
-		unmount_partition(part);
+	if (file != (uint8_t *)env) {
+		free(file);
 	}
+	free(compressed);
 	return result;
 }
 
 CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
 BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
 
+/* Byte range of each environment changed since it was read or written.
+ * Changes of the user variables are tracked by their index instead, see
+ * bgenv_uservar_dirty_range(). */
+typedef struct {
+	uint32_t start;
+	uint32_t end;		/* empty if not behind start */
+} ENV_RANGE;
+
+static ENV_RANGE env_dirty[ENV_NUM_CONFIG_PARTS];
+
+/* Contents of each environment as stored in its file, used to skip writing
+ * unchanged data. */
+typedef struct {
+	BG_ENVDATA *data;	/* NULL if unknown */
+	bool compressed;
+} ENV_STORED;
+
+static ENV_STORED env_stored[ENV_NUM_CONFIG_PARTS];
+
+/* Environments of which only the fixed fields in front of the user
+ * variables were read by bgenv_init in lazy mode */
+static bool env_header_only[ENV_NUM_CONFIG_PARTS];
+
+/* User variable capacity of each environment file of variable size, 0 for
+ * files of fixed size */
+static uint32_t env_capacity[ENV_NUM_CONFIG_PARTS];
+
+static int env_slot(BG_ENVDATA *data)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (data == &envdata[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static uint32_t env_file_capacity(BG_ENVDATA *env)
+{
+	int slot = env_slot(env);
+
+	return slot < 0 ? 0 : env_capacity[slot];
+}
+
+void bgenv_mark_dirty(BGENV *env, void *start, uint32_t len)
+{
+	ENV_RANGE *range;
+	uint32_t offset;
+	int slot;
+
+	if (!env || !env->data || !len) {
+		return;
+	}
+	slot = env_slot(env->data);
+	if (slot < 0) {
+		return;
+	}
+	range = &env_dirty[slot];
+	offset = (uint8_t *)start - (uint8_t *)env->data;
+	if (range->start >= range->end) {
+		range->start = offset;
+		range->end = offset + len;
+		return;
+	}
+	if (offset < range->start) {
+		range->start = offset;
+	}
+	if (offset + len > range->end) {
+		range->end = offset + len;
+	}
+}
+
+static void env_remember(BG_ENVDATA *data, bool valid, bool compressed)
+{
+	ENV_STORED *stored;
+	int slot = env_slot(data);
+
+	if (slot < 0) {
+		return;
+	}
+	stored = &env_stored[slot];
+	if (!valid) {
+		free(stored->data);
+		stored->data = NULL;
+		return;
+	}
+	if (!stored->data && !(stored->data = malloc(sizeof(BG_ENVDATA)))) {
+		return;
+	}
+	memcpy(stored->data, data, sizeof(BG_ENVDATA));
+	stored->compressed = compressed;
+}
+
+/* Is the file of the environment already holding data, in the format it
+ * would be written in? */
+static bool env_unchanged(BG_ENVDATA *data)
+{
+	ENV_STORED *stored;
+	int slot = env_slot(data);
+
+	if (slot < 0) {
+		return false;
+	}
+	stored = &env_stored[slot];
+	/* the checksum rejects almost all changes without comparing */
+	return stored->data && stored->compressed == bgenv_compression &&
+	       stored->data->crc32 == data->crc32 &&
+	       memcmp(stored->data, data, sizeof(BG_ENVDATA)) == 0;
+}
+
+uint32_t bgenv_get_skipped_writes(void)
+{
+	return bgenv_skipped_writes;
+}
+
+static void env_mark_clean(BG_ENVDATA *data)
+{
+	int slot = env_slot(data);
+
+	if (slot >= 0) {
+		env_dirty[slot].start = env_dirty[slot].end = 0;
+	}
+	bgenv_clear_uservar_dirty(data->userdata);
+}
+
+/* Update the environment file in place, writing only the byte ranges changed
+ * since it was read or written and the checksum. Returns false if the
+ * changes are unknown or the file cannot be updated in place, so that the
+ * caller rewrites the whole file instead. */
+static bool write_env_dirty(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	ENV_RANGE ranges[3];
+	uint32_t ustart, uend;
+	struct stat st;
+	FILE *config;
+	bool result = true;
+	int slot, fd;
+
+	slot = env_slot(env);
+	/* compressed data moves completely, raw access rewrites in place
+	 * anyway, files of variable size change their size */
+	if (slot < 0 || part->raw || bgenv_compression || env_capacity[slot] ||
+	    !bgenv_uservar_dirty_range(env->userdata, &ustart, &uend)) {
+		return false;
+	}
+	ranges[0] = env_dirty[slot];
+	ranges[1].start = offsetof(BG_ENVDATA, userdata) + ustart;
+	ranges[1].end = offsetof(BG_ENVDATA, userdata) + uend;
+	ranges[2].start = offsetof(BG_ENVDATA, crc32);
+	ranges[2].end = sizeof(BG_ENVDATA);
+	if (ranges[0].start == 0 && ranges[0].end >= ranges[2].start) {
+		return false;
+	}
+	if (part->not_mounted && !mount_partition(part)) {
+		return false;
+	}
+	if (!(config = open_config_file(part, "r+b"))) {
+		return false;
+	}
+	fd = fileno(config);
+	if (fstat(fd, &st) || st.st_size != sizeof(BG_ENVDATA)) {
+		(void)close_config_file(config);
+		return false;
+	}
+	VERBOSE(stdout, "Updating changed parts of %s\n", part->devpath);
+	for (int i = 0; i < 3 && result; i++) {
+		uint32_t len = ranges[i].end - ranges[i].start;
+
+		if (ranges[i].start >= ranges[i].end) {
+			continue;
+		}
+		if (pwrite(fd, (uint8_t *)env + ranges[i].start, len,
+			   ranges[i].start) != len) {
+			result = false;
+		}
+	}
+	if (result && fsync(fd)) {
+		result = false;
+	}
+	if (close_config_file(config)) {
+		result = false;
+	}
+	if (!result) {
+		VERBOSE(stderr, "Error updating environment data on %s\n",
+			part->devpath);
+	}
+	return result;
+}
+
+/* Config partitions not mounted by the system are mounted once by
+ * probe_config_file and kept mounted for reading and writing until here,
+ * which also runs when the program exits. Only the process which mounted
+ * them unmounts them. */
+void bgenv_release_mounts(void)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (config_parts[i].not_mounted) {
+			unmount_partition(&config_parts[i]);
+		}
+	}
+}
+
+/* Reading and verifying one environment file, the unit of work of
+ * bgenv_init */
+typedef struct {
+	CONFIG_PART *part;
+	BG_ENVDATA *env;
+	bool header_only;
+	bool valid;
+	bool compressed;
+	uint32_t capacity;
+} ENV_READ;
+
+static void *bgenv_read_one(void *arg)
+{
+	ENV_READ *r = (ENV_READ *)arg;
+
+	if (r->header_only) {
+		/* verified when the user variables are loaded */
+		memset(r->env, 0, sizeof(BG_ENVDATA));
+		(void)read_env_header(r->part, r->env);
+		r->compressed = false;
+		r->capacity = 0;
+		r->valid = true;
+		return NULL;
+	}
+	read_env(r->part, r->env);
+	r->compressed = env_read_compressed;
+	r->capacity = env_read_capacity;
+	r->valid = r->env->crc32 == env_crc32(r->env);
+	if (!r->valid) {
+		VERBOSE(stderr, "Invalid CRC32!\n");
+		r->capacity = 0;
+		/* clear invalid environment */
+		memset(r->env, 0, sizeof(BG_ENVDATA));
+		r->env->crc32 = env_crc32(r->env);
+	}
+	return NULL;
+}
+
+/* Read all environment files. In parallel mode, every file but the first
+ * is read and verified by a thread of its own, so that reading takes about
+ * as long as the slowest file. Files no thread can be started for are read
+ * by the calling thread. */
+static void bgenv_read_all(ENV_READ *reads)
+{
+	pthread_t threads[ENV_NUM_CONFIG_PARTS];
+	bool started[ENV_NUM_CONFIG_PARTS];
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		reads[i].part = &config_parts[i];
+		reads[i].env = &envdata[i];
+		reads[i].header_only = bgenv_lazy_loading;
+		started[i] = bgenv_parallel_reads && i > 0 &&
+			     pthread_create(&threads[i], NULL, bgenv_read_one,
+					    &reads[i]) == 0;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!started[i]) {
+			bgenv_read_one(&reads[i]);
+		}
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
+
+/* Set up the bookkeeping of an environment just read completely */
+static void bgenv_loaded(uint32_t index, ENV_READ *r)
+{
+	(void)bgenv_build_uservar_index(envdata[index].userdata);
+	env_capacity[index] = r->capacity;
+	(void)bgenv_set_uservar_capacity(envdata[index].userdata,
+					 r->capacity ? r->capacity
+						     : ENV_MEM_USERVARS);
+	env_mark_clean(&envdata[index]);
+	if (!r->valid || r->compressed) {
+		/* the file does not match the data in memory */
+		env_dirty[index].start = 0;
+		env_dirty[index].end = sizeof(BG_ENVDATA);
+	}
+	env_remember(&envdata[index], r->valid, r->compressed);
+}
+
 bool bgenv_init()
 {
+	ENV_READ reads[ENV_NUM_CONFIG_PARTS];
+
+	/* mounts of a previous session are not tracked after probing */
+	bgenv_release_mounts();
+	mount_table_release();
 	memset((void *)&config_parts, 0,
 	       sizeof(CONFIG_PART) * ENV_NUM_CONFIG_PARTS);
 	/* enumerate all config partitions */
@@ -137,21 +756,81 @@ bool bgenv_init()
 		VERBOSE(stderr, "Error finding config partitions.\n");
 		return false;
 	}
+	bgenv_read_all(reads);
+	/* the user variable indices are shared, build them one by one */
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		read_env(&config_parts[i], &envdata[i]);
-		uint32_t sum = crc32(0, (Bytef *)&envdata[i],
-		    sizeof(BG_ENVDATA) - sizeof(envdata[i].crc32));
-		if (envdata[i].crc32 != sum) {
-			VERBOSE(stderr, "Invalid CRC32!\n");
-			/* clear invalid environment */
-			memset(&envdata[i], 0, sizeof(BG_ENVDATA));
-			envdata[i].crc32 = crc32(0, (Bytef *)&envdata[i],
-			    sizeof(BG_ENVDATA) - sizeof(envdata[i].crc32));
+		env_header_only[i] = reads[i].header_only;
+		if (reads[i].header_only) {
+			bgenv_drop_uservar_index(envdata[i].userdata);
+			env_remember(&envdata[i], false, false);
+			continue;
 		}
+		bgenv_loaded(i, &reads[i]);
 	}
 	return true;
 }
 
+/* Load and verify the user variables of an environment of which only the
+ * fixed fields were read. Returns false if the environment turned out to be
+ * invalid and was cleared. */
+static bool bgenv_load(uint32_t index)
+{
+	ENV_READ r;
+
+	if (!env_header_only[index]) {
+		return true;
+	}
+	VERBOSE(stdout, "Loading user variables of environment %u.\n",
+		index);
+	r.part = &config_parts[index];
+	r.env = &envdata[index];
+	r.header_only = false;
+	bgenv_read_one(&r);
+	bgenv_loaded(index, &r);
+	env_header_only[index] = false;
+	return r.valid;
+}
+
+/* Make sure the environment was read completely and its checksum verified,
+ * false if it turned out to be invalid and was cleared */
+bool bgenv_verify(uint32_t index)
+{
+	if (index >= ENV_NUM_CONFIG_PARTS) {
+		return false;
+	}
+	return bgenv_load(index);
+}
+
+bool bgenv_get_summary(uint32_t index, ebgenv_summary_t *summary)
+{
+	if (index >= ENV_NUM_CONFIG_PARTS || !summary) {
+		return false;
+	}
+	summary->revision = envdata[index].revision;
+	summary->ustate = envdata[index].ustate;
+	summary->in_progress = envdata[index].in_progress;
+	summary->watchdog_timeout_sec = envdata[index].watchdog_timeout_sec;
+	summary->verified = !env_header_only[index];
+	return true;
+}
+
+/* Index of the environment with the highest or lowest revision, the first
+ * one of equal revisions */
+uint32_t bgenv_select_index(bool latest)
+{
+	uint32_t rev = latest ? 0 : 0xFFFFFFFF;
+	uint32_t idx = 0;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (latest ? envdata[i].revision > rev
+			   : envdata[i].revision < rev) {
+			rev = envdata[i].revision;
+			idx = i;
+		}
+	}
+	return idx;
+}
+
 BGENV *bgenv_open_by_index(uint32_t index)
 {
 	BGENV *handle;
@@ -160,6 +839,7 @@ BGENV *bgenv_open_by_index(uint32_t index)
 	if (index >= ENV_NUM_CONFIG_PARTS) {
 		return NULL;
 	}
+	(void)bgenv_load(index);
 	if (!(handle = calloc(1, sizeof(BGENV)))) {
 		return NULL;
 	}
@@ -168,32 +848,328 @@ BGENV *bgenv_open_by_index(uint32_t index)
 	return handle;
 }
 
+/* In lazy mode, the selection by unverified fixed fields is repeated if
+ * the selected environment turns out to be invalid when loading it. This
+ * terminates, as every round loads one more environment. */
+uint32_t bgenv_select_verified(bool latest)
+{
+	uint32_t index;
+
+	do {
+		index = bgenv_select_index(latest);
+	} while (!bgenv_load(index));
+	return index;
+}
+
+static BGENV *bgenv_open_selected(bool latest)
+{
+	return bgenv_open_by_index(bgenv_select_verified(latest));
+}
+
 BGENV *bgenv_open_oldest()
 {
-	uint32_t minrev = 0xFFFFFFFF;
-	uint32_t min_idx = 0;
+	return bgenv_open_selected(false);
+}
 
-	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (envdata[i].revision < minrev) {
-			minrev = envdata[i].revision;
-			min_idx = i;
+BGENV *bgenv_open_latest()
+{
+	return bgenv_open_selected(true);
+}
+
+static bool bgenv_is_blob(uint8_t *var)
+{
+	uint64_t type;
+
+	if (!var) {
+		return false;
+	}
+	bgenv_map_uservar(var, NULL, &type, NULL, NULL, NULL);
+	return (type & USERVAR_TYPE_BLOB) != 0;
+}
+
+bool bgenv_has_blobs(BGENV *env)
+{
+	uint32_t pos = 0;
+	uint8_t *var;
+
+	if (!env || !env->data) {
+		return false;
+	}
+	while ((var = bgenv_iter_uservar(env->data->userdata, NULL, &pos))) {
+		if (bgenv_is_blob(var)) {
+			return true;
 		}
 	}
-	return bgenv_open_by_index(min_idx);
+	return false;
 }
 
-BGENV *bgenv_open_latest()
+/* Collect the ids of all blob files referred to by user variables */
+static bool bgenv_blob_ids(BG_ENVDATA *data, uint32_t **ids, uint32_t *count)
 {
-	uint32_t maxrev = 0;
-	uint32_t max_idx = 0;
+	uint32_t pos = 0, size = 0, *tmp;
+	uint8_t *var, *val;
+	BLOB_REF ref;
 
-	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (envdata[i].revision > maxrev) {
-			maxrev = envdata[i].revision;
-			max_idx = i;
+	*ids = NULL;
+	*count = 0;
+	while ((var = bgenv_iter_uservar(data->userdata, NULL, &pos))) {
+		if (!bgenv_is_blob(var)) {
+			continue;
+		}
+		if (*count == size) {
+			size = size ? size * 2 : 16;
+			tmp = realloc(*ids, size * sizeof(uint32_t));
+			if (!tmp) {
+				free(*ids);
+				*ids = NULL;
+				return false;
+			}
+			*ids = tmp;
 		}
+		bgenv_map_uservar(var, NULL, NULL, &val, NULL, NULL);
+		memcpy(&ref, val, sizeof(BLOB_REF));
+		(*ids)[(*count)++] = ref.id;
+	}
+	return true;
+}
+
+/* Blob files need a mounted file system, raw access only covers the
+ * environment file. */
+static bool bgenv_blob_mount(CONFIG_PART *part)
+{
+	if (part->raw) {
+		VERBOSE(stderr, "Blobs are not supported with raw access "
+				"to %s.\n",
+			part->devpath);
+		return false;
+	}
+	return !part->not_mounted || mount_partition(part);
+}
+
+static bool bgenv_read_blob(CONFIG_PART *part, BLOB_REF *ref, uint8_t *buffer)
+{
+	bool result = true;
+	FILE *blob;
+
+	if (!bgenv_blob_mount(part)) {
+		return false;
+	}
+	if (!(blob = open_blob_file(part, ref->id, "rb"))) {
+		VERBOSE(stderr, "Could not open blob file on %s.\n",
+			part->devpath);
+		result = false;
+	} else {
+		if (ref->size && fread(buffer, ref->size, 1, blob) != 1) {
+			VERBOSE(stderr, "Error reading blob file on %s.\n",
+				part->devpath);
+			result = false;
+		}
+		fclose(blob);
+	}
+	if (result && crc32(0, buffer, ref->size) != ref->crc32) {
+		VERBOSE(stderr, "Invalid CRC32 of blob file on %s.\n",
+			part->devpath);
+		result = false;
 	}
-	return bgenv_open_by_index(max_idx);
+	return result;
+}
+
+static bool bgenv_write_blob(CONFIG_PART *part, uint32_t id, uint8_t *data,
+			     uint32_t datalen)
+{
+	bool result = true;
+	FILE *blob;
+
+	if (!(blob = open_blob_file(part, id, "wb"))) {
+		VERBOSE(stderr, "Could not create blob file on %s.\n",
+			part->devpath);
+		return false;
+	}
+	if (datalen && fwrite(data, datalen, 1, blob) != 1) {
+		result = false;
+	}
+	if (result && (fflush(blob) || fsync(fileno(blob)))) {
+		result = false;
+	}
+	if (fclose(blob)) {
+		result = false;
+	}
+	if (!result) {
+		VERBOSE(stderr, "Error writing blob file on %s.\n",
+			part->devpath);
+		(void)remove_blob_file(part, id);
+	}
+	return result;
+}
+
+static int bgenv_get_blob(BGENV *env, uint8_t *val, void *data,
+			  uint32_t maxlen)
+{
+	uint8_t *buffer;
+	BLOB_REF ref;
+
+	memcpy(&ref, val, sizeof(BLOB_REF));
+	if (!data) {
+		return ref.size;
+	}
+	if (!env->desc) {
+		return -EIO;
+	}
+	if (!(buffer = malloc(ref.size ? ref.size : 1))) {
+		return -ENOMEM;
+	}
+	if (!bgenv_read_blob((CONFIG_PART *)env->desc, &ref, buffer)) {
+		free(buffer);
+		return -EIO;
+	}
+	memcpy(data, buffer, ref.size < maxlen ? ref.size : maxlen);
+	free(buffer);
+	return 0;
+}
+
+/* A fresh file for every value, the written environment may still refer
+ * to the current one. Get an id above those of all blob files. */
+static bool bgenv_new_blob_id(CONFIG_PART *part, uint32_t *id)
+{
+	uint32_t *ids, count;
+
+	if (!list_blob_files(part, &ids, &count)) {
+		VERBOSE(stderr, "Could not list blob files on %s: %s\n",
+			part->devpath, strerror(errno));
+		return false;
+	}
+	*id = 1;
+	for (uint32_t i = 0; i < count; i++) {
+		if (ids[i] >= *id) {
+			*id = ids[i] + 1;
+		}
+	}
+	free(ids);
+	return true;
+}
+
+static int bgenv_set_blob(BGENV *env, char *key, uint64_t type, void *data,
+			  uint32_t datalen)
+{
+	CONFIG_PART *part = (CONFIG_PART *)env->desc;
+	uint32_t id;
+	BLOB_REF ref;
+	int res = 0;
+
+	if (!part) {
+		return -EIO;
+	}
+	if (!bgenv_blob_mount(part) || !bgenv_new_blob_id(part, &id)) {
+		return -EIO;
+	}
+	if (!bgenv_write_blob(part, id, data, datalen)) {
+		res = -EIO;
+		goto set_blob_out;
+	}
+	ref.id = id;
+	ref.size = datalen;
+	ref.crc32 = crc32(0, data, datalen);
+	res = bgenv_set_uservar(env->data->userdata, key, type, &ref,
+				sizeof(BLOB_REF));
+	if (res) {
+		(void)remove_blob_file(part, id);
+		goto set_blob_out;
+	}
+	env->dirty = true;
+	env->blobs_changed = true;
+
+set_blob_out:
+	return res;
+}
+
+/* Remove blob files no longer referred to by the environment. Only called
+ * after the environment was written, so that a crash leaves the blobs of
+ * the environment on disk intact. */
+static void bgenv_remove_stale_blobs(BGENV *env)
+{
+	CONFIG_PART *part = (CONFIG_PART *)env->desc;
+	uint32_t *ids, *files, num_ids, num_files;
+
+	if (!bgenv_blob_ids(env->data, &ids, &num_ids)) {
+		return;
+	}
+	if (!bgenv_blob_mount(part)) {
+		free(ids);
+		return;
+	}
+	if (!list_blob_files(part, &files, &num_files)) {
+		/* without the list, no file is known to be unreferenced */
+		VERBOSE(stderr, "Could not list blob files on %s: %s\n",
+			part->devpath, strerror(errno));
+		free(ids);
+		return;
+	}
+	for (uint32_t i = 0; i < num_files; i++) {
+		bool referenced = false;
+		for (uint32_t j = 0; j < num_ids && !referenced; j++) {
+			referenced = files[i] == ids[j];
+		}
+		if (!referenced) {
+			(void)remove_blob_file(part, files[i]);
+		}
+	}
+	free(files);
+	free(ids);
+}
+
+/* Copy the blob files of the user variables of dst, which were copied from
+ * src, to fresh files on the config partition of dst */
+bool bgenv_copy_blobs(BGENV *dst, BGENV *src)
+{
+	CONFIG_PART *dst_part, *src_part;
+	uint32_t pos = 0, id = 0, first = 0;
+	uint8_t *var, *val, *buffer;
+	BLOB_REF ref;
+	bool result = true;
+
+	if (!dst || !src || !dst->desc || !src->desc) {
+		return false;
+	}
+	dst_part = (CONFIG_PART *)dst->desc;
+	src_part = (CONFIG_PART *)src->desc;
+	while (result &&
+	       (var = bgenv_iter_uservar(dst->data->userdata, NULL, &pos))) {
+		if (!bgenv_is_blob(var)) {
+			continue;
+		}
+		bgenv_map_uservar(var, NULL, NULL, &val, NULL, NULL);
+		memcpy(&ref, val, sizeof(BLOB_REF));
+		if (!(buffer = malloc(ref.size ? ref.size : 1))) {
+			return false;
+		}
+		result = bgenv_read_blob(src_part, &ref, buffer);
+		if (result && !id) {
+			result = bgenv_blob_mount(dst_part) &&
+				 bgenv_new_blob_id(dst_part, &id);
+			first = id;
+		}
+		if (result) {
+			result = bgenv_write_blob(dst_part, id, buffer,
+						  ref.size);
+		}
+		free(buffer);
+		if (result) {
+			ref.id = id++;
+			memcpy(val, &ref, sizeof(BLOB_REF));
+			bgenv_mark_dirty(dst, val, sizeof(BLOB_REF));
+		}
+	}
+	if (result && first) {
+		dst->dirty = true;
+		/* the copies replace files of blobs dst referred to before */
+		dst->blobs_changed = true;
+	} else if (!result) {
+		/* not referred to by any environment */
+		for (uint32_t i = first; first && i < id; i++) {
+			(void)remove_blob_file(dst_part, i);
+		}
+	}
+	return result;
 }
 
 bool bgenv_write(BGENV *env)
@@ -210,11 +1186,53 @@ bool bgenv_write(BGENV *env)
 		    "Invalid config partition to store environment.\n");
 		return false;
 	}
-	if (!write_env(part, env->data)) {
-		VERBOSE(stderr, "Could not write to %s\n",
+	if (env_unchanged(env->data)) {
+		/* nothing to mount, write or sync */
+		VERBOSE(stdout, "Environment on %s unchanged, not writing.\n",
 			part->devpath);
+		bgenv_skipped_writes++;
+	} else {
+		if (!write_env_dirty(part, env->data) &&
+		    !write_env(part, env->data)) {
+			VERBOSE(stderr, "Could not write to %s\n",
+				part->devpath);
+			/* the file may be partially written */
+			env_remember(env->data, false, false);
+			return false;
+		}
+		env_mark_clean(env->data);
+		env_remember(env->data, true, bgenv_compression);
+	}
+	if (env->blobs_changed) {
+		bgenv_remove_stale_blobs(env);
+		env->blobs_changed = false;
+	}
+	return true;
+}
+
+bool bgenv_set_capacity(BGENV *env, uint32_t capacity)
+{
+	int slot, res;
+
+	slot = env ? env_slot(env->data) : -1;
+	if (slot < 0 || capacity > ENV_MEM_USERVARS) {
+		errno = EINVAL;
+		return false;
+	}
+	res = bgenv_set_uservar_capacity(env->data->userdata,
+					 capacity ? capacity
+						  : ENV_MEM_USERVARS);
+	if (res) {
+		errno = -res;
 		return false;
 	}
+	if (env_capacity[slot] != capacity) {
+		/* the file is rewritten in its new format */
+		env_capacity[slot] = capacity;
+		env_remember(env->data, false, false);
+		bgenv_mark_dirty(env, env->data, sizeof(BG_ENVDATA));
+		env->dirty = true;
+	}
 	return true;
 }
 
@@ -285,14 +1303,22 @@ int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 		return -EPERM;
 	}
 	if (e == EBGENV_UNKNOWN) {
-		if (!data) {
-			uint8_t *u;
-			uint32_t size;
-			u = bgenv_find_uservar(env->data->userdata, key);
-			if (!u) {
-				return -ENOENT;
+		uint8_t *u, *val;
+		uint32_t size;
+		uint64_t utype;
+
+		u = bgenv_find_uservar(env->data->userdata, key);
+		if (!u) {
+			return -ENOENT;
+		}
+		bgenv_map_uservar(u, NULL, &utype, &val, NULL, &size);
+		if (utype & USERVAR_TYPE_BLOB) {
+			if (type) {
+				*type = utype;
 			}
-			bgenv_map_uservar(u, NULL, NULL, NULL, NULL, &size);
+			return bgenv_get_blob(env, val, data, maxlen);
+		}
+		if (!data) {
 			return size;
 		}
 		return bgenv_get_uservar(env->data->userdata, key, type, data,
@@ -353,6 +1379,8 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 	int val;
 	char *p;
 	char *value = (char *)data;
+	void *field;
+	uint32_t size;
 
 	if (!key || !data || datalen == 0) {
 		return -EINVAL;
@@ -363,8 +1391,20 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 		return -EPERM;
 	}
 	if (e == EBGENV_UNKNOWN) {
-		return bgenv_set_uservar(env->data->userdata, key, type, data,
-					 datalen);
+		if (bgenv_is_blob(bgenv_find_uservar(env->data->userdata,
+						     key))) {
+			env->blobs_changed = true;
+		}
+		if ((type & (USERVAR_TYPE_BLOB | USERVAR_TYPE_DELETED)) ==
+		    USERVAR_TYPE_BLOB) {
+			return bgenv_set_blob(env, key, type, data, datalen);
+		}
+		int res = bgenv_set_uservar(env->data->userdata, key, type,
+					    data, datalen);
+		if (res == 0) {
+			env->dirty = true;
+		}
+		return res;
 	}
 	switch (e) {
 	case EBGENV_REVISION:
@@ -373,12 +1413,18 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 			return val;
 		}
 		env->data->revision = val;
+		field = &env->data->revision;
+		size = sizeof(env->data->revision);
 		break;
 	case EBGENV_KERNELFILE:
 		str8to16(env->data->kernelfile, value);
+		field = env->data->kernelfile;
+		size = sizeof(env->data->kernelfile);
 		break;
 	case EBGENV_KERNELPARAMS:
 		str8to16(env->data->kernelparams, value);
+		field = env->data->kernelparams;
+		size = sizeof(env->data->kernelparams);
 		break;
 	case EBGENV_WATCHDOG_TIMEOUT_SEC:
 		val = bgenv_convert_to_long(value);
@@ -386,6 +1432,8 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 			return val;
 		}
 		env->data->watchdog_timeout_sec = val;
+		field = &env->data->watchdog_timeout_sec;
+		size = sizeof(env->data->watchdog_timeout_sec);
 		break;
 	case EBGENV_USTATE:
 		val = bgenv_convert_to_long(value);
@@ -393,6 +1441,8 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 			return val;
 		}
 		env->data->ustate = val;
+		field = &env->data->ustate;
+		size = sizeof(env->data->ustate);
 		break;
 	case EBGENV_IN_PROGRESS:
 		val = bgenv_convert_to_long(value);
@@ -400,10 +1450,99 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 			return val;
 		}
 		env->data->in_progress = val;
+		field = &env->data->in_progress;
+		size = sizeof(env->data->in_progress);
 		break;
 	default:
 		return -EINVAL;
 	}
+	bgenv_mark_dirty(env, field, size);
+	env->dirty = true;
+	return 0;
+}
+
+int bgenv_get_view(BGENV *env, char *key, uint64_t *type, uint8_t **value,
+		   uint32_t *datalen, bool writable)
+{
+	uint8_t *var;
+	uint32_t rsize;
+
+	if (!key || !value) {
+		return -EINVAL;
+	}
+	if (!env) {
+		return -EPERM;
+	}
+	/* pre-defined variables are not stored as user variables */
+	if (bgenv_str2enum(key) != EBGENV_UNKNOWN) {
+		return -EINVAL;
+	}
+	var = bgenv_find_uservar(env->data->userdata, key);
+	if (!var) {
+		return -ENOENT;
+	}
+	/* blob values are not kept in memory */
+	if (bgenv_is_blob(var)) {
+		return -EINVAL;
+	}
+	bgenv_map_uservar(var, NULL, type, value, &rsize, datalen);
+	if (writable) {
+		/* the caller changes the value behind our back */
+		bgenv_mark_uservar_dirty(env->data->userdata, var, rsize);
+		env->dirty = true;
+	}
+	return 0;
+}
+
+int bgenv_set_many(BGENV *env, ebgenv_var_t *vars, uint32_t count)
+{
+	ebgenv_var_t *uservars;
+	uint32_t num_uservars = 0;
+	int res;
+
+	if (!vars && count) {
+		return -EINVAL;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (!vars[i].key || !vars[i].value || vars[i].datalen == 0) {
+			return -EINVAL;
+		}
+	}
+	if (!env) {
+		return -EPERM;
+	}
+	uservars = calloc(count ? count : 1, sizeof(ebgenv_var_t));
+	if (!uservars) {
+		return -ENOMEM;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (bgenv_str2enum(vars[i].key) == EBGENV_UNKNOWN &&
+		    !(vars[i].type & USERVAR_TYPE_BLOB)) {
+			if (bgenv_is_blob(bgenv_find_uservar(
+				env->data->userdata, vars[i].key))) {
+				env->blobs_changed = true;
+			}
+			uservars[num_uservars++] = vars[i];
+		}
+	}
+	/* user variables first, they are applied as a whole or not at all */
+	res = bgenv_set_uservars(env->data->userdata, uservars, num_uservars);
+	free(uservars);
+	if (res) {
+		return res;
+	}
+	env->dirty = true;
+	for (uint32_t i = 0; i < count; i++) {
+		if (bgenv_str2enum(vars[i].key) == EBGENV_UNKNOWN &&
+		    !(vars[i].type & USERVAR_TYPE_BLOB)) {
+			continue;
+		}
+		res = bgenv_set(env, vars[i].key, vars[i].type, vars[i].value,
+				vars[i].datalen);
+		if (res) {
+			return res;
+		}
+	}
 	return 0;
 }
 
@@ -435,6 +1574,9 @@ BGENV *bgenv_create_new(void)
 	env_new->data->in_progress = 1;
 	/* set default watchdog timeout */
 	env_new->data->watchdog_timeout_sec = 30;
+	(void)bgenv_build_uservar_index(env_new->data->userdata);
+	bgenv_mark_dirty(env_new, env_new->data, sizeof(BG_ENVDATA));
+	env_new->dirty = true;
 
 	return env_new;
 
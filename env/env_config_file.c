@@ -14,9 +14,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
+#include <dirent.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 #include "env_config_file.h"
+#include "env_fat_raw.h"
 
 FILE *open_config_file(CONFIG_PART *cfgpart, char *mode)
 {
@@ -40,6 +43,90 @@ FILE *open_config_file(CONFIG_PART *cfgpart, char *mode)
 	return config;
 }
 
+static char *blob_file_path(CONFIG_PART *cfgpart, uint32_t id)
+{
+	char *path;
+
+	if (!cfgpart || !cfgpart->mountpoint) {
+		return NULL;
+	}
+	if (asprintf(&path, "%s/" BLOB_FILENAME_FORMAT, cfgpart->mountpoint,
+		     id) < 0) {
+		return NULL;
+	}
+	return path;
+}
+
+FILE *open_blob_file(CONFIG_PART *cfgpart, uint32_t id, char *mode)
+{
+	char *path;
+	FILE *blob;
+
+	if (!(path = blob_file_path(cfgpart, id))) {
+		return NULL;
+	}
+	VERBOSE(stdout, "Opening blob file %s.\n", path);
+	blob = fopen(path, mode);
+	free(path);
+	return blob;
+}
+
+int remove_blob_file(CONFIG_PART *cfgpart, uint32_t id)
+{
+	char *path;
+	int result;
+
+	if (!(path = blob_file_path(cfgpart, id))) {
+		return -ENOMEM;
+	}
+	VERBOSE(stdout, "Removing blob file %s.\n", path);
+	result = remove(path) ? -errno : 0;
+	free(path);
+	return result;
+}
+
+bool list_blob_files(CONFIG_PART *cfgpart, uint32_t **ids, uint32_t *count)
+{
+	DIR *dir;
+	struct dirent *entry;
+	uint32_t *tmp, size = 0, id;
+	char name[sizeof("00000000.BLB")];
+
+	*ids = NULL;
+	*count = 0;
+	if (!cfgpart || !cfgpart->mountpoint) {
+		errno = EINVAL;
+		return false;
+	}
+	if (!(dir = opendir(cfgpart->mountpoint))) {
+		return false;
+	}
+	while ((entry = readdir(dir))) {
+		/* FAT does not preserve the case of short names */
+		if (strlen(entry->d_name) != sizeof(name) - 1 ||
+		    sscanf(entry->d_name, "%8X.%3s", &id, name) != 2 ||
+		    strcasecmp(name, "BLB") != 0) {
+			continue;
+		}
+		if (*count == size) {
+			size = size ? size * 2 : 16;
+			tmp = realloc(*ids, size * sizeof(uint32_t));
+			if (!tmp) {
+				free(*ids);
+				*ids = NULL;
+				closedir(dir);
+				*count = 0;
+				errno = ENOMEM;
+				return false;
+			}
+			*ids = tmp;
+		}
+		(*ids)[(*count)++] = id;
+	}
+	closedir(dir);
+	return true;
+}
+
 int close_config_file(FILE *config_file_handle)
 {
 	if (config_file_handle) {
@@ -60,12 +147,22 @@ bool probe_config_file(CONFIG_PART *cfgpart)
 		cfgpart->not_mounted = true;
 		VERBOSE(stdout, "Partition %s is not mounted.\n",
 			cfgpart->devpath);
+		if (bgenv_raw_io) {
+			/* look for the file without mounting, partitions
+			 * mounted by the system are still accessed through
+			 * their mount to stay coherent with its cache */
+			cfgpart->raw = true;
+			return fat_raw_probe_file(cfgpart->devpath,
+						  FAT_ENV_FILENAME, NULL);
+		}
 		if (!mount_partition(cfgpart)) {
 			return false;
 		}
-		do_unmount = true;
+		/* only mounts made here are undone */
+		do_unmount = cfgpart->not_mounted;
 	} else {
 		cfgpart->not_mounted = false;
+		cfgpart->raw = false;
 	}
 
 	if (cfgpart->mountpoint) {
@@ -87,7 +184,9 @@ bool probe_config_file(CONFIG_PART *cfgpart)
 						cfgpart->devpath);
 			}
 		}
-		if (do_unmount) {
+		/* keep the mount of a config partition for reading and writing
+		 * the environment later on */
+		if (do_unmount && !result) {
 			unmount_partition(cfgpart);
 		}
 		return result;
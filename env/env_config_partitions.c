@@ -12,21 +12,271 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <sys/sysmacros.h>
+#include <libgen.h>
 #include "env_api.h"
 #include "ebgpart.h"
 #include "env_config_partitions.h"
 #include "env_config_file.h"
+#include "env_disk_utils.h"
+
+#define DISCOVERY_CACHE_MAGIC "EBGCACHE 3"
+
+char *bgenv_discovery_cache = ENV_DISCOVERY_CACHE;
+const char *uevent_seqnum_path = "/sys/kernel/uevent_seqnum";
+
+void bgenv_use_discovery_cache(char *path)
+{
+	bgenv_discovery_cache = path;
+}
+
+/* Environment files created on partitions change no device, so whoever
+ * creates them has to drop the cache */
+void bgenv_drop_discovery_cache(void)
+{
+	if (bgenv_discovery_cache && *bgenv_discovery_cache &&
+	    unlink(bgenv_discovery_cache) && errno != ENOENT) {
+		VERBOSE(stderr, "Could not remove %s.\n",
+			bgenv_discovery_cache);
+	}
+}
+
+/* A config partition as found by a full scan. It is identified by its
+ * device number, the UUID of the partition and the sequence number of its
+ * disk, which changes when the medium does. */
+typedef struct {
+	char devpath[4096];
+	char disk[4096];
+	uint16_t num;
+	char uuid[PART_UUID_LEN];
+	dev_t rdev;
+	unsigned long long diskseq;
+} DISCOVERY_ENTRY;
+
+static DISCOVERY_ENTRY discovered[ENV_NUM_CONFIG_PARTS];
+
+/* uevent sequence number before the last full scan */
+static unsigned long long discovery_seqnum;
+
+/* 0 if the kernel does not provide disk sequence numbers */
+static unsigned long long disk_sequence(dev_t disk)
+{
+	unsigned long long seq = 0;
+	char path[64];
+	FILE *f;
+
+	(void)snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/diskseq",
+		       major(disk), minor(disk));
+	if ((f = fopen(path, "r"))) {
+		if (fscanf(f, "%llu", &seq) != 1) {
+			seq = 0;
+		}
+		(void)fclose(f);
+	}
+	return seq;
+}
+
+/* Fill in the device number and disk sequence number of entry */
+static bool discovery_identify(DISCOVERY_ENTRY *entry)
+{
+	struct stat st_part, st_disk;
+
+	if (stat(entry->devpath, &st_part) || !S_ISBLK(st_part.st_mode) ||
+	    stat(entry->disk, &st_disk) || !S_ISBLK(st_disk.st_mode)) {
+		return false;
+	}
+	entry->rdev = st_part.st_rdev;
+	entry->diskseq = disk_sequence(st_disk.st_rdev);
+	return true;
+}
+
+static bool discovery_valid(DISCOVERY_ENTRY *cached)
+{
+	DISCOVERY_ENTRY now = *cached;
+
+	if (!discovery_identify(&now) || now.rdev != cached->rdev ||
+	    now.diskseq != cached->diskseq ||
+	    !ped_partition_get_uuid(cached->disk, cached->num, now.uuid)) {
+		return false;
+	}
+	return strcmp(now.uuid, cached->uuid) == 0;
+}
+
+/* Sequence number of the last uevent, counting every block device and
+ * partition the kernel added, removed or changed. Once it changes, a disk
+ * with another config partition may have shown up, which only a full scan
+ * detects. 0 if unknown. */
+static unsigned long long uevent_seqnum(void)
+{
+	unsigned long long seq = 0;
+	FILE *f;
+
+	if ((f = fopen(uevent_seqnum_path, "r"))) {
+		if (fscanf(f, "%llu", &seq) != 1) {
+			seq = 0;
+		}
+		(void)fclose(f);
+	}
+	return seq;
+}
+
+static void discovery_reset(CONFIG_PART *cfgpart, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (cfgpart[i].not_mounted) {
+			unmount_partition(&cfgpart[i]);
+		}
+		free(cfgpart[i].mountpoint);
+		free(cfgpart[i].devpath);
+		memset(&cfgpart[i], 0, sizeof(CONFIG_PART));
+	}
+}
+
+/* Take the config partitions from the cache if every one of them is still
+ * the partition found by the last full scan and holds an environment.
+ * Otherwise, the cache is removed. */
+static bool discovery_cache_load(CONFIG_PART *cfgpart)
+{
+	DISCOVERY_ENTRY *e = discovered;
+	unsigned long long rdev;
+	char magic[16];
+	struct stat st;
+	unsigned long long seqnum;
+	int count = 0, n;
+	FILE *cache;
+
+	if (!bgenv_discovery_cache || !*bgenv_discovery_cache ||
+	    !(cache = fopen(bgenv_discovery_cache, "r"))) {
+		return false;
+	}
+	/* only trust a cache no other user could have written */
+	if (fstat(fileno(cache), &st) ||
+	    (st.st_uid != 0 && st.st_uid != geteuid()) ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    !fgets(magic, sizeof(magic), cache) ||
+	    strncmp(magic, DISCOVERY_CACHE_MAGIC,
+		    strlen(DISCOVERY_CACHE_MAGIC)) != 0 ||
+	    fscanf(cache, "%d %llu", &n, &seqnum) != 2 ||
+	    n != ENV_NUM_CONFIG_PARTS) {
+		goto cache_load_invalid;
+	}
+	if (seqnum != uevent_seqnum()) {
+		VERBOSE(stdout, "Block devices changed since caching config "
+				"partitions.\n");
+		goto cache_load_invalid;
+	}
+	for (count = 0; count < ENV_NUM_CONFIG_PARTS; count++, e++) {
+		if (fscanf(cache, "%4095s %4095s %hu %llx %36s %llu",
+			   e->devpath, e->disk, &e->num, &rdev, e->uuid,
+			   &e->diskseq) != 6) {
+			goto cache_load_invalid;
+		}
+		e->rdev = rdev;
+		if (!discovery_valid(e)) {
+			VERBOSE(stdout, "Cached config partition %s changed.\n",
+				e->devpath);
+			goto cache_load_invalid;
+		}
+	}
+	(void)fclose(cache);
+	cache = NULL;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!(cfgpart[i].devpath = strdup(discovered[i].devpath)) ||
+		    !probe_config_file(&cfgpart[i])) {
+			goto cache_load_invalid;
+		}
+	}
+	VERBOSE(stdout, "Using cached config partitions.\n");
+	return true;
+
+cache_load_invalid:
+	if (cache) {
+		(void)fclose(cache);
+	}
+	discovery_reset(cfgpart, ENV_NUM_CONFIG_PARTS);
+	(void)unlink(bgenv_discovery_cache);
+	return false;
+}
+
+/* Replace the cache atomically, failures only cost the next full scan */
+static void discovery_cache_store(void)
+{
+	char *tmpname = NULL, *dir;
+	FILE *cache = NULL;
+	int fd;
+
+	if (!bgenv_discovery_cache || !*bgenv_discovery_cache) {
+		return;
+	}
+	/* devices added during the scan may have been missed */
+	if (!discovery_seqnum || discovery_seqnum != uevent_seqnum()) {
+		return;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!discovery_identify(&discovered[i])) {
+			return;
+		}
+		/* could not be checked when loading the cache */
+		if (!discovered[i].uuid[0]) {
+			VERBOSE(stdout, "No UUID of %s, not caching config "
+					"partitions.\n",
+				discovered[i].devpath);
+			return;
+		}
+	}
+	if (asprintf(&tmpname, "%s.XXXXXX", bgenv_discovery_cache) == -1) {
+		return;
+	}
+	dir = dirname(strdupa(bgenv_discovery_cache));
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		goto cache_store_out;
+	}
+	if ((fd = mkstemp(tmpname)) < 0) {
+		goto cache_store_out;
+	}
+	if (fchmod(fd, 0644) || !(cache = fdopen(fd, "w"))) {
+		close(fd);
+		goto cache_store_error;
+	}
+	fprintf(cache, "%s\n%d %llu\n", DISCOVERY_CACHE_MAGIC,
+		ENV_NUM_CONFIG_PARTS, discovery_seqnum);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		DISCOVERY_ENTRY *e = &discovered[i];
+
+		fprintf(cache, "%s %s %u %llx %s %llu\n", e->devpath, e->disk,
+			e->num, (unsigned long long)e->rdev, e->uuid,
+			e->diskseq);
+	}
+	if (fclose(cache) || rename(tmpname, bgenv_discovery_cache)) {
+		goto cache_store_error;
+	}
+	free(tmpname);
+	return;
+
+cache_store_error:
+	(void)unlink(tmpname);
+cache_store_out:
+	VERBOSE(stderr, "Could not cache config partitions in %s.\n",
+		bgenv_discovery_cache);
+	free(tmpname);
+}
 
 bool probe_config_partitions(CONFIG_PART *cfgpart)
 {
+	CONFIG_PART extra = {0}, *candidate;
+	DISCOVERY_ENTRY *found;
 	PedDevice *dev = NULL;
-	char devpath[4096];
 	int count = 0;
 
 	if (!cfgpart) {
 		return false;
 	}
 
+	if (discovery_cache_load(cfgpart)) {
+		return true;
+	}
+
+	discovery_seqnum = uevent_seqnum();
 	ped_device_probe_all();
 
 	while ((dev = ped_device_get_next(dev))) {
@@ -37,49 +287,63 @@ bool probe_config_partitions(CONFIG_PART *cfgpart)
 		}
 		PedPartition *part = pd->part_list;
 		while (part) {
-			if (!part->fs_type || !part->fs_type->name ||
+			if (!part->path ||
+			    !part->fs_type || !part->fs_type->name ||
 			    (strcmp(part->fs_type->name, "fat12") != 0 &&
 			     strcmp(part->fs_type->name, "fat16") != 0 &&
 			     strcmp(part->fs_type->name, "fat32") != 0)) {
 				part = ped_disk_next_partition(pd, part);
 				continue;
 			}
-			if (strncmp("/dev/mmcblk", dev->path, 11) == 0) {
-				(void)snprintf(devpath, 4096, "%sp%u",
-					       dev->path, part->num);
-			} else {
-				(void)snprintf(devpath, 4096, "%s%u",
-					       dev->path, part->num);
+			/* all config partitions found, any further one is
+			 * probed to detect an error */
+			candidate = count < ENV_NUM_CONFIG_PARTS
+					    ? &cfgpart[count]
+					    : &extra;
+			/* a path of a partition without environment may be
+			 * shorter */
+			free(candidate->devpath);
+			candidate->devpath = strdup(part->path);
+			if (!candidate->devpath) {
+				VERBOSE(stderr, "Out of memory.");
+				return false;
 			}
-			if (!cfgpart[count].devpath) {
-				cfgpart[count].devpath =
-				    malloc(strlen(devpath) + 1);
-				if (!cfgpart[count].devpath) {
-					VERBOSE(stderr, "Out of memory.");
-					return false;
-				}
-			}
-			strncpy(cfgpart[count].devpath, devpath,
-				strlen(devpath) + 1);
-			if (probe_config_file(&cfgpart[count])) {
+			if (probe_config_file(candidate)) {
 				printf_debug("%s", "Environment file found.\n");
 				if (count >= ENV_NUM_CONFIG_PARTS) {
 					VERBOSE(stderr, "Error, there are "
 							"more than %d config "
 							"partitions.\n",
 						ENV_NUM_CONFIG_PARTS);
+					discovery_reset(&extra, 1);
 					return false;
 				}
+				found = &discovered[count];
+				(void)snprintf(found->devpath,
+					       sizeof(found->devpath), "%s",
+					       part->path);
+				(void)snprintf(found->disk, sizeof(found->disk),
+					       "%s", dev->path);
+				found->num = part->num;
+				strcpy(found->uuid, part->uuid);
+				/* not known for partitions listed by the
+				 * kernel */
+				if (!found->uuid[0]) {
+					(void)ped_partition_get_uuid(
+					    dev->path, part->num, found->uuid);
+				}
 				count++;
 			}
 			part = ped_disk_next_partition(pd, part);
 		}
 	}
+	free(extra.devpath);
 	if (count < ENV_NUM_CONFIG_PARTS) {
 		VERBOSE(stderr,
 			"Error, less than %d config partitions exist.\n",
 			ENV_NUM_CONFIG_PARTS);
 		return false;
 	}
+	discovery_cache_store();
 	return true;
 }
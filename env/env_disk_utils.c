@@ -13,40 +13,170 @@
  */
 
 #include <stdlib.h>
-#include <mntent.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 
 const char *tmp_mnt_dir = "/tmp/mnt-XXXXXX";
+const char *mountinfo_path = "/proc/self/mountinfo";
 
-char *get_mountpoint(char *devpath)
+/* Mounts of the system, taken once per session and looked up by device
+ * number, so that every alias of a device node finds them. Only mounts of
+ * the root of a file system are kept, the first one of each device. */
+typedef struct {
+	dev_t dev;
+	char *dir;		/* NULL for a free slot */
+} MOUNT_ENTRY;
+
+static MOUNT_ENTRY *mount_table;
+static uint32_t mount_table_size;	/* power of two */
+static uint32_t mount_table_used;	/* kept below half of the size */
+static bool mount_table_valid;
+static pthread_mutex_t mount_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static MOUNT_ENTRY *mount_table_slot(dev_t dev)
 {
-	struct mntent *part;
-	FILE *mtab;
+	uint32_t i = (major(dev) * 31 + minor(dev)) & (mount_table_size - 1);
 
-	mtab = setmntent("/proc/mounts", "r");
-	if (!mtab) {
-		return NULL;
+	while (mount_table[i].dir && mount_table[i].dev != dev) {
+		i = (i + 1) & (mount_table_size - 1);
+	}
+	return &mount_table[i];
+}
+
+/* Double the size of the table, so that probing always ends at a free slot
+ * however many mounts show up while reading mountinfo */
+static bool mount_table_grow(void)
+{
+	MOUNT_ENTRY *old = mount_table, *slot;
+	uint32_t old_size = mount_table_size;
+
+	mount_table_size = old_size ? old_size * 2 : 16;
+	if (!(mount_table = calloc(mount_table_size, sizeof(MOUNT_ENTRY)))) {
+		mount_table = old;
+		mount_table_size = old_size;
+		return false;
+	}
+	for (uint32_t i = 0; i < old_size; i++) {
+		if (old[i].dir) {
+			slot = mount_table_slot(old[i].dev);
+			*slot = old[i];
+		}
+	}
+	free(old);
+	return true;
+}
+
+/* Undo the octal escapes of spaces and other characters in mountinfo */
+static void mountinfo_unescape(char *s)
+{
+	char *out = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*out++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 |
+				 (s[3] - '0');
+			s += 4;
+		} else {
+			*out++ = *s++;
+		}
+	}
+	*out = 0;
+}
+
+static void mount_table_build(void)
+{
+	char *line = NULL, *root, *dir;
+	unsigned int maj, min;
+	size_t len = 0;
+	MOUNT_ENTRY *slot;
+	FILE *info;
+
+	mount_table_valid = true;
+	if (!(info = fopen(mountinfo_path, "r"))) {
+		return;
 	}
+	mount_table_used = 0;
+	while (getline(&line, &len, info) != -1) {
+		if (sscanf(line, "%*u %*u %u:%u %ms %ms", &maj, &min, &root,
+			   &dir) != 4) {
+			continue;
+		}
+		if (2 * (mount_table_used + 1) > mount_table_size &&
+		    !mount_table_grow()) {
+			free(root);
+			free(dir);
+			break;
+		}
+		slot = mount_table_slot(makedev(maj, min));
+		if (strcmp(root, "/") == 0 && !slot->dir) {
+			mountinfo_unescape(dir);
+			slot->dev = makedev(maj, min);
+			slot->dir = dir;
+			mount_table_used++;
+		} else {
+			free(dir);
+		}
+		free(root);
+	}
+	free(line);
+	fclose(info);
+}
 
-	while ((part = getmntent(mtab)) != NULL) {
-		if ((part->mnt_fsname != NULL) &&
-		    (strcmp(part->mnt_fsname, devpath)) == 0) {
-			char *mntpoint;
+/* Start a new session, the next lookup takes a new snapshot */
+void mount_table_release(void)
+{
+	pthread_mutex_lock(&mount_table_lock);
+	for (uint32_t i = 0; mount_table && i < mount_table_size; i++) {
+		free(mount_table[i].dir);
+	}
+	free(mount_table);
+	mount_table = NULL;
+	mount_table_size = 0;
+	mount_table_used = 0;
+	mount_table_valid = false;
+	pthread_mutex_unlock(&mount_table_lock);
+}
+
+char *get_mountpoint(char *devpath)
+{
+	char *mntpoint = NULL;
+	MOUNT_ENTRY *slot;
+	struct stat st;
 
-			mntpoint = malloc(strlen(part->mnt_dir) + 1);
-			if (!mntpoint) {
-				break;
-			}
-			strncpy(mntpoint, part->mnt_dir,
-				strlen(part->mnt_dir) + 1);
-			return mntpoint;
+	if (stat(devpath, &st) || !S_ISBLK(st.st_mode)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&mount_table_lock);
+	if (!mount_table_valid) {
+		mount_table_build();
+	}
+	if (mount_table) {
+		slot = mount_table_slot(st.st_rdev);
+		if (slot->dir) {
+			mntpoint = strdup(slot->dir);
 		}
 	}
-	endmntent(mtab);
+	pthread_mutex_unlock(&mount_table_lock);
+	return mntpoint;
+}
+
+static pthread_once_t release_at_exit_once = PTHREAD_ONCE_INIT;
+
+static void release_mounts_at_exit(void)
+{
+	bgenv_release_mounts();
+}
 
-	return NULL;
+static void register_release_at_exit(void)
+{
+	if (atexit(release_mounts_at_exit)) {
+		VERBOSE(stderr, "Error registering release of temporary "
+				"mounts.\n");
+	}
 }
 
 bool mount_partition(CONFIG_PART *cfgpart)
@@ -60,6 +190,15 @@ bool mount_partition(CONFIG_PART *cfgpart)
 	if (!cfgpart->devpath) {
 		return false;
 	}
+	if (cfgpart->mountpoint) {
+		/* temporary mounts are kept until bgenv_release_mounts */
+		return true;
+	}
+	if ((cfgpart->mountpoint = get_mountpoint(cfgpart->devpath))) {
+		/* a mount of the system is used as it is */
+		cfgpart->not_mounted = false;
+		return true;
+	}
 	if (!(mountpoint = mkdtemp(tmpdir_template))) {
 		VERBOSE(stderr, "Error creating temporary mount point.\n");
 		return false;
@@ -78,6 +217,10 @@ bool mount_partition(CONFIG_PART *cfgpart)
 		return false;
 	}
 	strncpy(cfgpart->mountpoint, mountpoint, strlen(mountpoint) + 1);
+	/* mounts left behind by tools not closing the environment are
+	 * released when the program exits */
+	cfgpart->mount_owner = getpid();
+	(void)pthread_once(&release_at_exit_once, register_release_at_exit);
 	return true;
 }
 
@@ -89,6 +232,10 @@ void unmount_partition(CONFIG_PART *cfgpart)
 	if (!cfgpart->mountpoint) {
 		return;
 	}
+	if (cfgpart->mount_owner != getpid()) {
+		/* a forked process leaves the mounts of its parent alone */
+		return;
+	}
 	if (umount(cfgpart->mountpoint)) {
 		VERBOSE(stderr, "Error unmounting temporary mountpoint %s.\n",
 			cfgpart->mountpoint);
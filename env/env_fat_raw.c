@@ -0,0 +1,427 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Minimal FAT12/16/32 access for files in the root directory of a raw
+ * partition. Files are only read and rewritten in place within their
+ * cluster chain, nothing is ever allocated, so neither the FAT nor the
+ * directory is modified.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <endian.h>
+#include "env_api.h"
+#include "env_fat_raw.h"
+
+#define FAT_DIRENT_SIZE 32
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_LONG_NAME 0x0F
+#define FAT_DIRENT_FREE 0xE5
+
+static uint16_t get_le16(uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static uint32_t get_le32(uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static bool fat_raw_io(int fd, void *buffer, uint32_t len, uint64_t offset,
+		       bool write)
+{
+	uint8_t *p = buffer;
+	ssize_t n;
+
+	while (len) {
+		if (write) {
+			n = pwrite(fd, p, len, offset);
+		} else {
+			n = pread(fd, p, len, offset);
+		}
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		offset += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool fat_raw_parse_bpb(FAT_RAW *fs, uint8_t *bpb)
+{
+	uint32_t sector_size, sectors_per_cluster, reserved, num_fats;
+	uint32_t root_entries, total_sectors, fat_sectors, root_sectors;
+	uint32_t data_sectors;
+
+	if ((bpb[0] != 0xEB && bpb[0] != 0xE9) || bpb[510] != 0x55 ||
+	    bpb[511] != 0xAA) {
+		return false;
+	}
+	sector_size = get_le16(bpb + 11);
+	sectors_per_cluster = bpb[13];
+	reserved = get_le16(bpb + 14);
+	num_fats = bpb[16];
+	root_entries = get_le16(bpb + 17);
+	total_sectors = get_le16(bpb + 19);
+	if (!total_sectors) {
+		total_sectors = get_le32(bpb + 32);
+	}
+	fat_sectors = get_le16(bpb + 22);
+	if (!fat_sectors) {
+		fat_sectors = get_le32(bpb + 36);
+	}
+	if (sector_size < 512 || sector_size > 4096 ||
+	    (sector_size & (sector_size - 1)) || !sectors_per_cluster ||
+	    (sectors_per_cluster & (sectors_per_cluster - 1)) || !reserved ||
+	    !num_fats || !fat_sectors) {
+		return false;
+	}
+	root_sectors = (root_entries * FAT_DIRENT_SIZE + sector_size - 1) /
+		       sector_size;
+	if ((uint64_t)reserved + (uint64_t)num_fats * fat_sectors +
+		root_sectors >= total_sectors) {
+		return false;
+	}
+	data_sectors = total_sectors - reserved - num_fats * fat_sectors -
+		       root_sectors;
+
+	fs->cluster_size = sector_size * sectors_per_cluster;
+	fs->num_clusters = data_sectors / sectors_per_cluster;
+	/* the type is determined by the number of clusters only */
+	if (fs->num_clusters < 4085) {
+		fs->type = 12;
+	} else if (fs->num_clusters < 65525) {
+		fs->type = 16;
+	} else {
+		fs->type = 32;
+	}
+	fs->fat_offset = (uint64_t)reserved * sector_size;
+	fs->fat_bytes = fat_sectors * sector_size;
+	fs->root_offset = fs->fat_offset + (uint64_t)num_fats * fs->fat_bytes;
+	fs->root_bytes = root_entries * FAT_DIRENT_SIZE;
+	fs->root_cluster = fs->type == 32 ? get_le32(bpb + 44) : 0;
+	fs->data_offset = fs->root_offset + (uint64_t)root_sectors *
+					    sector_size;
+	if (fs->type == 32 && root_entries) {
+		return false;
+	}
+	if ((uint64_t)(fs->num_clusters + 2) * fs->type / 8 > fs->fat_bytes) {
+		return false;
+	}
+	return true;
+}
+
+bool fat_raw_open(FAT_RAW *fs, char *devpath, bool writable)
+{
+	uint8_t bpb[512];
+
+	memset(fs, 0, sizeof(FAT_RAW));
+	fs->fd = open(devpath, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fs->fd < 0) {
+		VERBOSE(stderr, "Error opening %s: %s\n", devpath,
+			strerror(errno));
+		return false;
+	}
+	if (!fat_raw_io(fs->fd, bpb, sizeof(bpb), 0, false) ||
+	    !fat_raw_parse_bpb(fs, bpb)) {
+		VERBOSE(stderr, "No FAT file system on %s.\n", devpath);
+		close(fs->fd);
+		fs->fd = -1;
+		return false;
+	}
+	return true;
+}
+
+void fat_raw_close(FAT_RAW *fs)
+{
+	if (fs->fd >= 0) {
+		close(fs->fd);
+		fs->fd = -1;
+	}
+}
+
+static bool fat_raw_valid_cluster(FAT_RAW *fs, uint32_t cluster)
+{
+	return cluster >= 2 && cluster < fs->num_clusters + 2;
+}
+
+/* Get the next cluster of a chain, false at the end of the chain or for
+ * invalid entries. */
+static bool fat_raw_next_cluster(FAT_RAW *fs, uint32_t cluster,
+				 uint32_t *next)
+{
+	uint32_t offset, len, value;
+
+	offset = fs->type == 12 ? cluster + cluster / 2 : cluster * fs->type / 8;
+	len = fs->type == 32 ? 4 : 2;
+	if (offset + len > fs->fat_bytes) {
+		return false;
+	}
+	if (offset < fs->cache_start ||
+	    offset + len > fs->cache_start + fs->cache_len) {
+		fs->cache_start = offset;
+		fs->cache_len = fs->fat_bytes - offset;
+		if (fs->cache_len > sizeof(fs->cache)) {
+			fs->cache_len = sizeof(fs->cache);
+		}
+		if (!fat_raw_io(fs->fd, fs->cache, fs->cache_len,
+				fs->fat_offset + offset, false)) {
+			fs->cache_len = 0;
+			return false;
+		}
+	}
+	offset -= fs->cache_start;
+	switch (fs->type) {
+	case 12:
+		value = get_le16(fs->cache + offset);
+		value = cluster & 1 ? value >> 4 : value & 0x0FFF;
+		break;
+	case 16:
+		value = get_le16(fs->cache + offset);
+		break;
+	default:
+		value = get_le32(fs->cache + offset) & 0x0FFFFFFF;
+		break;
+	}
+	if (!fat_raw_valid_cluster(fs, value)) {
+		return false;
+	}
+	*next = value;
+	return true;
+}
+
+static uint64_t fat_raw_cluster_offset(FAT_RAW *fs, uint32_t cluster)
+{
+	return fs->data_offset + (uint64_t)(cluster - 2) * fs->cluster_size;
+}
+
+/* Transfer the first len bytes of a cluster chain, merging runs of
+ * contiguous clusters into one pread or pwrite. */
+static bool fat_raw_transfer(FAT_RAW *fs, uint32_t cluster, uint8_t *buffer,
+			     uint32_t len, bool write)
+{
+	uint32_t start, bytes, chunk, next, steps = 0;
+
+	while (len) {
+		start = cluster;
+		bytes = 0;
+		for (;;) {
+			if (!fat_raw_valid_cluster(fs, cluster) ||
+			    steps++ > fs->num_clusters) {
+				return false;
+			}
+			chunk = len - bytes < fs->cluster_size
+					? len - bytes
+					: fs->cluster_size;
+			bytes += chunk;
+			if (bytes == len) {
+				break;
+			}
+			if (!fat_raw_next_cluster(fs, cluster, &next)) {
+				return false;
+			}
+			cluster = next;
+			if (cluster != start + bytes / fs->cluster_size) {
+				break;
+			}
+		}
+		if (!fat_raw_io(fs->fd, buffer, bytes,
+				fat_raw_cluster_offset(fs, start), write)) {
+			return false;
+		}
+		buffer += bytes;
+		len -= bytes;
+	}
+	return true;
+}
+
+/* Convert a file name to the padded upper case 8.3 form of directory
+ * entries. */
+static bool fat_raw_short_name(char *name, uint8_t *short_name)
+{
+	char *dot = strchr(name, '.');
+	size_t base, ext;
+
+	base = dot ? (size_t)(dot - name) : strlen(name);
+	ext = dot ? strlen(dot + 1) : 0;
+	if (!base || base > 8 || ext > 3 || (dot && strchr(dot + 1, '.'))) {
+		return false;
+	}
+	memset(short_name, ' ', 11);
+	for (size_t i = 0; i < base; i++) {
+		short_name[i] = toupper((unsigned char)name[i]);
+	}
+	for (size_t i = 0; i < ext; i++) {
+		short_name[8 + i] = toupper((unsigned char)dot[1 + i]);
+	}
+	return true;
+}
+
+/* Search count directory entries, returns 1 if found, 0 if not found and
+ * -1 at the end of the directory. */
+static int fat_raw_search(uint8_t *entries, uint32_t count,
+			  uint8_t *short_name, FAT_RAW_FILE *file)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t *e = entries + i * FAT_DIRENT_SIZE;
+		uint8_t attr = e[11];
+
+		if (e[0] == 0) {
+			return -1;
+		}
+		if (e[0] == FAT_DIRENT_FREE ||
+		    (attr & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME ||
+		    (attr & (FAT_ATTR_VOLUME_ID | FAT_ATTR_DIRECTORY))) {
+			continue;
+		}
+		if (memcmp(e, short_name, 11) == 0) {
+			file->cluster = (uint32_t)get_le16(e + 20) << 16 |
+					get_le16(e + 26);
+			file->size = get_le32(e + 28);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+bool fat_raw_lookup(FAT_RAW *fs, char *name, FAT_RAW_FILE *file)
+{
+	uint8_t short_name[11];
+	uint32_t cluster, steps = 0;
+	uint8_t *buffer;
+	int found = 0;
+
+	if (!fat_raw_short_name(name, short_name)) {
+		return false;
+	}
+	buffer = malloc(fs->type == 32 ? fs->cluster_size : fs->root_bytes);
+	if (!buffer) {
+		return false;
+	}
+	if (fs->type != 32) {
+		if (fat_raw_io(fs->fd, buffer, fs->root_bytes, fs->root_offset,
+			       false)) {
+			found = fat_raw_search(buffer,
+					       fs->root_bytes / FAT_DIRENT_SIZE,
+					       short_name, file);
+		}
+	} else {
+		cluster = fs->root_cluster;
+		while (found == 0 && fat_raw_valid_cluster(fs, cluster) &&
+		       steps++ <= fs->num_clusters &&
+		       fat_raw_io(fs->fd, buffer, fs->cluster_size,
+				  fat_raw_cluster_offset(fs, cluster), false)) {
+			found = fat_raw_search(
+			    buffer, fs->cluster_size / FAT_DIRENT_SIZE,
+			    short_name, file);
+			if (found == 0 &&
+			    !fat_raw_next_cluster(fs, cluster, &cluster)) {
+				break;
+			}
+		}
+	}
+	free(buffer);
+	return found == 1;
+}
+
+bool fat_raw_read(FAT_RAW *fs, FAT_RAW_FILE *file, void *buffer, uint32_t len)
+{
+	if (len > file->size) {
+		return false;
+	}
+	return fat_raw_transfer(fs, file->cluster, buffer, len, false);
+}
+
+bool fat_raw_write(FAT_RAW *fs, FAT_RAW_FILE *file, void *buffer,
+		   uint32_t len)
+{
+	/* files are rewritten in place and cannot grow */
+	if (len > file->size) {
+		return false;
+	}
+	if (!fat_raw_transfer(fs, file->cluster, buffer, len, true)) {
+		return false;
+	}
+	return fsync(fs->fd) == 0;
+}
+
+bool fat_raw_probe_file(char *devpath, char *name, uint32_t *size)
+{
+	FAT_RAW_FILE file;
+	FAT_RAW fs;
+	bool result;
+
+	if (!fat_raw_open(&fs, devpath, false)) {
+		return false;
+	}
+	result = fat_raw_lookup(&fs, name, &file);
+	if (result && size) {
+		*size = file.size;
+	}
+	fat_raw_close(&fs);
+	return result;
+}
+
+/* Read at most *len bytes of the file, *len is set to the bytes read */
+bool fat_raw_read_file(char *devpath, char *name, void *buffer,
+		       uint32_t *len)
+{
+	FAT_RAW_FILE file;
+	FAT_RAW fs;
+	bool result;
+
+	if (!fat_raw_open(&fs, devpath, false)) {
+		return false;
+	}
+	result = fat_raw_lookup(&fs, name, &file);
+	if (result) {
+		if (*len > file.size) {
+			*len = file.size;
+		}
+		result = fat_raw_read(&fs, &file, buffer, *len);
+	}
+	fat_raw_close(&fs);
+	return result;
+}
+
+bool fat_raw_write_file(char *devpath, char *name, void *buffer,
+			uint32_t len)
+{
+	FAT_RAW_FILE file;
+	FAT_RAW fs;
+	bool result;
+
+	if (!fat_raw_open(&fs, devpath, true)) {
+		return false;
+	}
+	result = fat_raw_lookup(&fs, name, &file) &&
+		 fat_raw_write(&fs, &file, buffer, len);
+	fat_raw_close(&fs);
+	return result;
+}
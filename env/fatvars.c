@@ -19,6 +19,74 @@
 static int current_partition = 0;
 static BG_ENVDATA env[ENV_NUM_CONFIG_PARTS];
 
+/* Environment files of variable size keep their user variable capacity and
+ * used length when saved, as writing a file does not truncate it */
+static UINT32 env_capacity[ENV_NUM_CONFIG_PARTS];
+static UINT32 env_used[ENV_NUM_CONFIG_PARTS];
+static UINT32 env_magic[ENV_NUM_CONFIG_PARTS];
+static UINT8 env_file[sizeof(BG_ENVDATA) + sizeof(BG_ENVFOOTER)];
+
+/* Take environment i from the first len bytes of env_file, in either format
+ * of envdata.h */
+static BOOLEAN env_from_file(UINTN i, UINTN len)
+{
+	BG_ENVFOOTER *footer;
+	UINT32 used;
+
+	env_capacity[i] = 0;
+	if (len < ENV_HEADER_SIZE + sizeof(BG_ENVFOOTER)) {
+		return FALSE;
+	}
+	/* a file padded to sizeof(BG_ENVDATA) also passes the checksum of
+	 * the fixed format, check the footer first */
+	footer = (BG_ENVFOOTER *)(env_file + len - sizeof(BG_ENVFOOTER));
+	used = len - ENV_HEADER_SIZE - sizeof(BG_ENVFOOTER);
+	if ((footer->magic != ENV_FOOTER_MAGIC &&
+	     footer->magic != ENV_FOOTER_MAGIC_ZLIB) ||
+	    footer->used != used ||
+	    used > ENV_MEM_USERVARS || footer->capacity == 0 ||
+	    used > footer->capacity ||
+	    calc_crc32(env_file, len - sizeof(footer->crc32)) !=
+		footer->crc32) {
+		if (len != sizeof(BG_ENVDATA)) {
+			return FALSE;
+		}
+		CopyMem(&env[i], env_file, sizeof(BG_ENVDATA));
+		return calc_crc32(&env[i], sizeof(BG_ENVDATA) -
+						sizeof(env[i].crc32)) ==
+		       env[i].crc32;
+	}
+	ZeroMem(&env[i], sizeof(BG_ENVDATA));
+	CopyMem(&env[i], env_file, ENV_HEADER_SIZE + used);
+	env_capacity[i] = footer->capacity;
+	env_used[i] = used;
+	/* compressed user variables are kept as they are */
+	env_magic[i] = footer->magic;
+	return TRUE;
+}
+
+/* Build the file of environment i in env_file, returns its length */
+static UINTN env_to_file(UINTN i)
+{
+	BG_ENVFOOTER *footer;
+	UINTN len;
+
+	if (!env_capacity[i]) {
+		env[i].crc32 = calc_crc32(&env[i], sizeof(BG_ENVDATA) -
+							sizeof(env[i].crc32));
+		CopyMem(env_file, &env[i], sizeof(BG_ENVDATA));
+		return sizeof(BG_ENVDATA);
+	}
+	len = ENV_HEADER_SIZE + env_used[i] + sizeof(BG_ENVFOOTER);
+	CopyMem(env_file, &env[i], ENV_HEADER_SIZE + env_used[i]);
+	footer = (BG_ENVFOOTER *)(env_file + ENV_HEADER_SIZE + env_used[i]);
+	footer->capacity = env_capacity[i];
+	footer->used = env_used[i];
+	footer->magic = env_magic[i];
+	footer->crc32 = calc_crc32(env_file, len - sizeof(footer->crc32));
+	return len;
+}
+
 BG_STATUS save_current_config(void)
 {
 	BG_STATUS result = BG_SUCCESS;
@@ -63,13 +131,9 @@ BG_STATUS save_current_config(void)
 		return BG_CONFIG_ERROR;
 	}
 
-	UINTN writelen = sizeof(BG_ENVDATA);
-	uint32_t crc32 = calc_crc32(&env[current_partition],
-				    sizeof(BG_ENVDATA) -
-					sizeof(env[current_partition].crc32));
-	env[current_partition].crc32 = crc32;
+	UINTN writelen = env_to_file(current_partition);
 	efistatus = uefi_call_wrapper(fh->Write, 3, fh, &writelen,
-				      (VOID *)&env[current_partition]);
+				      (VOID *)env_file);
 	if (EFI_ERROR(efistatus)) {
 		Print(L"Error writing environment to file: %r\n", efistatus);
 		result = BG_CONFIG_ERROR;
@@ -130,9 +194,9 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 			continue;
 		}
 
-		UINTN readlen = sizeof(BG_ENVDATA);
+		UINTN readlen = sizeof(env_file);
 		if (EFI_ERROR(uefi_call_wrapper(fh->Read, 3, fh, &readlen,
-						(VOID *)&env[i]))) {
+						(VOID *)env_file))) {
 			Print(L"Error reading environment from config "
 			      L"partition %d.\n",
 			      i);
@@ -145,14 +209,10 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 			continue;
 		}
 
-		uint32_t crc32 = calc_crc32(&env[i], sizeof(BG_ENVDATA) -
-							 sizeof(env[i].crc32));
-		if (crc32 != env[i].crc32) {
+		if (!env_from_file(i, readlen)) {
 			Print(L"CRC32 error in environment data on config "
 			      L"partition %d.\n",
 			      i);
-			Print(L"calculated: %lx\n", crc32);
-			Print(L"stored: %lx\n", env[i].crc32);
 			/* Don't treat this as fatal error because we may still
 			 * have
 			 * valid environments */
@@ -16,6 +16,554 @@
 #include "env_api.h"
 #include "uservars.h"
 
+/* Lookup index over the user variables of a loaded environment.
+ *
+ * Each loaded environment owns an open addressing hash table, which maps
+ * the hash of a key to the offset of its record inside the user variable
+ * region. The index is built once when the environment is loaded and kept
+ * in sync by all functions modifying the region. Regions without an index,
+ * e.g. temporary buffers of tools, are searched linearly as before.
+ *
+ * Besides the hash table, the index caches the offset of the end of the
+ * last record (tail) and the number of bytes occupied by records (used),
+ * so that appending and free space queries do not need to walk the region.
+ * Everything behind the tail is zero.
+ *
+ * In deferred compaction mode, deleted records are not cut out of the region
+ * but flagged as tombstones, and every appended record is followed by a slack
+ * tombstone. A record growing or shrinking consumes or produces the
+ * tombstones behind it in place, so that frequently updated variables neither
+ * move the rest of the region nor change their position. Tombstones are
+ * removed by bgenv_compact_uservars(), which runs when the environment is
+ * closed or when appending a record would not fit otherwise. In this mode
+ * tail - used is the number of bytes held by tombstones.
+ *
+ * For iterating over keys with a common prefix, the offsets of all visible
+ * records are sorted by key on demand. The sorted array is dropped whenever
+ * a key is added or removed or a record moves.
+ *
+ * In compact mode, records are written in the compact layout described at
+ * bgenv_map_uservar(), and compaction converts legacy records.
+ *
+ * All functions modifying the region extend the dirty range of the index,
+ * the span of bytes changed since the region was last read or written, so
+ * that only this span needs to be written back. Without an index, the
+ * whole region has to be considered dirty.
+ *
+ * The capacity of the index limits the space for records below the size of
+ * the region, for environment files of variable size.
+ */
+#define USERVAR_INDEX_MIN_SLOTS 64
+
+#define USERVAR_SLACK_KEY "-"
+#define USERVAR_SLACK_SIZE 32
+#define USERVAR_MIN_RECORD_SIZE \
+	(sizeof(USERVAR_SLACK_KEY) + sizeof(uint32_t) + sizeof(uint64_t))
+
+typedef struct {
+	uint32_t offset;	/* record offset + 1, 0 marks an empty slot */
+	uint32_t hash;
+} USERVAR_SLOT;
+
+typedef struct {
+	uint8_t *udata;
+	USERVAR_SLOT *slots;
+	uint32_t num_slots;
+	uint32_t num_entries;
+	uint32_t tail;
+	uint32_t used;
+	bool deferred;
+	bool compact;
+	uint32_t *sorted;
+	uint32_t num_sorted;
+	uint32_t dirty_start;
+	uint32_t dirty_end;	/* empty if not behind dirty_start */
+	uint32_t capacity;	/* 0 for the whole region */
+} USERVAR_INDEX;
+
+static USERVAR_INDEX uservar_index[ENV_NUM_CONFIG_PARTS];
+
+static bool uservar_is_compact(uint8_t *p)
+{
+	return p[0] == USERVAR_COMPACT || p[0] == USERVAR_COMPACT_DELETED;
+}
+
+static char *uservar_key(uint8_t *p)
+{
+	return (char *)(uservar_is_compact(p) ? p + 1 : p);
+}
+
+static uint32_t uservar_varint_size(uint64_t value)
+{
+	uint32_t size = 1;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static uint8_t *uservar_put_varint(uint8_t *p, uint64_t value)
+{
+	while (value >= 0x80) {
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+/* Decode a LEB128 number, not reading at or behind end unless end is NULL.
+ * Returns the position behind the number or NULL if it is invalid. */
+static uint8_t *uservar_get_varint(uint8_t *p, uint8_t *end, uint64_t *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (end && p >= end) {
+			return NULL;
+		}
+		*value |= (uint64_t)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static uint32_t uservar_record_size(bool compact, char *key, uint64_t type,
+				    uint32_t datalen)
+{
+	if (!compact) {
+		return datalen + sizeof(uint64_t) + sizeof(uint32_t) +
+		       strlen(key) + 1;
+	}
+	return 1 + strlen(key) + 1 + uservar_varint_size(datalen) + 1 +
+	       (type >= USERVAR_COMPACT_TYPE_EXT ? uservar_varint_size(type)
+						 : 0) +
+	       datalen;
+}
+
+static void uservar_serialize_compact(uint8_t *p, char *key, uint64_t type,
+				      void *data, uint32_t datalen)
+{
+	*p++ = USERVAR_COMPACT;
+	memcpy(p, key, strlen(key) + 1);
+	p += strlen(key) + 1;
+	p = uservar_put_varint(p, datalen);
+	if (type < USERVAR_COMPACT_TYPE_EXT) {
+		*p++ = (uint8_t)type;
+	} else {
+		*p++ = USERVAR_COMPACT_TYPE_EXT;
+		p = uservar_put_varint(p, type);
+	}
+	memcpy(p, data, datalen);
+}
+
+static bool uservar_key_reserved(char *key)
+{
+	/* first bytes of compact records and compressed data, which are
+	 * never valid UTF-8 */
+	return (uint8_t)key[0] >= USERVAR_COMPACT_DELETED;
+}
+
+/* FNV-1a hash of a key, shared by all sets of keys of the library */
+uint32_t bgenv_uservar_hash(char *key)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (uint8_t)*key++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static USERVAR_INDEX *uservar_index_get(uint8_t *udata)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (uservar_index[i].udata == udata) {
+			return &uservar_index[i];
+		}
+	}
+	return NULL;
+}
+
+static uint32_t uservar_capacity(USERVAR_INDEX *idx)
+{
+	return idx && idx->capacity ? idx->capacity : ENV_MEM_USERVARS;
+}
+
+/* Space behind the tail within the capacity */
+static uint32_t uservar_space(USERVAR_INDEX *idx)
+{
+	uint32_t capacity = uservar_capacity(idx);
+
+	return idx->tail < capacity ? capacity - idx->tail : 0;
+}
+
+static void uservar_mark_dirty(USERVAR_INDEX *idx, uint32_t start,
+			       uint32_t end)
+{
+	if (!idx || start >= end) {
+		return;
+	}
+	if (idx->dirty_start >= idx->dirty_end) {
+		idx->dirty_start = start;
+		idx->dirty_end = end;
+		return;
+	}
+	if (start < idx->dirty_start) {
+		idx->dirty_start = start;
+	}
+	if (end > idx->dirty_end) {
+		idx->dirty_end = end;
+	}
+}
+
+static USERVAR_SLOT *uservar_index_lookup(USERVAR_INDEX *idx, char *key)
+{
+	uint32_t hash, mask, i;
+
+	if (!idx->num_slots) {
+		return NULL;
+	}
+	hash = bgenv_uservar_hash(key);
+	mask = idx->num_slots - 1;
+	i = hash & mask;
+
+	while (idx->slots[i].offset) {
+		if (idx->slots[i].hash == hash &&
+		    strcmp(uservar_key(idx->udata + idx->slots[i].offset - 1),
+			   key) == 0) {
+			return &idx->slots[i];
+		}
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void uservar_index_place(USERVAR_SLOT *slots, uint32_t num_slots,
+				uint32_t hash, uint32_t offset)
+{
+	uint32_t i = hash & (num_slots - 1);
+
+	while (slots[i].offset) {
+		i = (i + 1) & (num_slots - 1);
+	}
+	slots[i].offset = offset + 1;
+	slots[i].hash = hash;
+}
+
+static bool uservar_index_grow(USERVAR_INDEX *idx)
+{
+	uint32_t num_slots;
+	USERVAR_SLOT *slots;
+
+	num_slots = idx->num_slots ? idx->num_slots * 2
+				   : USERVAR_INDEX_MIN_SLOTS;
+	slots = calloc(num_slots, sizeof(USERVAR_SLOT));
+	if (!slots) {
+		return false;
+	}
+	for (uint32_t i = 0; i < idx->num_slots; i++) {
+		if (idx->slots[i].offset) {
+			uservar_index_place(slots, num_slots,
+					    idx->slots[i].hash,
+					    idx->slots[i].offset - 1);
+		}
+	}
+	free(idx->slots);
+	idx->slots = slots;
+	idx->num_slots = num_slots;
+	return true;
+}
+
+static void uservar_index_unsort(USERVAR_INDEX *idx)
+{
+	free(idx->sorted);
+	idx->sorted = NULL;
+	idx->num_sorted = 0;
+}
+
+static int uservar_compare_offsets(const void *a, const void *b,
+				   void *udata)
+{
+	return strcmp(uservar_key((uint8_t *)udata + *(const uint32_t *)a),
+		      uservar_key((uint8_t *)udata + *(const uint32_t *)b));
+}
+
+static bool uservar_index_sort(USERVAR_INDEX *idx)
+{
+	uint32_t n = 0;
+
+	if (idx->sorted || !idx->num_entries) {
+		return true;
+	}
+	idx->sorted = malloc(idx->num_entries * sizeof(uint32_t));
+	if (!idx->sorted) {
+		return false;
+	}
+	for (uint32_t i = 0; i < idx->num_slots; i++) {
+		if (idx->slots[i].offset) {
+			idx->sorted[n++] = idx->slots[i].offset - 1;
+		}
+	}
+	qsort_r(idx->sorted, n, sizeof(uint32_t), uservar_compare_offsets,
+		idx->udata);
+	idx->num_sorted = n;
+	return true;
+}
+
+static void uservar_index_release(USERVAR_INDEX *idx)
+{
+	uservar_index_unsort(idx);
+	free(idx->slots);
+	memset(idx, 0, sizeof(USERVAR_INDEX));
+}
+
+static bool uservar_index_insert(USERVAR_INDEX *idx, char *key,
+				 uint32_t offset)
+{
+	/* keep the load factor at or below 1/2 */
+	if ((idx->num_entries + 1) * 2 > idx->num_slots) {
+		if (!uservar_index_grow(idx)) {
+			return false;
+		}
+	}
+	uservar_index_place(idx->slots, idx->num_slots,
+			    bgenv_uservar_hash(key), offset);
+	idx->num_entries++;
+	uservar_index_unsort(idx);
+	return true;
+}
+
+static void uservar_index_remove(USERVAR_INDEX *idx, USERVAR_SLOT *slot)
+{
+	uint32_t mask = idx->num_slots - 1;
+	uint32_t i = slot - idx->slots;
+	uint32_t j = i;
+
+	/* Backward shift deletion: move every following entry of the probe
+	 * sequence into the gap, unless it already sits in its home slot
+	 * or between the home slot and the gap. */
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!idx->slots[j].offset) {
+			break;
+		}
+		uint32_t home = idx->slots[j].hash & mask;
+		if ((i <= j) ? (i < home && home <= j)
+			     : (i < home || home <= j)) {
+			continue;
+		}
+		idx->slots[i] = idx->slots[j];
+		i = j;
+	}
+	idx->slots[i].offset = 0;
+	idx->num_entries--;
+	uservar_index_unsort(idx);
+}
+
+static void uservar_index_update(uint8_t *udata, char *key, uint8_t *p)
+{
+	USERVAR_INDEX *idx;
+	USERVAR_SLOT *slot;
+
+	idx = uservar_index_get(udata);
+	if (!idx) {
+		return;
+	}
+	slot = uservar_index_lookup(idx, key);
+	if (slot) {
+		if (slot->offset != p - udata + 1) {
+			slot->offset = p - udata + 1;
+			uservar_index_unsort(idx);
+		}
+		return;
+	}
+	if (!uservar_index_insert(idx, key, p - udata)) {
+		/* fall back to linear search */
+		uservar_index_release(idx);
+	}
+}
+
+static bool uservar_compact_record_valid(uint8_t *udata, uint32_t offset,
+					 uint32_t *record_size)
+{
+	uint8_t *p, *end = udata + ENV_MEM_USERVARS;
+	uint64_t datalen, type;
+
+	p = memchr(udata + offset + 1, 0, ENV_MEM_USERVARS - offset - 1);
+	if (!p) {
+		return false;
+	}
+	p = uservar_get_varint(p + 1, end, &datalen);
+	if (!p || p >= end) {
+		return false;
+	}
+	if (*p++ & USERVAR_COMPACT_TYPE_EXT) {
+		p = uservar_get_varint(p, end, &type);
+		if (!p) {
+			return false;
+		}
+	}
+	if (datalen > (uint64_t)(end - p)) {
+		return false;
+	}
+	*record_size = p - (udata + offset) + datalen;
+	return true;
+}
+
+static bool uservar_record_valid(uint8_t *udata, uint32_t offset,
+				 uint32_t *record_size)
+{
+	uint32_t keylen, payload_size;
+	uint8_t *end;
+
+	if (uservar_is_compact(udata + offset)) {
+		return uservar_compact_record_valid(udata, offset,
+						    record_size);
+	}
+	end = memchr(udata + offset, 0, ENV_MEM_USERVARS - offset);
+	if (!end) {
+		return false;
+	}
+	keylen = end - (udata + offset);
+	if (ENV_MEM_USERVARS - offset - keylen - 1 <
+	    sizeof(uint32_t) + sizeof(uint64_t)) {
+		return false;
+	}
+	memcpy(&payload_size, end + 1, sizeof(uint32_t));
+	if (payload_size < sizeof(uint32_t) + sizeof(uint64_t) ||
+	    payload_size > ENV_MEM_USERVARS - offset - keylen - 1) {
+		return false;
+	}
+	*record_size = keylen + 1 + payload_size;
+	return true;
+}
+
+static bool uservar_is_tombstone(uint8_t *p)
+{
+	uint64_t type;
+
+	bgenv_map_uservar(p, NULL, &type, NULL, NULL, NULL);
+	return (type & USERVAR_TYPE_DELETED) != 0;
+}
+
+static void uservar_put_tombstone(uint8_t *p)
+{
+	uint8_t *t = p + strlen((char *)p) + 1 + sizeof(uint32_t);
+	uint64_t type;
+
+	if (uservar_is_compact(p)) {
+		p[0] = USERVAR_COMPACT_DELETED;
+		return;
+	}
+	memcpy(&type, t, sizeof(uint64_t));
+	type |= USERVAR_TYPE_DELETED;
+	memcpy(t, &type, sizeof(uint64_t));
+}
+
+static void uservar_put_slack(uint8_t *p, uint32_t record_size)
+{
+	uint64_t type = USERVAR_TYPE_DELETED | USERVAR_TYPE_SLACK;
+	uint32_t payload_size = record_size - sizeof(USERVAR_SLACK_KEY);
+
+	memset(p, 0, record_size);
+	memcpy(p, USERVAR_SLACK_KEY, sizeof(USERVAR_SLACK_KEY));
+	p += sizeof(USERVAR_SLACK_KEY);
+	memcpy(p, &payload_size, sizeof(uint32_t));
+	p += sizeof(uint32_t);
+	memcpy(p, &type, sizeof(uint64_t));
+}
+
+bool bgenv_build_uservar_index(uint8_t *udata)
+{
+	USERVAR_INDEX *idx;
+	uint32_t offset, rsize, used, dirty_start, dirty_end, capacity;
+	bool deferred, compact;
+	char *key;
+
+	if (!udata) {
+		return false;
+	}
+	idx = uservar_index_get(udata);
+	if (!idx) {
+		idx = uservar_index_get(NULL);
+	}
+	if (!idx) {
+		VERBOSE(stderr, "No free user variable index.\n");
+		return false;
+	}
+	/* settings and the dirty range survive rebuilding after a sweep */
+	deferred = idx->deferred;
+	compact = idx->compact;
+	dirty_start = idx->dirty_start;
+	dirty_end = idx->dirty_end;
+	capacity = idx->capacity;
+	uservar_index_release(idx);
+	idx->udata = udata;
+	idx->deferred = deferred;
+	idx->compact = compact;
+	idx->dirty_start = dirty_start;
+	idx->dirty_end = dirty_end;
+	idx->capacity = capacity;
+
+	offset = 0;
+	used = 0;
+	while (offset < ENV_MEM_USERVARS && udata[offset]) {
+		if (!uservar_record_valid(udata, offset, &rsize)) {
+			VERBOSE(stderr, "Corrupt user variable record at "
+					"offset %lu.\n", (unsigned long)offset);
+			uservar_index_release(idx);
+			return false;
+		}
+		key = uservar_key(udata + offset);
+		if (uservar_is_tombstone(udata + offset)) {
+			offset += rsize;
+			continue;
+		}
+		used += rsize;
+		/* like the linear search, only the first record of a key
+		 * is visible */
+		if (!uservar_index_lookup(idx, key) &&
+		    !uservar_index_insert(idx, key, offset)) {
+			VERBOSE(stderr, "Out of memory building the user "
+					"variable index.\n");
+			uservar_index_release(idx);
+			return false;
+		}
+		offset += rsize;
+	}
+	idx->tail = offset;
+	idx->used = used;
+
+	/* Keep the invariant that everything behind the last record is
+	 * zero, as it is for all files written by this library. */
+	for (; offset < ENV_MEM_USERVARS; offset++) {
+		if (udata[offset]) {
+			VERBOSE(stderr, "Garbage behind last user variable.\n");
+			uservar_index_release(idx);
+			return false;
+		}
+	}
+	return true;
+}
+
+void bgenv_drop_uservar_index(uint8_t *udata)
+{
+	USERVAR_INDEX *idx;
+
+	if (!udata) {
+		return;
+	}
+	idx = uservar_index_get(udata);
+	if (idx) {
+		uservar_index_release(idx);
+	}
+}
+
 void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val,
 		       uint32_t *record_size, uint32_t *data_size)
 {
@@ -34,11 +582,56 @@ void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val
 	 * |      (reserved)      |  (free for user)  |    (reserved)   |
 	 *
 	 * internal flags and standard types are declared in ebgenv.h
+	 *
+	 * Compact records start with a marker byte, which is never the first
+	 * byte of a key:
+	 * |------|------------|------------|---------|-----------|-----------|
+	 * | 0xFE | char KEY[] | varint len | uint8_t | [varint   | uint8_t   |
+	 * |      |            |            | type    |  type]    | data[]    |
+	 * |------|------------|------------|---------|-----------|-----------|
+	 *
+	 * here varint is an unsigned LEB128 number and 'len' is the size of
+	 * the data. A type below 0x80 is stored in the single type byte,
+	 * otherwise the type byte is 0x80 and followed by the full type.
+	 * Deleted compact records get the marker 0xFD.
+	 *
+	 * Fields are copied rather than dereferenced, as records are not
+	 * aligned.
 	 */
 	char *var_key;
-	uint32_t *payload_size;
-	uint64_t *var_type;
-	uint8_t *data;
+	uint32_t payload_size;
+	uint64_t var_type, datalen;
+	uint8_t *p;
+
+	if (uservar_is_compact(udata)) {
+		var_key = (char *)udata + 1;
+		p = (uint8_t *)var_key + strlen(var_key) + 1;
+		p = uservar_get_varint(p, NULL, &datalen);
+		if (*p++ & USERVAR_COMPACT_TYPE_EXT) {
+			p = uservar_get_varint(p, NULL, &var_type);
+		} else {
+			var_type = p[-1];
+		}
+		if (udata[0] == USERVAR_COMPACT_DELETED) {
+			var_type |= USERVAR_TYPE_DELETED;
+		}
+		if (key) {
+			*key = var_key;
+		}
+		if (record_size) {
+			*record_size = p - udata + datalen;
+		}
+		if (type) {
+			*type = var_type;
+		}
+		if (data_size) {
+			*data_size = datalen;
+		}
+		if (val) {
+			*val = p;
+		}
+		return;
+	}
 
 	/* Get the key */
 	var_key = (char *)udata;
@@ -46,29 +639,30 @@ void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val
 		*key = var_key;
 	}
 
-	/* Get position of payload size */
-	payload_size = (uint32_t *)(var_key + strlen(var_key) + 1);
+	/* Get the payload size */
+	p = (uint8_t *)var_key + strlen(var_key) + 1;
+	memcpy(&payload_size, p, sizeof(uint32_t));
+	p += sizeof(uint32_t);
 
 	/* Calculate the record size (size of the whole thing) */
 	if (record_size) {
-		*record_size = *payload_size + strlen(var_key) + 1;
+		*record_size = payload_size + strlen(var_key) + 1;
 	}
 
-	/* Get position of the type field */
-	var_type = (uint64_t *)((uint8_t *)payload_size + sizeof(uint32_t));
+	/* Get the type field */
 	if (type) {
-		*type = *var_type;
+		memcpy(type, p, sizeof(uint64_t));
 	}
+	p += sizeof(uint64_t);
 
 	/* Calculate the data size */
 	if (data_size) {
-		*data_size = *payload_size - sizeof(uint32_t) -
+		*data_size = payload_size - sizeof(uint32_t) -
 			     sizeof(uint64_t);
 	}
 	/* Get the pointer to the data field */
-	data = (uint8_t *)var_type + sizeof(uint64_t);
 	if (val) {
-		*val = data;
+		*val = p;
 	}
 }
 
@@ -87,7 +681,7 @@ void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type, void *data,
 	p += sizeof(uint32_t);
 
 	/* store datatype */
-	*((uint64_t *)p) = type;
+	memcpy(p, &type, sizeof(uint64_t));
 	p += sizeof(uint64_t);
 
 	/* store data */
@@ -127,11 +721,17 @@ int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
 int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 	              uint32_t datalen)
 {
+	USERVAR_INDEX *idx;
 	uint32_t total_size;
+	bool compact;
 	uint8_t *p;
 
-	total_size = datalen + sizeof(uint64_t) + sizeof(uint32_t) +
-		     strlen(key) + 1;
+	if (uservar_key_reserved(key)) {
+		return -EINVAL;
+	}
+	idx = uservar_index_get(udata);
+	compact = idx && idx->compact;
+	total_size = uservar_record_size(compact, key, type, datalen);
 
 	p = bgenv_find_uservar(udata, key);
 	if (p) {
@@ -152,22 +752,208 @@ int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 		return -errno;
 	}
 
-	bgenv_serialize_uservar(p, key, type, data, total_size);
+	if (compact) {
+		uservar_serialize_compact(p, key, type, data, datalen);
+	} else {
+		bgenv_serialize_uservar(p, key, type, data, total_size);
+	}
+	uservar_mark_dirty(uservar_index_get(udata), p - udata,
+			   p - udata + total_size);
+	uservar_index_update(udata, key, p);
 
 	return 0;
 }
 
+/* Key table of bgenv_set_uservars, mapping each key of the batch to its
+ * first and last occurrence. */
+typedef struct {
+	uint32_t hash;
+	uint32_t first;		/* index of the first occurrence + 1 */
+	uint32_t last;
+	bool done;
+} USERVAR_BATCH_SLOT;
+
+static USERVAR_BATCH_SLOT *uservar_batch_lookup(USERVAR_BATCH_SLOT *slots,
+						uint32_t num_slots,
+						ebgenv_var_t *vars, char *key)
+{
+	uint32_t hash = bgenv_uservar_hash(key);
+	uint32_t i = hash & (num_slots - 1);
+
+	while (slots[i].first) {
+		if (slots[i].hash == hash &&
+		    strcmp(vars[slots[i].first - 1].key, key) == 0) {
+			break;
+		}
+		i = (i + 1) & (num_slots - 1);
+	}
+	/* unused slots are returned with the hash to insert the key */
+	slots[i].hash = hash;
+	return &slots[i];
+}
+
+static bool uservar_batch_emit(uint8_t *buffer, uint32_t *offset,
+			       ebgenv_var_t *var, bool compact,
+			       uint32_t capacity)
+{
+	uint32_t rsize;
+
+	if (var->type & USERVAR_TYPE_DELETED) {
+		return true;
+	}
+	rsize = uservar_record_size(compact, var->key, var->type,
+				    var->datalen);
+	/* keep space for the terminating zero */
+	if (*offset + rsize >= capacity) {
+		return false;
+	}
+	if (compact) {
+		uservar_serialize_compact(buffer + *offset, var->key,
+					  var->type, var->value, var->datalen);
+	} else {
+		bgenv_serialize_uservar(buffer + *offset, var->key, var->type,
+					var->value, rsize);
+	}
+	*offset += rsize;
+	return true;
+}
+
+int bgenv_set_uservars(uint8_t *udata, ebgenv_var_t *vars, uint32_t count)
+{
+	USERVAR_BATCH_SLOT *slots = NULL, *slot;
+	USERVAR_INDEX *idx;
+	uint32_t num_slots, rsize, in, out, end;
+	uint8_t *buffer = NULL;
+	char *key;
+	int res = 0;
+
+	if (!udata || (!vars && count)) {
+		return -EINVAL;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (!vars[i].key || !*vars[i].key ||
+		    uservar_key_reserved(vars[i].key)) {
+			return -EINVAL;
+		}
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	num_slots = USERVAR_INDEX_MIN_SLOTS;
+	while (num_slots < count * 2) {
+		num_slots *= 2;
+	}
+	slots = calloc(num_slots, sizeof(USERVAR_BATCH_SLOT));
+	buffer = malloc(ENV_MEM_USERVARS);
+	if (!slots || !buffer) {
+		res = -ENOMEM;
+		goto set_uservars_out;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		slot = uservar_batch_lookup(slots, num_slots, vars,
+					    vars[i].key);
+		if (!slot->first) {
+			slot->first = i + 1;
+		}
+		slot->last = i;
+	}
+
+	/* Rebuild the region into the buffer: existing variables keep their
+	 * position, changed ones get their new value in place, deleted ones
+	 * are dropped and new ones are appended in the order given. */
+	idx = uservar_index_get(udata);
+	end = idx ? idx->tail : ENV_MEM_USERVARS - bgenv_user_free(udata);
+	out = 0;
+	for (in = 0; in < end; in += rsize) {
+		bgenv_map_uservar(udata + in, &key, NULL, NULL, &rsize, NULL);
+		if (uservar_is_tombstone(udata + in)) {
+			continue;
+		}
+		slot = uservar_batch_lookup(slots, num_slots, vars, key);
+		if (slot->first) {
+			if (slot->done) {
+				/* hidden duplicate of a replaced key */
+				continue;
+			}
+			slot->done = true;
+			if (!uservar_batch_emit(buffer, &out,
+						&vars[slot->last],
+						idx && idx->compact,
+						uservar_capacity(idx))) {
+				res = -ENOMEM;
+				goto set_uservars_out;
+			}
+			continue;
+		}
+		if (out + rsize >= uservar_capacity(idx)) {
+			res = -ENOMEM;
+			goto set_uservars_out;
+		}
+		memcpy(buffer + out, udata + in, rsize);
+		out += rsize;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		slot = uservar_batch_lookup(slots, num_slots, vars,
+					    vars[i].key);
+		if (slot->done) {
+			continue;
+		}
+		slot->done = true;
+		if (!uservar_batch_emit(buffer, &out, &vars[slot->last],
+					idx && idx->compact,
+					uservar_capacity(idx))) {
+			res = -ENOMEM;
+			goto set_uservars_out;
+		}
+	}
+
+	if (idx) {
+		/* unchanged leading records are not dirty */
+		in = 0;
+		while (in < out && in < end && buffer[in] == udata[in]) {
+			in++;
+		}
+		uservar_mark_dirty(idx, in, out > end ? out : end);
+	}
+	memcpy(udata, buffer, out);
+	if (end > out) {
+		memset(udata + out, 0, end - out);
+	}
+	if (idx) {
+		(void)bgenv_build_uservar_index(udata);
+	}
+
+set_uservars_out:
+	if (res == -ENOMEM) {
+		VERBOSE(stderr,
+			"Error, out of memory setting user variables.\n");
+	}
+	free(buffer);
+	free(slots);
+	return res;
+}
+
 uint8_t *bgenv_find_uservar(uint8_t *udata, char *key)
 {
+	USERVAR_INDEX *idx;
+	USERVAR_SLOT *slot;
+	uint64_t type;
 	char *varkey;
 
 	if (!udata) {
 		return NULL;
 	}
+	idx = uservar_index_get(udata);
+	if (idx) {
+		slot = uservar_index_lookup(idx, key);
+		return slot ? udata + slot->offset - 1 : NULL;
+	}
 	while (*udata) {
-		bgenv_map_uservar(udata, &varkey, NULL, NULL, NULL, NULL);
+		bgenv_map_uservar(udata, &varkey, &type, NULL, NULL, NULL);
 
-		if (strncmp(varkey, key, strlen(key) + 1) == 0) {
+		if ((type & USERVAR_TYPE_DELETED) == 0 &&
+		    strncmp(varkey, key, strlen(key) + 1) == 0) {
 			return udata;
 		}
 		udata = bgenv_next_uservar(udata);
@@ -186,13 +972,22 @@ uint8_t *bgenv_next_uservar(uint8_t *udata)
 
 uint8_t *bgenv_uservar_alloc(uint8_t *udata, uint32_t datalen)
 {
+	USERVAR_INDEX *idx;
 	uint32_t spaceleft;
+	uint8_t *p;
 
 	if (!udata) {
 		errno = EINVAL;
 		return NULL;
 	}
-	spaceleft = bgenv_user_free(udata);
+	idx = uservar_index_get(udata);
+	if (idx && uservar_space(idx) < datalen + 1 &&
+	    idx->used < idx->tail) {
+		/* tombstones are only reclaimed when running out of space */
+		bgenv_compact_uservars(udata);
+		idx = uservar_index_get(udata);
+	}
+	spaceleft = idx ? uservar_space(idx) : bgenv_user_free(udata);
 	VERBOSE(stdout, "uservar_alloc: free: %lu requested: %lu \n",
 		(unsigned long)spaceleft, (unsigned long)datalen);
 
@@ -204,12 +999,76 @@ uint8_t *bgenv_uservar_alloc(uint8_t *udata, uint32_t datalen)
 		return NULL;
 	}
 
-	return udata + (ENV_MEM_USERVARS - spaceleft);
+	p = idx ? udata + idx->tail
+		: udata + (ENV_MEM_USERVARS - spaceleft);
+	if (idx) {
+		/* the caller serializes the record into the returned space */
+		idx->tail += datalen;
+		idx->used += datalen;
+		if (idx->deferred &&
+		    uservar_space(idx) > USERVAR_SLACK_SIZE) {
+			uservar_put_slack(udata + idx->tail,
+					  USERVAR_SLACK_SIZE);
+			idx->tail += USERVAR_SLACK_SIZE;
+		}
+		uservar_mark_dirty(idx, p - udata, idx->tail);
+	}
+	return p;
+}
+
+/* Resize the record at p in deferred compaction mode without moving it, by
+ * taking space from or giving space to the tombstones behind it. Returns
+ * false if the new size does not fit. */
+static bool uservar_resize_in_place(USERVAR_INDEX *idx, uint8_t *p,
+				    uint32_t rsize, uint32_t new_rsize)
+{
+	uint8_t *udata = idx->udata;
+	uint32_t offset, end, tsize, rest;
+
+	offset = p - udata;
+	end = offset + rsize;
+	while (end < idx->tail && uservar_is_tombstone(udata + end)) {
+		bgenv_map_uservar(udata + end, NULL, NULL, NULL, &tsize, NULL);
+		end += tsize;
+	}
+
+	if (end == idx->tail) {
+		/* last record, it can grow into the free space */
+		if (offset + new_rsize + 1 > uservar_capacity(idx)) {
+			return false;
+		}
+		end = offset + new_rsize;
+		if (uservar_capacity(idx) - end > USERVAR_SLACK_SIZE) {
+			uservar_put_slack(udata + end, USERVAR_SLACK_SIZE);
+			end += USERVAR_SLACK_SIZE;
+		}
+		if (end < idx->tail) {
+			memset(udata + end, 0, idx->tail - end);
+		}
+		uservar_mark_dirty(idx, offset,
+				   end > idx->tail ? end : idx->tail);
+		idx->tail = end;
+	} else {
+		if (offset + new_rsize > end) {
+			return false;
+		}
+		rest = end - offset - new_rsize;
+		if (rest && rest < USERVAR_MIN_RECORD_SIZE) {
+			return false;
+		}
+		if (rest) {
+			uservar_put_slack(p + new_rsize, rest);
+		}
+		uservar_mark_dirty(idx, offset, end);
+	}
+	idx->used = idx->used - rsize + new_rsize;
+	return true;
 }
 
 uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 			       uint8_t *p)
 {
+	USERVAR_INDEX *idx;
 	uint32_t spaceleft;
 	uint32_t rsize;
 
@@ -221,26 +1080,73 @@ uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 		return p;
 	}
 
+	idx = uservar_index_get(udata);
+	if (idx && idx->deferred) {
+		if (uservar_resize_in_place(idx, p, rsize, new_rsize)) {
+			return p;
+		}
+		bgenv_del_uservar(udata, p);
+		return bgenv_uservar_alloc(udata, new_rsize);
+	}
+
 	/* Delete variable and return pointer to end of whole user vars */
 	bgenv_del_uservar(udata, p);
 
-	spaceleft = bgenv_user_free(udata);
+	spaceleft = idx ? uservar_space(idx) : bgenv_user_free(udata);
 
-	if (spaceleft < new_rsize - 1) {
+	/* keep space for the terminating zero */
+	if (spaceleft < new_rsize + 1) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	return udata + ENV_MEM_USERVARS - spaceleft;
+	p = idx ? udata + idx->tail : udata + ENV_MEM_USERVARS - spaceleft;
+	if (idx) {
+		idx->tail += new_rsize;
+		idx->used += new_rsize;
+		uservar_mark_dirty(idx, p - udata, idx->tail);
+	}
+	return p;
 }
 
 void bgenv_del_uservar(uint8_t *udata, uint8_t *var)
 {
+	USERVAR_INDEX *idx;
+	USERVAR_SLOT *slot;
 	uint32_t spaceleft;
 	uint32_t rsize;
+	char *key;
 
 	/* Get the record size of the variable */
-	bgenv_map_uservar(var, NULL, NULL, NULL, &rsize, NULL);
+	bgenv_map_uservar(var, &key, NULL, NULL, &rsize, NULL);
+
+	idx = uservar_index_get(udata);
+	if (idx) {
+		slot = uservar_index_lookup(idx, key);
+		if (slot && slot->offset - 1 == var - udata) {
+			uservar_index_remove(idx, slot);
+		}
+		idx->used -= rsize;
+		if (idx->deferred) {
+			uservar_put_tombstone(var);
+			uservar_mark_dirty(idx, var - udata,
+					   var - udata + rsize);
+			return;
+		}
+		uservar_mark_dirty(idx, var - udata, idx->tail);
+		/* all records behind the deleted one move down */
+		uservar_index_unsort(idx);
+		for (uint32_t i = 0; i < idx->num_slots; i++) {
+			if (idx->slots[i].offset &&
+			    idx->slots[i].offset - 1 > var - udata) {
+				idx->slots[i].offset -= rsize;
+			}
+		}
+		memmove(var, var + rsize, idx->tail - (var - udata) - rsize);
+		idx->tail -= rsize;
+		memset(udata + idx->tail, 0, rsize);
+		return;
+	}
 
 	/* Move variable out of place and close gap. */
 	spaceleft = bgenv_user_free(udata);
@@ -256,6 +1162,7 @@ void bgenv_del_uservar(uint8_t *udata, uint8_t *var)
 
 uint32_t bgenv_user_free(uint8_t *udata)
 {
+	USERVAR_INDEX *idx;
 	uint32_t rsize;
 	uint32_t spaceleft;
 
@@ -264,6 +1171,13 @@ uint32_t bgenv_user_free(uint8_t *udata)
 	if (!udata) {
 		return 0;
 	}
+	idx = uservar_index_get(udata);
+	if (idx) {
+		/* tombstones count as free, compaction reclaims them */
+		return uservar_capacity(idx) > idx->used
+			       ? uservar_capacity(idx) - idx->used
+			       : 0;
+	}
 	if (!*udata) {
 		return spaceleft;
 	}
@@ -279,3 +1193,268 @@ uint32_t bgenv_user_free(uint8_t *udata)
 
 	return spaceleft;
 }
+
+bool bgenv_defer_uservar_compaction(uint8_t *udata, bool enable)
+{
+	USERVAR_INDEX *idx;
+
+	idx = udata ? uservar_index_get(udata) : NULL;
+	if (!idx) {
+		/* tombstones cannot be tracked without an index */
+		return false;
+	}
+	idx->deferred = enable;
+	return true;
+}
+
+/* Move all live records not matched by the filter to the start of the
+ * region in a single pass and rebuild the index. Returns the number of
+ * removed live records. */
+static uint32_t uservar_sweep(uint8_t *udata, USERVAR_INDEX *idx,
+			      uservar_filter_t match, void *ctx)
+{
+	uint32_t in, out, rsize, dsize, csize, removed = 0;
+	uint32_t first = ENV_MEM_USERVARS;
+	uint8_t *record = NULL, *val;
+	uint64_t type;
+	char *key;
+
+	if (idx && idx->compact) {
+		/* scratch space for converting legacy records */
+		record = malloc(ENV_MEM_USERVARS);
+	}
+
+	out = 0;
+	for (in = 0; in < ENV_MEM_USERVARS && udata[in]; in += rsize) {
+		bgenv_map_uservar(udata + in, &key, &type, NULL, &rsize,
+				  &dsize);
+		if (type & USERVAR_TYPE_DELETED) {
+			continue;
+		}
+		if (match && match(key, type, ctx)) {
+			removed++;
+			continue;
+		}
+		csize = uservar_record_size(true, key, type, dsize);
+		if (record && !uservar_is_compact(udata + in) &&
+		    csize <= rsize) {
+			if (out < first) {
+				first = out;
+			}
+			memcpy(record, udata + in, rsize);
+			bgenv_map_uservar(record, &key, &type, &val, NULL,
+					  NULL);
+			uservar_serialize_compact(udata + out, key, type, val,
+						  dsize);
+			out += csize;
+			continue;
+		}
+		if (out != in) {
+			if (out < first) {
+				first = out;
+			}
+			memmove(udata + out, udata + in, rsize);
+		}
+		out += rsize;
+	}
+	memset(udata + out, 0, in - out);
+	free(record);
+	if (out < in && out < first) {
+		first = out;
+	}
+	uservar_mark_dirty(idx, first, in);
+
+	if (idx) {
+		(void)bgenv_build_uservar_index(udata);
+	}
+	return removed;
+}
+
+void bgenv_compact_uservars(uint8_t *udata)
+{
+	USERVAR_INDEX *idx;
+
+	if (!udata) {
+		return;
+	}
+	/* tombstones only exist in regions with an index, without one the
+	 * records may not even have been validated */
+	idx = uservar_index_get(udata);
+	if (!idx || (idx->used == idx->tail && !idx->compact)) {
+		return;
+	}
+	(void)uservar_sweep(udata, idx, NULL, NULL);
+}
+
+uint32_t bgenv_del_uservars_matching(uint8_t *udata, uservar_filter_t match,
+				     void *ctx)
+{
+	if (!udata || !match) {
+		return 0;
+	}
+	return uservar_sweep(udata, uservar_index_get(udata), match, ctx);
+}
+
+bool bgenv_use_compact_uservars(uint8_t *udata, bool enable)
+{
+	USERVAR_INDEX *idx;
+
+	idx = udata ? uservar_index_get(udata) : NULL;
+	if (!idx) {
+		return false;
+	}
+	idx->compact = enable;
+	return true;
+}
+
+void bgenv_uservar_stats(uint8_t *udata, ebgenv_user_stats_t *stats)
+{
+	uint32_t offset, rsize, capacity;
+	uint64_t type;
+
+	memset(stats, 0, sizeof(ebgenv_user_stats_t));
+	if (!udata) {
+		return;
+	}
+	for (offset = 0; offset < ENV_MEM_USERVARS && udata[offset];
+	     offset += rsize) {
+		bgenv_map_uservar(udata + offset, NULL, &type, NULL, &rsize,
+				  NULL);
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
+			stats->live += rsize;
+		} else if (type & USERVAR_TYPE_SLACK) {
+			stats->slack += rsize;
+		} else {
+			stats->dead += rsize;
+		}
+	}
+	capacity = uservar_capacity(uservar_index_get(udata));
+	stats->free = capacity > offset ? capacity - offset : 0;
+}
+
+void bgenv_mark_uservar_dirty(uint8_t *udata, uint8_t *p, uint32_t len)
+{
+	if (!udata || !p) {
+		return;
+	}
+	uservar_mark_dirty(uservar_index_get(udata), p - udata,
+			   p - udata + len);
+}
+
+bool bgenv_uservar_dirty_range(uint8_t *udata, uint32_t *start,
+			       uint32_t *end)
+{
+	USERVAR_INDEX *idx;
+
+	idx = udata ? uservar_index_get(udata) : NULL;
+	if (!idx) {
+		/* changes cannot be tracked without an index */
+		return false;
+	}
+	if (idx->dirty_start >= idx->dirty_end) {
+		*start = *end = 0;
+	} else {
+		*start = idx->dirty_start;
+		*end = idx->dirty_end;
+	}
+	return true;
+}
+
+void bgenv_clear_uservar_dirty(uint8_t *udata)
+{
+	USERVAR_INDEX *idx;
+
+	idx = udata ? uservar_index_get(udata) : NULL;
+	if (idx) {
+		idx->dirty_start = idx->dirty_end = 0;
+	}
+}
+
+int bgenv_set_uservar_capacity(uint8_t *udata, uint32_t capacity)
+{
+	USERVAR_INDEX *idx;
+
+	idx = udata ? uservar_index_get(udata) : NULL;
+	if (!idx || capacity == 0 || capacity > ENV_MEM_USERVARS) {
+		/* the capacity cannot be kept without an index */
+		return -EINVAL;
+	}
+	if (idx->tail >= capacity && idx->used < idx->tail) {
+		bgenv_compact_uservars(udata);
+		idx = uservar_index_get(udata);
+		if (!idx) {
+			return -EINVAL;
+		}
+	}
+	/* keep space for the terminating zero */
+	if (idx->tail && idx->tail >= capacity) {
+		return -ENOSPC;
+	}
+	idx->capacity = capacity == ENV_MEM_USERVARS ? 0 : capacity;
+	return 0;
+}
+
+uint8_t *bgenv_iter_uservar(uint8_t *udata, char *prefix, uint32_t *pos)
+{
+	USERVAR_INDEX *idx;
+	uint32_t lo, hi, mid, rsize;
+	size_t prefix_len;
+	uint8_t *p;
+	uint64_t type;
+
+	if (!udata || !pos) {
+		return NULL;
+	}
+	if (!prefix) {
+		prefix = "";
+	}
+	prefix_len = strlen(prefix);
+
+	/* With an index, *pos is the position in the sorted offsets plus one,
+	 * otherwise the offset of the next record plus one. 0 starts over. */
+	idx = uservar_index_get(udata);
+	if (idx && uservar_index_sort(idx)) {
+		if (*pos == 0) {
+			/* binary search for the first key not below prefix */
+			lo = 0;
+			hi = idx->num_sorted;
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				if (strcmp(uservar_key(udata +
+						       idx->sorted[mid]),
+					   prefix) < 0) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			*pos = lo + 1;
+		}
+		if (*pos - 1 >= idx->num_sorted) {
+			return NULL;
+		}
+		p = udata + idx->sorted[*pos - 1];
+		if (strncmp(uservar_key(p), prefix, prefix_len) != 0) {
+			/* past the range of keys with this prefix */
+			*pos = idx->num_sorted + 1;
+			return NULL;
+		}
+		(*pos)++;
+		return p;
+	}
+
+	if (*pos == 0) {
+		*pos = 1;
+	}
+	while (*pos - 1 < ENV_MEM_USERVARS && udata[*pos - 1]) {
+		p = udata + *pos - 1;
+		bgenv_map_uservar(p, NULL, &type, NULL, &rsize, NULL);
+		*pos += rsize;
+		if ((type & USERVAR_TYPE_DELETED) == 0 &&
+		    strncmp(uservar_key(p), prefix, prefix_len) == 0 &&
+		    bgenv_find_uservar(udata, uservar_key(p)) == p) {
+			return p;
+		}
+	}
+	return NULL;
+}
@@ -31,6 +31,8 @@
 #define USERVAR_TYPE_STRING_ASCII      32
 #define USERVAR_TYPE_BOOL	       64
 #define USERVAR_TYPE_DELETED  (1ULL << 63)
+#define USERVAR_TYPE_SLACK    (1ULL << 62)
+#define USERVAR_TYPE_BLOB     (1ULL << 61)
 #define USERVAR_TYPE_DEFAULT		0
 
 #define USERVAR_STANDARD_TYPE_MASK ((1ULL << 32) - 1)
@@ -40,12 +42,120 @@ typedef struct {
 	void *gc_registry;
 } ebgenv_t;
 
+typedef struct {
+	char *key;
+	uint64_t type;
+	uint8_t *value;
+	uint32_t datalen;
+} ebgenv_var_t;
+
+typedef struct {
+	uint32_t revision;
+	uint8_t ustate;
+	uint8_t in_progress;
+	uint16_t watchdog_timeout_sec;
+	bool verified;	/* user variables loaded and checksum verified */
+} ebgenv_summary_t;
+
+typedef struct {
+	uint32_t live;	/* bytes used by variables */
+	uint32_t dead;	/* bytes used by deleted variables */
+	uint32_t slack;	/* bytes reserved for growing variables */
+	uint32_t free;	/* bytes behind the last record */
+} ebgenv_user_stats_t;
+
+typedef struct {
+	void *bgenv;
+	char *prefix;
+	uint32_t pos;
+} ebgenv_iter_t;
+
 /** @brief Tell the library to output information for the user.
  *  @param e A pointer to an ebgenv_t context.
  *  @param v A boolean to set verbosity.
  */
 void ebg_beverbose(ebgenv_t *e, bool v);
 
+/** @brief Tell the library to store user variables compressed. Both
+ *         compressed and plain environments are read transparently.
+ *         Compressed environments are written to files of variable size,
+ *         which older versions of the library do not read. The space for
+ *         user variables stays the same.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param v A boolean to enable compression when writing.
+ */
+void ebg_env_compress(ebgenv_t *e, bool v);
+
+/** @brief Tell the library to access config partitions which are not
+ *         mounted by reading and writing the FAT file system on the raw
+ *         partition, instead of mounting it. This needs no mount
+ *         privileges, but blobs are not available then.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param v A boolean to enable raw access.
+ */
+void ebg_env_raw_io(ebgenv_t *e, bool v);
+
+/** @brief Tell the library to read the environments of all config
+ *         partitions in parallel, one thread per partition, and verify
+ *         each as soon as it is read.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param v A boolean to enable parallel reads.
+ */
+void ebg_env_parallel_reads(ebgenv_t *e, bool v);
+
+/** @brief Tell the library to read only the fixed fields of each
+ *         environment, like revision and ustate, when initializing. User
+ *         variables are read and the checksum is verified when an
+ *         environment is opened, or when its fixed fields decide the
+ *         global state. Other fixed fields, like those reported by
+ *         ebg_env_list, may come from a corrupt environment until then,
+ *         which is cleared and ignored once verified.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param v A boolean to enable lazy loading.
+ */
+void ebg_env_lazy_load(ebgenv_t *e, bool v);
+
+/** @brief Limit the time spent looking for config partitions. A block
+ *         device whose partition table is not read within device_ms, or
+ *         before total_ms have passed since the search started, is
+ *         skipped with a warning. By default, there is no limit.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param device_ms deadline per block device in milliseconds, 0 for none
+ *  @param total_ms deadline for all block devices in milliseconds, 0 for
+ *         none
+ */
+void ebg_env_probe_timeouts(ebgenv_t *e, unsigned int device_ms,
+			    unsigned int total_ms);
+
+/** @brief Search all block devices for config partitions on the next
+ *         open instead of taking them from the discovery cache. The cache
+ *         is dropped whenever block devices change, but not when an
+ *         environment file is created on an existing partition, so this
+ *         has to be called after doing so.
+ *  @param e A pointer to an ebgenv_t context.
+ */
+void ebg_env_rescan(ebgenv_t *e);
+
+/** @brief Get the fixed fields of the environments of all config
+ *         partitions. If no environment is open, the config partitions are
+ *         probed and read, which is cheapest in lazy mode. The fields of
+ *         a summary not marked as verified are not checked against the
+ *         checksum of their environment.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param list destination for one summary per config partition
+ *  @param count in: number of elements of list, out: number of config
+ *         partitions
+ *  @return 0 on success, ENOBUFS if list is too small, errno on failure
+ */
+int ebg_env_list(ebgenv_t *e, ebgenv_summary_t *list, uint32_t *count);
+
+/** @brief Get the number of writes skipped because the environment was
+ *         unchanged since it was read or last written
+ *  @param e A pointer to an ebgenv_t context.
+ *  @return number of skipped writes since the library was loaded
+ */
+uint32_t ebg_env_skipped_writes(ebgenv_t *e);
+
 /** @brief Initialize environment library and open environment. The first
  *         time this function is called, it will create a new environment with
  *         the highest revision number for update purposes. Every next time it
@@ -92,6 +202,18 @@ int ebg_env_set(ebgenv_t *e, char *key, char *value);
 int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t datatype, uint8_t *value,
 		   uint32_t datalen);
 
+/** @brief Store new content into many variables at once. User variables
+ *         are rewritten in a single pass over the user variable memory.
+ *         If a key occurs more than once, the last occurrence wins.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param vars array of variables, each with key, datatype, value and
+ *         length of the value as for ebg_env_set_ex
+ *  @param count number of elements in vars
+ *  @return 0 on success, -errno on failure. User variables are left
+ *          unchanged if they do not fit.
+ */
+int ebg_env_set_many(ebgenv_t *e, ebgenv_var_t *vars, uint32_t count);
+
 /** @brief Get content of user variable
  *  @param e A pointer to an ebgenv_t context.
  *  @param key name of the environment variable to retrieve
@@ -103,12 +225,108 @@ int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t datatype, uint8_t *value,
 int ebg_env_get_ex(ebgenv_t *e, char *key, uint64_t *datatype, uint8_t *buffer,
 		   uint32_t maxlen);
 
+/** @brief Get a read-only view of a user variable without copying it
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key name of the user variable to retrieve
+ *  @param datatype pointer to store the datatype into, may be NULL
+ *  @param value pointer to store the address of the value into. The value
+ *         stays valid until a variable is changed or the environment is
+ *         closed.
+ *  @param datalen pointer to store the length of the value into, may be
+ *         NULL
+ *  @return 0 on success, -errno on failure
+ */
+int ebg_env_get_view(ebgenv_t *e, char *key, uint64_t *datatype,
+		     const uint8_t **value, uint32_t *datalen);
+
+/** @brief Get a writable view of a user variable to change its value in
+ *         place. The length of the value cannot be changed this way. The
+ *         environment is marked as changed.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key name of the user variable to retrieve
+ *  @param datatype pointer to store the datatype into, may be NULL
+ *  @param value pointer to store the address of the value into, valid as
+ *         for ebg_env_get_view
+ *  @param datalen pointer to store the length of the value into, may be
+ *         NULL
+ *  @return 0 on success, -errno on failure
+ */
+int ebg_env_get_view_rw(ebgenv_t *e, char *key, uint64_t *datatype,
+			uint8_t **value, uint32_t *datalen);
+
 /** @brief Get available space for user variables
  *  @param e A pointer to an ebgenv_t context.
  *  @return Free space in bytes
  */
 uint32_t ebg_env_user_free(ebgenv_t *e);
 
+/** @brief Defer compaction of user variables. Deleted variables are kept
+ *         as dead space and every variable is followed by slack space, so
+ *         that values can grow or shrink in place. Dead and slack space is
+ *         reclaimed by ebg_env_close or when space runs out.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param defer true to enable deferred compaction, false to disable it
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_defer_compaction(ebgenv_t *e, bool defer);
+
+/** @brief Set the space for user variables of the current environment. With
+ *         a capacity, the environment file records it and holds only the
+ *         used part of the user variables, so that its size follows the
+ *         data. The file is rewritten in its new format by ebg_env_close.
+ *         Files on partitions accessed without mounting cannot change
+ *         their size.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param capacity space for user variables in bytes, 0 for files of fixed
+ *         size
+ *  @return 0 on success, EINVAL if capacity is too large, ENOSPC if the
+ *          user variables do not fit, errno on failure
+ */
+int ebg_env_set_capacity(ebgenv_t *e, uint32_t capacity);
+
+/** @brief Store user variables in the compact record format, which encodes
+ *         sizes and types as variable-length numbers. Variables in the
+ *         legacy format are converted by ebg_env_close.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param compact true to write compact records, false for legacy records
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_use_compact_records(ebgenv_t *e, bool compact);
+
+/** @brief Get fragmentation statistics of the user variable memory
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param stats destination for live, dead, slack and free bytes
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_user_stats(ebgenv_t *e, ebgenv_user_stats_t *stats);
+
+/** @brief Start iterating over user variables
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param it A pointer to the iterator to initialize
+ *  @param prefix only visit keys starting with prefix, NULL or "" for all
+ *  @return 0 on success, -errno on failure, like ebg_env_iter_next
+ */
+int ebg_env_iter_begin(ebgenv_t *e, ebgenv_iter_t *it, char *prefix);
+
+/** @brief Get the next user variable of an iteration. Key and value point
+ *         into the environment and stay valid until a variable is changed.
+ *         Changing variables during an iteration invalidates the iterator.
+ *  @param it A pointer to an iterator initialized by ebg_env_iter_begin
+ *  @param key pointer to store the key of the variable into
+ *  @param datatype pointer to store the datatype of the variable into
+ *  @param value pointer to store the address of the value into
+ *  @param datalen pointer to store the length of the value into
+ *  @return 0 on success, -ENOENT if there are no more variables, -errno on
+ *          failure. Any of key, datatype, value and datalen may be NULL.
+ */
+int ebg_env_iter_next(ebgenv_iter_t *it, char **key, uint64_t *datatype,
+		      uint8_t **value, uint32_t *datalen);
+
+/** @brief Finish an iteration and release its resources
+ *  @param it A pointer to an iterator initialized by ebg_env_iter_begin
+ */
+void ebg_env_iter_end(ebgenv_iter_t *it);
+
 /** @brief Get global ustate value, accounting for all environments
  *  @param e A pointer to an ebgenv_t context.
  *  @return ustate value
@@ -138,6 +356,14 @@ int ebg_env_close(ebgenv_t *e);
  */
 int ebg_env_register_gc_var(ebgenv_t *e, char *key);
 
+/** @brief Register a glob pattern, e.g. "swu.*", whose matching variables
+ *         will be deleted on finalize
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param pattern A shell wildcard pattern as understood by fnmatch(3)
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_register_gc_pattern(ebgenv_t *e, char *pattern);
+
 /** @brief Finalizes a currently running update procedure
  *  @param e A pointer to an ebgenv_t context.
  *  @return 0 on success, errno on failure
@@ -29,6 +29,18 @@
 
 #define DEV_FILENAME_LEN 256
 
+/* Number of block devices probed at the same time */
+#define PED_PROBE_WORKERS 8
+
+/* Default deadlines in milliseconds for probing a single block device and
+ * all of them, 0 for none. Slow or spinning up disks may hold the config
+ * partition, so they are waited for unless a deadline is set. */
+#define PED_PROBE_DEVICE_TIMEOUT_MS 0
+#define PED_PROBE_TOTAL_TIMEOUT_MS 0
+
+/* GPT partition GUID, or MBR disk signature and partition number */
+#define PART_UUID_LEN 37
+
 #ifndef VERBOSE
 #define VERBOSE(o, ...)                                                        \
 	if (verbosity) fprintf(o, __VA_ARGS__)
@@ -50,6 +62,7 @@
 #include <stdlib.h>
 
 #define SYSBLOCKDIR "/sys/block"
+#define SYSDEVBLOCKDIR "/sys/dev/block"
 #define DEVDIR "/dev"
 
 #define LB_SIZE 512
@@ -64,8 +77,19 @@
 #define MBR_TYPE_FAT16_LBA 0x0E
 #define MBR_TYPE_EXTENDED_LBA 0x0F
 
-#define GPT_PARTITION_GUID_FAT_NTFS "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7"
-#define GPT_PARTITION_GUID_ESP "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
+/* Type GUIDs in the byte order of partition entries */
+/* EBD0A0A2-B9E5-4433-87C0-68B6B72699C7 */
+#define GPT_PARTITION_GUID_FAT_NTFS                                            \
+	{0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,                       \
+	 0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7}
+/* C12A7328-F81F-11D2-BA4B-00A0C93EC93B */
+#define GPT_PARTITION_GUID_ESP                                                 \
+	{0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,                       \
+	 0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B}
+
+/* Bounds of the partition entry array read at once */
+#define GPT_MAX_ENTRY_SIZE 4096
+#define GPT_MAX_TABLE_SIZE (1024 * 1024)
 
 #pragma pack(push)
 #pragma pack(1)
@@ -119,6 +143,12 @@ typedef struct _PedFileSystemType {
 typedef struct _PedPartition {
 	PedFileSystemType *fs_type;
 	uint16_t num;
+	char uuid[PART_UUID_LEN];
+	/* device node of the partition */
+	char *path;
+	/* first sector, if the partition was listed by the kernel or is a
+	 * FAT partition of a GPT */
+	uint64_t start;
 	struct _PedPartition *next;
 } PedPartition;
 
@@ -133,12 +163,23 @@ typedef struct _PedDisk {
 	PedPartition *part_list;
 } PedDisk;
 
+typedef enum {
+	PED_PROBE_NONE,
+	PED_PROBE_FOUND,
+	PED_PROBE_TIMEOUT
+} PedProbeResult;
+
 void ped_device_probe_all(void);
+void ped_device_probe(PedDevice **devs, PedProbeResult *result, size_t count);
+void ped_device_set_probe_timeouts(unsigned int device_ms,
+				   unsigned int total_ms);
 PedDevice *ped_device_get_next(const PedDevice *dev);
 PedDisk *ped_disk_new(const PedDevice *dev);
 PedPartition *ped_disk_next_partition(const PedDisk *pd,
 				      const PedPartition *part);
 
+bool ped_partition_get_uuid(const char *devpath, uint16_t num, char *uuid);
+
 void ebgpart_beverbose(bool v);
 
 #endif // __EBGPART_H__
@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include "config.h"
 #include <zlib.h>
 #include "envdata.h"
@@ -42,11 +43,20 @@
 #endif
 
 extern bool bgenv_verbosity;
+extern bool bgenv_compression;
+extern bool bgenv_raw_io;
+extern bool bgenv_parallel_reads;
+extern bool bgenv_lazy_loading;
+extern uint32_t bgenv_skipped_writes;
 
 #define VERBOSE(o, ...)                                                       \
 	if (bgenv_verbosity)                                                    \
 	fprintf(o, __VA_ARGS__)
 
+/* Marker of compressed user variables on disk, see compress_env() */
+#define USERDATA_ZLIB 0xFF
+#define USERDATA_ZLIB_HEADER_SIZE (1 + sizeof(uint32_t))
+
 typedef enum {
 	EBGENV_KERNELFILE,
 	EBGENV_KERNELPARAMS,
@@ -61,28 +71,72 @@ typedef struct {
 	char *devpath;
 	char *mountpoint;
 	bool not_mounted;
+	/* process owning the temporary mount */
+	pid_t mount_owner;
+	/* accessed with env_fat_raw instead of mounting */
+	bool raw;
 } CONFIG_PART;
 
 typedef struct {
 	void *desc;
 	BG_ENVDATA *data;
+	bool dirty;		/* data was changed through this handle */
+	bool blobs_changed;	/* blob files may have become unreferenced */
 } BGENV;
 
+/* Value of a user variable of type USERVAR_TYPE_BLOB, referring to the file
+ * on the same config partition that holds the data */
+#pragma pack(push)
+#pragma pack(1)
+typedef struct {
+	uint32_t id;
+	uint32_t size;
+	uint32_t crc32;
+} BLOB_REF;
+#pragma pack(pop)
+
 typedef struct gc_item {
 	char *key;
+	uint32_t hash;
+	uint32_t prefix_len;
 	struct gc_item *next;
 } GC_ITEM;
 
+/* Variables deleted on finalize: keys are kept in a hash set, patterns are
+ * either plain prefixes (prefix_len is set) or fnmatch globs. */
+typedef struct {
+	GC_ITEM **buckets;
+	uint32_t num_buckets;
+	uint32_t num_keys;
+	GC_ITEM *patterns;
+} GC_SET;
+
 extern void bgenv_be_verbose(bool v);
+extern void bgenv_be_compressing(bool v);
+extern void bgenv_use_raw_io(bool v);
+extern void bgenv_use_parallel_reads(bool v);
+extern void bgenv_use_lazy_loading(bool v);
+extern void bgenv_set_probe_timeouts(unsigned int device_ms,
+				     unsigned int total_ms);
+extern bool compress_env(BG_ENVDATA *env);
+extern bool decompress_env(BG_ENVDATA *env);
 
 extern char *str16to8(char *buffer, wchar_t *src);
 extern wchar_t *str8to16(wchar_t *buffer, char *src);
 
 extern bool bgenv_init(void);
+extern void bgenv_release_mounts(void);
 extern BGENV *bgenv_open_by_index(uint32_t index);
 extern BGENV *bgenv_open_oldest(void);
 extern BGENV *bgenv_open_latest(void);
+extern uint32_t bgenv_select_index(bool latest);
+extern uint32_t bgenv_select_verified(bool latest);
+extern bool bgenv_verify(uint32_t index);
+extern bool bgenv_get_summary(uint32_t index, ebgenv_summary_t *summary);
 extern bool bgenv_write(BGENV *env);
+extern void bgenv_mark_dirty(BGENV *env, void *start, uint32_t len);
+extern uint32_t bgenv_get_skipped_writes(void);
+extern bool bgenv_set_capacity(BGENV *env, uint32_t capacity);
 extern BG_ENVDATA *bgenv_read(BGENV *env);
 extern bool bgenv_close(BGENV *env);
 
@@ -91,6 +145,11 @@ extern int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 		     uint32_t maxlen);
 extern int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 		     uint32_t datalen);
+extern int bgenv_set_many(BGENV *env, ebgenv_var_t *vars, uint32_t count);
+extern int bgenv_get_view(BGENV *env, char *key, uint64_t *type,
+			  uint8_t **value, uint32_t *datalen, bool writable);
+extern bool bgenv_has_blobs(BGENV *env);
+extern bool bgenv_copy_blobs(BGENV *dst, BGENV *src);
 extern uint8_t *bgenv_find_uservar(uint8_t *userdata, char *key);
 
 #endif // __ENV_API_H__
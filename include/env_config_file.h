@@ -15,7 +15,13 @@
 #ifndef __ENV_CONFIG_FILE_H__
 #define __ENV_CONFIG_FILE_H__
 
+/* Blob variables keep their values in files next to the environment */
+#define BLOB_FILENAME_FORMAT "%08X.BLB"
+
 FILE *open_config_file(CONFIG_PART *cfgpart, char *mode);
+FILE *open_blob_file(CONFIG_PART *cfgpart, uint32_t id, char *mode);
+int remove_blob_file(CONFIG_PART *cfgpart, uint32_t id);
+bool list_blob_files(CONFIG_PART *cfgpart, uint32_t **ids, uint32_t *count);
 int close_config_file(FILE *config_file_handle);
 bool probe_config_file(CONFIG_PART *cfgpart);
 
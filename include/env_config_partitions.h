@@ -15,6 +15,11 @@
 #ifndef __ENV_CONFIG_PARTITIONS_H__
 #define __ENV_CONFIG_PARTITIONS_H__
 
+extern char *bgenv_discovery_cache;
+extern const char *uevent_seqnum_path;
+
+void bgenv_use_discovery_cache(char *path);
+void bgenv_drop_discovery_cache(void);
 bool probe_config_partitions(CONFIG_PART *cfgpart);
 
 #endif // __ENV_CONFIG_PARTITIONS_H__
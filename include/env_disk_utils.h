@@ -15,6 +15,9 @@
 #ifndef __ENV_DISK_UTILS_H__
 #define __ENV_DISK_UTILS_H__
 
+extern const char *mountinfo_path;
+
+void mount_table_release(void);
 char *get_mountpoint(char *devpath);
 bool mount_partition(CONFIG_PART *cfgpart);
 void unmount_partition(CONFIG_PART *cfgpart);
@@ -0,0 +1,63 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#ifndef __ENV_FAT_RAW_H__
+#define __ENV_FAT_RAW_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FAT_RAW_CACHE_SIZE 4096
+
+/* A FAT12/16/32 file system accessed with pread/pwrite on the raw
+ * partition, without mounting it. */
+typedef struct {
+	int fd;
+	uint8_t type;
+	uint32_t cluster_size;
+	uint32_t num_clusters;
+	uint64_t fat_offset;
+	uint32_t fat_bytes;
+	/* fixed root directory of FAT12/16 */
+	uint64_t root_offset;
+	uint32_t root_bytes;
+	/* root directory cluster of FAT32 */
+	uint32_t root_cluster;
+	uint64_t data_offset;
+	/* window of the first FAT for following cluster chains */
+	uint8_t cache[FAT_RAW_CACHE_SIZE];
+	uint32_t cache_start;
+	uint32_t cache_len;
+} FAT_RAW;
+
+typedef struct {
+	uint32_t cluster;
+	uint32_t size;
+} FAT_RAW_FILE;
+
+bool fat_raw_open(FAT_RAW *fs, char *devpath, bool writable);
+void fat_raw_close(FAT_RAW *fs);
+bool fat_raw_lookup(FAT_RAW *fs, char *name, FAT_RAW_FILE *file);
+bool fat_raw_read(FAT_RAW *fs, FAT_RAW_FILE *file, void *buffer,
+		  uint32_t len);
+bool fat_raw_write(FAT_RAW *fs, FAT_RAW_FILE *file, void *buffer,
+		   uint32_t len);
+
+bool fat_raw_probe_file(char *devpath, char *name, uint32_t *size);
+bool fat_raw_read_file(char *devpath, char *name, void *buffer,
+		       uint32_t *len);
+bool fat_raw_write_file(char *devpath, char *name, void *buffer,
+			uint32_t len);
+
+#endif // __ENV_FAT_RAW_H__
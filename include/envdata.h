@@ -47,4 +47,29 @@ struct _BG_ENVDATA {
 
 typedef struct _BG_ENVDATA BG_ENVDATA;
 
+/* Fixed fields in front of the user variables */
+#define ENV_HEADER_SIZE \
+	(sizeof(BG_ENVDATA) - ENV_MEM_USERVARS - sizeof(uint32_t))
+
+#define ENV_FOOTER_MAGIC 0x53474245	/* "EBGS" */
+/* Marks files holding zlib compressed user variables, which only readers
+ * knowing this magic accept */
+#define ENV_FOOTER_MAGIC_ZLIB 0x5A474245	/* "EBGZ" */
+
+/* Environment files of exactly sizeof(BG_ENVDATA) bytes hold the structure
+ * above. Files of variable size hold the fixed fields, the first used bytes
+ * of the user variables and this footer. The missing user variable bytes
+ * are zero. The checksum covers the file up to the checksum itself. */
+#pragma pack(push)
+#pragma pack(1)
+struct _BG_ENVFOOTER {
+	uint32_t capacity;	/* space for user variables */
+	uint32_t used;		/* bytes of user variables in the file */
+	uint32_t magic;
+	uint32_t crc32;
+};
+#pragma pack(pop)
+
+typedef struct _BG_ENVFOOTER BG_ENVFOOTER;
+
 #endif // __H_ENV_DATA__
@@ -16,6 +16,15 @@
 #define __USER_VARS_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "ebgenv.h"
+
+/* Markers of compact records, see bgenv_map_uservar() */
+#define USERVAR_COMPACT 0xFE
+#define USERVAR_COMPACT_DELETED 0xFD
+#define USERVAR_COMPACT_TYPE_EXT 0x80
+
+typedef bool (*uservar_filter_t)(char *key, uint64_t type, void *ctx);
 
 void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type,
 		       uint8_t **val, uint32_t *record_size,
@@ -27,7 +36,9 @@ int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
 		      uint32_t maxlen);
 int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 	              uint32_t datalen);
+int bgenv_set_uservars(uint8_t *udata, ebgenv_var_t *vars, uint32_t count);
 
+uint32_t bgenv_uservar_hash(char *key);
 uint8_t *bgenv_find_uservar(uint8_t *udata, char *key);
 uint8_t *bgenv_next_uservar(uint8_t *udata);
 
@@ -37,4 +48,22 @@ uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 void bgenv_del_uservar(uint8_t *udata, uint8_t *var);
 uint32_t bgenv_user_free(uint8_t *udata);
 
+bool bgenv_build_uservar_index(uint8_t *udata);
+void bgenv_drop_uservar_index(uint8_t *udata);
+
+bool bgenv_defer_uservar_compaction(uint8_t *udata, bool enable);
+void bgenv_compact_uservars(uint8_t *udata);
+bool bgenv_use_compact_uservars(uint8_t *udata, bool enable);
+uint32_t bgenv_del_uservars_matching(uint8_t *udata, uservar_filter_t match,
+				     void *ctx);
+void bgenv_uservar_stats(uint8_t *udata, ebgenv_user_stats_t *stats);
+
+uint8_t *bgenv_iter_uservar(uint8_t *udata, char *prefix, uint32_t *pos);
+
+void bgenv_mark_uservar_dirty(uint8_t *udata, uint8_t *p, uint32_t len);
+bool bgenv_uservar_dirty_range(uint8_t *udata, uint32_t *start,
+			       uint32_t *end);
+void bgenv_clear_uservar_dirty(uint8_t *udata);
+int bgenv_set_uservar_capacity(uint8_t *udata, uint32_t capacity);
+
 #endif // __USER_VARS_H__
@@ -16,6 +16,8 @@
 
 #include "env_api.h"
 #include "ebgenv.h"
+#include "ebgpart.h"
+#include "env_config_partitions.h"
 #include "uservars.h"
 #include "version.h"
 
@@ -38,6 +40,19 @@ static struct argp_option options_setenv[] = {
     {"confirm", 'c', 0, 0, "Confirm working environment"},
     {"update", 'u', 0, 0, "Automatically update oldest revision"},
     {"verbose", 'v', 0, 0, "Be verbose"},
+    {"raw", 'R', 0, 0, "Access unmounted config partitions without "
+		       "mounting them"},
+    {"probe-timeout", 'T', "MS[,TOTAL_MS]", 0, "Skip block devices whose "
+					      "partition table is not read "
+					      "within MS milliseconds, or "
+					      "within TOTAL_MS for all of "
+					      "them. 0 waits without limit"},
+    {"rescan", 'S', 0, 0, "Search all block devices for config partitions "
+			  "instead of using the cached ones"},
+    {"capacity", 'C', "BYTES", 0, "Store the environment in a file sized to "
+				  "its user variables, with space for BYTES "
+				  "of them. 0 selects files of fixed "
+				  "size."},
     {"uservar", 'x', "KEY=VAL", 0, "Set user-defined string variable. For "
 				   "setting multiple variables, use this "
 				   "option multiple times."},
@@ -49,6 +64,15 @@ static struct argp_option options_setenv[] = {
 
 static struct argp_option options_printenv[] = {
     {"verbose", 'v', 0, 0, "Be verbose"},
+    {"raw", 'R', 0, 0, "Access unmounted config partitions without "
+		       "mounting them"},
+    {"probe-timeout", 'T', "MS[,TOTAL_MS]", 0, "Skip block devices whose "
+					      "partition table is not read "
+					      "within MS milliseconds, or "
+					      "within TOTAL_MS for all of "
+					      "them. 0 waits without limit"},
+    {"rescan", 'S', 0, 0, "Search all block devices for config partitions "
+			  "instead of using the cached ones"},
     {"version", 'V', 0, 0, "Print version"},
     {0}};
 
@@ -169,6 +193,9 @@ static bool verbosity = false;
 
 static char *envfilepath = NULL;
 
+/* user variable capacity of the updated environment file, -1 to keep it */
+static int capacity = -1;
+
 static char *ustatemap[] = {"OK", "INSTALLED", "TESTING", "FAILED", "UNKNOWN"};
 
 static uint8_t str2ustate(char *str)
@@ -229,6 +256,30 @@ static int parse_int(char *arg)
 	return i;
 }
 
+/* Parse MS[,TOTAL_MS] of --probe-timeout */
+static int parse_timeouts(char *arg)
+{
+	unsigned long device_ms, total_ms = PED_PROBE_TOTAL_TIMEOUT_MS;
+	char *end;
+
+	errno = 0;
+	device_ms = strtoul(arg, &end, 10);
+	if (*end == ',') {
+		char *total = end + 1;
+
+		total_ms = strtoul(total, &end, 10);
+		if (end == total) {
+			return EINVAL;
+		}
+	}
+	if (errno || end == arg || *end || strchr(arg, '-') ||
+	    device_ms > UINT_MAX || total_ms > UINT_MAX) {
+		return EINVAL;
+	}
+	bgenv_set_probe_timeouts(device_ms, total_ms);
+	return 0;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct arguments *arguments = state->input;
@@ -381,6 +432,26 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		/* Set verbosity in the library */
 		bgenv_be_verbose(true);
 		break;
+	case 'R':
+		bgenv_use_raw_io(true);
+		break;
+	case 'S':
+		bgenv_drop_discovery_cache();
+		break;
+	case 'T':
+		if (parse_timeouts(arg) != 0) {
+			fprintf(stderr, "Invalid probe timeout specified.\n");
+			return 1;
+		}
+		break;
+	case 'C':
+		i = parse_int(arg);
+		if (errno || i < 0 || i > ENV_MEM_USERVARS) {
+			fprintf(stderr, "Invalid capacity specified.\n");
+			return 1;
+		}
+		capacity = i;
+		break;
 	case 'x':
 		/* Set user-defined variable(s) */
 		e = set_uservars(arg);
@@ -414,6 +485,10 @@ static void dump_uservars(uint8_t *udata)
 	while (*udata) {
 		bgenv_map_uservar(udata, &key, &type, (uint8_t **)&value,
 				  &rsize, &dsize);
+		if (type & USERVAR_TYPE_DELETED) {
+			udata = bgenv_next_uservar(udata);
+			continue;
+		}
 		fprintf(stdout, "%s ", key);
 		type &= USERVAR_STANDARD_TYPE_MASK;
 		if (type == USERVAR_TYPE_STRING_ASCII) {
@@ -579,6 +654,11 @@ int main(int argc, char **argv)
 		BGENV env;
 		BG_ENVDATA data;
 
+		if (capacity >= 0) {
+			fprintf(stderr, "Capacity cannot be set for output "
+					"to file.\n");
+			return 1;
+		}
 		memset(&env, 0, sizeof(BGENV));
 		memset(&data, 0, sizeof(BG_ENVDATA));
 		env.data = &data;
@@ -653,9 +733,23 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
+		/* files of blobs of the replaced data become unreferenced */
+		bool had_blobs = bgenv_has_blobs(env_new);
 		memcpy((char *)env_new->data, (char *)env_current->data,
 		       sizeof(BG_ENVDATA));
 		env_new->data->revision = env_current->data->revision + 1;
+		(void)bgenv_build_uservar_index(env_new->data->userdata);
+		bgenv_mark_dirty(env_new, env_new->data, sizeof(BG_ENVDATA));
+		/* blob files live on the config partition of each env */
+		if (!bgenv_copy_blobs(env_new, env_current)) {
+			fprintf(stderr, "Error copying blob variables.\n");
+			bgenv_close(env_new);
+			bgenv_close(env_current);
+			return 1;
+		}
+		if (had_blobs) {
+			env_new->blobs_changed = true;
+		}
 
 		if (!bgenv_close(env_current)) {
 			fprintf(stderr, "Error closing environment.\n");
@@ -673,6 +767,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (capacity >= 0 && !bgenv_set_capacity(env_new, capacity)) {
+		fprintf(stderr, "Error setting capacity: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
 	update_environment(env_new);
 
 	if (verbosity) {
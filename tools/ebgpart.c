@@ -18,10 +18,12 @@
 
 #include "ebgpart.h"
 #include <sys/sysmacros.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
 
 static PedDevice *first_device = NULL;
 static PedDisk g_ped_dummy_disk;
-static char buffer[37];
 
 static bool verbosity = false;
 
@@ -43,14 +45,25 @@ static void add_block_dev(PedDevice *dev)
 	d->next = dev;
 }
 
-static char *GUID_to_str(uint8_t *g)
+static const uint8_t GPT_type_FAT_NTFS[16] = GPT_PARTITION_GUID_FAT_NTFS;
+static const uint8_t GPT_type_ESP[16] = GPT_PARTITION_GUID_ESP;
+
+static char *GUID_to_str(uint8_t *g, char *str)
 {
-	(void)snprintf(buffer, 37,
+	(void)snprintf(str, PART_UUID_LEN,
 		       "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
 		       "%02X%02X%02X%02X%02X%02X",
 		 g[3], g[2], g[1], g[0], g[5], g[4], g[7], g[6], g[8], g[9],
 		 g[10], g[11], g[12], g[13], g[14], g[15]);
-	return buffer;
+	return str;
+}
+
+static void MBR_uuid(struct Masterbootrecord *mbr, uint16_t num, char *uuid)
+{
+	uint8_t *s = (uint8_t *)mbr->devsignature;
+
+	(void)snprintf(uuid, PART_UUID_LEN, "%02X%02X%02X%02X-%02X", s[3],
+		       s[2], s[1], s[0], num);
 }
 
 static char *type_to_name(char t)
@@ -72,133 +85,172 @@ static char *type_to_name(char t)
 	return "not supported";
 }
 
-static bool check_GPT_FAT_entry(int fd, struct EFIpartitionentry *e,
-				PedFileSystemType *pfst, uint32_t i)
+/* Tell FAT12/16 from FAT32 by the Id strings of the boot sector */
+static char *GPT_FAT_name(uint8_t *sector)
 {
-	if (strcmp(GPT_PARTITION_GUID_FAT_NTFS, GUID_to_str(e->type_GUID)) !=
-		0 &&
-	    strcmp(GPT_PARTITION_GUID_ESP, GUID_to_str(e->type_GUID)) != 0) {
-		if (asprintf(&pfst->name, "%s", "not supported") == -1) {
-			goto error_asprintf;
-		}
-		return true;
+	if (memcmp(sector + 0x36, "FAT12   ", 8) == 0) {
+		return "fat12";
+	} else if (memcmp(sector + 0x36, "FAT16   ", 8) == 0) {
+		return "fat16";
+	} else if (memcmp(sector + 0x52, "FAT12   ", 8) == 0) {
+		/* Id field of FAT32 */
+		return "fat12";
+	} else if (memcmp(sector + 0x52, "FAT16   ", 8) == 0) {
+		return "fat16";
 	}
-	VERBOSE(stdout, "GPT Partition #%u is FAT/NTFS.\n", i);
-	/* Save current file offset */
-	off64_t curr = lseek64(fd, 0, SEEK_CUR);
-	if (curr == -1) {
-		VERBOSE(stderr, "Error getting current seek position: %s\n",
-			strerror(errno));
-		return false;
+	return "fat32";
+}
+
+static int compare_start(const void *a, const void *b)
+{
+	uint64_t sa = (*(PedPartition * const *)a)->start;
+	uint64_t sb = (*(PedPartition * const *)b)->start;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+/* Read the boot sectors of the FAT partitions of a GPT, marked by a file
+ * system type without name, in one pass after all partition entries are
+ * known, in the order of their position on the disk. Partitions whose boot
+ * sector cannot be read are dropped. */
+static void GPT_FAT_types(int fd, PedDevice *dev)
+{
+	PedPartition **fat = NULL, **pp, *p;
+	uint8_t sector[LB_SIZE];
+	size_t count = 0;
+
+	for (p = dev->part_list; p; p = p->next) {
+		count += p->fs_type->name == NULL;
 	}
-	/* Look if it is a FAT12 or FAT16 */
-	off64_t dest = (off64_t)e->start_LBA * LB_SIZE + 0x36;
-	if (lseek64(fd, dest, SEEK_SET) == -1) {
-		VERBOSE(stderr, "Error seeking FAT12/16 Id String: %s\n",
-			strerror(errno));
-		return false;
+	if (count && !(fat = malloc(count * sizeof(PedPartition *)))) {
+		VERBOSE(stderr, "Out of memory\n");
+		count = 0;
 	}
-	char FAT_id[9];
-	if (read(fd, FAT_id, 8) != 8) {
-		VERBOSE(stderr, "Error reading FAT12/16 Id String: %s\n",
-			strerror(errno));
-		return false;
-	};
-	FAT_id[8] = 0;
-	if (strcmp(FAT_id, "FAT12   ") != 0 &&
-	    strcmp(FAT_id, "FAT16   ") != 0) {
-		/* No FAT12/16 so read ID field for FAT32 */
-		dest = (off64_t)e->start_LBA * LB_SIZE + 0x52;
-		if (lseek64(fd, dest, SEEK_SET) == -1) {
-			VERBOSE(stderr, "Error seeking FAT32 Id String: %s\n",
-				strerror(errno));
-			return false;
+	if (count) {
+		count = 0;
+		for (p = dev->part_list; p; p = p->next) {
+			if (!p->fs_type->name) {
+				fat[count++] = p;
+			}
 		}
-		if (read(fd, FAT_id, 8) != 8) {
-			VERBOSE(stderr, "Error reading FAT32 Id String: %s\n",
-				strerror(errno));
-			return false;
+		qsort(fat, count, sizeof(PedPartition *), compare_start);
+		for (size_t i = 0; i < count; i++) {
+			p = fat[i];
+			if (pread(fd, sector, LB_SIZE,
+				  (off64_t)p->start * LB_SIZE) != LB_SIZE) {
+				VERBOSE(stderr,
+					"Error reading FAT boot sector: %s\n",
+					strerror(errno));
+				continue;
+			}
+			if (asprintf(&p->fs_type->name, "%s",
+				     GPT_FAT_name(sector)) == -1) {
+				VERBOSE(stderr, "Error in asprintf - possibly "
+						"out of memory.\n");
+				p->fs_type->name = NULL;
+				continue;
+			}
+			VERBOSE(stdout, "GPT Partition #%u is %s.\n",
+				p->num - 1, p->fs_type->name);
 		}
+		free(fat);
 	}
-	if (strcmp(FAT_id, "FAT12   ") == 0) {
-		if (asprintf(&pfst->name, "%s", "fat12") == -1) {
-			goto error_asprintf;
-		}
-	} else if (strcmp(FAT_id, "FAT16   ") == 0) {
-		if (asprintf(&pfst->name, "%s", "fat16") == -1) {
-			goto error_asprintf;
-		}
-	} else {
-		if (asprintf(&pfst->name, "%s", "fat32") == -1) {
-			goto error_asprintf;
+	for (pp = &dev->part_list; (p = *pp);) {
+		if (p->fs_type->name) {
+			pp = &p->next;
+			continue;
 		}
+		*pp = p->next;
+		free(p->fs_type);
+		free(p);
 	}
-	VERBOSE(stdout, "GPT Partition #%u is %s.\n", i, pfst->name);
-	if (lseek64(fd, curr, SEEK_SET) == -1) {
-		VERBOSE(stderr, "Error restoring seek position (%s)",
-			strerror(errno));
-		return false;
-	}
-	return true;
-
-error_asprintf:
-	VERBOSE(stderr, "Error in asprintf - possibly out of memory.\n");
-	return false;
 }
 
-static void read_GPT_entries(int fd, uint64_t table_LBA, uint32_t num,
+/* The partition entry array is read at once. The boot sectors of the FAT
+ * partitions are read after that, in one pass. */
+static void read_GPT_entries(int fd, struct EFIHeader *efihdr,
 			     PedDevice *dev)
 {
-	off64_t offset;
+	uint32_t num = efihdr->partitions;
+	uint32_t size = efihdr->partitionentrysize;
 	struct EFIpartitionentry e;
+	PedFileSystemType *pfst;
 	PedPartition *tmpp;
-	PedFileSystemType *pfst = NULL;
+	char guid[PART_UUID_LEN];
+	uint8_t *table;
+	size_t len;
 
-	offset = LB_SIZE * table_LBA;
-	if (lseek64(fd, offset, SEEK_SET) != offset) {
-		VERBOSE(stderr, "Error seeking EFI partition table\n");
+	if (size < sizeof(e) || size > GPT_MAX_ENTRY_SIZE || size % 8) {
+		VERBOSE(stderr, "Invalid size of partition entries: %u\n",
+			size);
+		return;
+	}
+	if (num > GPT_MAX_TABLE_SIZE / size) {
+		num = GPT_MAX_TABLE_SIZE / size;
+	}
+	len = ((size_t)num * size + LB_SIZE - 1) / LB_SIZE * LB_SIZE;
+	if (len == 0) {
+		return;
+	}
+	if (posix_memalign((void **)&table, LB_SIZE, len)) {
+		VERBOSE(stderr, "Out of memory\n");
+		return;
+	}
+	if (pread(fd, table, len,
+		  (off64_t)efihdr->partitiontable_LBA * LB_SIZE) !=
+	    (ssize_t)len) {
+		VERBOSE(stderr, "Error reading partition entries (%s)\n",
+			strerror(errno));
+		free(table);
 		return;
 	}
 
 	PedPartition **list_end = &dev->part_list;
 
 	for (uint32_t i = 0; i < num; i++) {
-		if (read(fd, &e, sizeof(e)) != sizeof(e)) {
-			VERBOSE(stderr, "Error reading partition entry\n");
-			VERBOSE(stderr, "(%s)\n", strerror(errno));
-			return;
-		}
+		memcpy(&e, table + (size_t)i * size, sizeof(e));
 		if ((*((uint64_t *)&e.type_GUID[0]) == 0) &&
 		    (*((uint64_t *)&e.type_GUID[8]) == 0)) {
-			return;
+			/* unused entry */
+			continue;
 		}
-		VERBOSE(stdout, "%u: %s\n", i, GUID_to_str(e.type_GUID));
+		VERBOSE(stdout, "%u: %s\n", i, GUID_to_str(e.type_GUID, guid));
 		pfst = calloc(sizeof(PedFileSystemType), 1);
 		if (!pfst) {
 			VERBOSE(stderr, "Out of memory\n");
-			return;
+			break;
 		}
 
 		tmpp = calloc(sizeof(PedPartition), 1);
 		if (!tmpp) {
 			VERBOSE(stderr, "Out of memory\n");
 			free(pfst);
-			return;
+			break;
 		}
 		tmpp->num = i + 1;
 		tmpp->fs_type = pfst;
+		GUID_to_str(e.partition_GUID, tmpp->uuid);
 
-		if (!check_GPT_FAT_entry(fd, &e, pfst, i)) {
-			free(pfst->name);
-			free(pfst);
-			free(tmpp);
-			dev->part_list = NULL;
-			continue;
+		if (memcmp(e.type_GUID, GPT_type_FAT_NTFS, 16) != 0 &&
+		    memcmp(e.type_GUID, GPT_type_ESP, 16) != 0) {
+			if (asprintf(&pfst->name, "%s", "not supported") ==
+			    -1) {
+				VERBOSE(stderr, "Out of memory\n");
+				free(pfst);
+				free(tmpp);
+				continue;
+			}
+		} else {
+			VERBOSE(stdout, "GPT Partition #%u is FAT/NTFS.\n", i);
+			/* named by GPT_FAT_types */
+			tmpp->start = e.start_LBA;
 		}
 
 		*list_end = tmpp;
 		list_end = &((*list_end)->next);
 	}
+	free(table);
+	GPT_FAT_types(fd, dev);
 }
 
 static void scanLogicalVolumes(int fd, off64_t extended_start_LBA,
@@ -262,17 +314,70 @@ scl_out_of_mem:
 	free(partition->next);
 }
 
+/* Name partition num of a disk like the kernel does, with a "p" in between
+ * if the name of the disk ends with a digit, e.g. nvme0n1p1 */
+static char *partition_path(const char *disk, uint16_t num)
+{
+	size_t len = strlen(disk);
+	char *path;
+
+	if (asprintf(&path, "%s%s%u", disk,
+		     len && isdigit((unsigned char)disk[len - 1]) ? "p" : "",
+		     num) == -1) {
+		return NULL;
+	}
+	return path;
+}
+
+/* Tell the file system of the partitions the kernel found by their boot
+ * sectors, as their types in the partition table are not known */
+static bool boot_sector_FAT_types(int fd, PedDevice *dev)
+{
+	uint8_t sector[LB_SIZE];
+
+	for (PedPartition *p = dev->part_list; p; p = p->next) {
+		char *name = "not supported";
+
+		if (pread(fd, sector, LB_SIZE, (off64_t)p->start * LB_SIZE) ==
+			LB_SIZE &&
+		    sector[510] == 0x55 && sector[511] == 0xaa) {
+			if (memcmp(sector + 0x36, "FAT12   ", 8) == 0) {
+				name = "fat12";
+			} else if (memcmp(sector + 0x36, "FAT16   ", 8) == 0) {
+				name = "fat16";
+			} else if (memcmp(sector + 0x52, "FAT32   ", 8) == 0) {
+				name = "fat32";
+			}
+		}
+		p->fs_type = calloc(sizeof(PedFileSystemType), 1);
+		if (!p->fs_type ||
+		    asprintf(&p->fs_type->name, "%s", name) == -1) {
+			VERBOSE(stderr, "Out of memory\n");
+			return false;
+		}
+		VERBOSE(stdout, "Partition #%u is %s.\n", p->num, name);
+	}
+	return true;
+}
+
 static bool check_partition_table(PedDevice *dev)
 {
 	int fd;
 	struct Masterbootrecord mbr;
 
 	VERBOSE(stdout, "Checking %s\n", dev->path);
-	fd = open(dev->path, O_RDONLY);
+	/* do not wait for media, e.g. of empty card readers */
+	fd = open(dev->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
 	if (fd < 0) {
 		VERBOSE(stderr, "Error opening block device.\n");
 		return false;
 	}
+	if (dev->part_list) {
+		/* partitions listed by the kernel */
+		bool result = boot_sector_FAT_types(fd, dev);
+		close(fd);
+		return result;
+	}
 	if (read(fd, &mbr, sizeof(mbr)) != sizeof(mbr)) {
 		VERBOSE(stderr, "Error reading mbr on %s.\n", dev->path);
 		close(fd);
@@ -299,14 +404,8 @@ static bool check_partition_table(PedDevice *dev)
 				mbr.parttable[i].start_LBA);
 			off64_t offset = LB_SIZE *
 			    (off64_t)mbr.parttable[i].start_LBA;
-			if (lseek64(fd, offset, SEEK_SET) != offset) {
-				VERBOSE(stderr, "Error seeking EFI Header\n.");
-				VERBOSE(stderr, "(%s)", strerror(errno));
-				close(fd);
-				return false;
-			}
 			struct EFIHeader efihdr;
-			if (read(fd, &efihdr, sizeof(efihdr)) !=
+			if (pread(fd, &efihdr, sizeof(efihdr), offset) !=
 			    sizeof(efihdr)) {
 				close(fd);
 				VERBOSE(stderr, "Error reading EFI Header\n.");
@@ -322,8 +421,7 @@ static bool check_partition_table(PedDevice *dev)
 				efihdr.partitions);
 			VERBOSE(stdout, "Partition Table @ LBA %llu\n",
 				(unsigned long long)efihdr.partitiontable_LBA);
-			read_GPT_entries(fd, efihdr.partitiontable_LBA,
-					 efihdr.partitions, dev);
+			read_GPT_entries(fd, &efihdr, dev);
 			break;
 		}
 		PedFileSystemType *pfst = calloc(sizeof(PedFileSystemType), 1);
@@ -369,42 +467,188 @@ static bool check_partition_table(PedDevice *dev)
 	if (numpartitions == 0) {
 		return false;
 	}
+	for (tmp = dev->part_list; tmp; tmp = tmp->next) {
+		/* primary and logical partitions of a DOS partition table */
+		if (!tmp->uuid[0]) {
+			MBR_uuid(&mbr, tmp->num, tmp->uuid);
+		}
+		tmp->path = partition_path(dev->path, tmp->num);
+	}
 	return true;
 }
 
-static int scan_devdir(unsigned int fmajor, unsigned int fminor, char *fullname,
-		       unsigned int maxlen)
+/* Read the UUID of partition num of a disk as recorded when scanning it,
+ * from the few sectors holding it only */
+bool ped_partition_get_uuid(const char *devpath, uint16_t num, char *uuid)
 {
-	int result = -1;
+	struct Masterbootrecord mbr;
+	struct EFIHeader efihdr;
+	struct EFIpartitionentry e;
+	bool result = false;
+	off64_t offset;
+	int fd;
 
+	fd = open(devpath, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	if (pread(fd, &mbr, sizeof(mbr), 0) != sizeof(mbr) ||
+	    mbr.mbrsignature != 0xaa55) {
+		goto get_uuid_out;
+	}
+	for (int i = 0; i < 4; i++) {
+		if (mbr.parttable[i].partition_type != MBR_TYPE_GPT) {
+			continue;
+		}
+		offset = LB_SIZE * (off64_t)mbr.parttable[i].start_LBA;
+		if (num == 0 ||
+		    pread(fd, &efihdr, sizeof(efihdr), offset) !=
+			sizeof(efihdr) ||
+		    num > efihdr.partitions ||
+		    efihdr.partitionentrysize < sizeof(e) ||
+		    efihdr.partitionentrysize > GPT_MAX_ENTRY_SIZE) {
+			goto get_uuid_out;
+		}
+		offset = LB_SIZE * (off64_t)efihdr.partitiontable_LBA +
+			 (off64_t)(num - 1) * efihdr.partitionentrysize;
+		if (pread(fd, &e, sizeof(e), offset) != sizeof(e)) {
+			goto get_uuid_out;
+		}
+		GUID_to_str(e.partition_GUID, uuid);
+		result = true;
+		goto get_uuid_out;
+	}
+	MBR_uuid(&mbr, num, uuid);
+	result = true;
+
+get_uuid_out:
+	close(fd);
+	return result;
+}
+
+typedef struct {
+	dev_t rdev;
+	char *name;
+} DEVNODE;
+
+/* Block device nodes in DEVDIR, sorted by device number. Only built if a
+ * node cannot be found by name, and at most once per scan. */
+static DEVNODE *devnodes;
+static size_t num_devnodes;
+static bool devnodes_scanned;
+
+static int devnode_cmp(const void *a, const void *b)
+{
+	dev_t ra = ((const DEVNODE *)a)->rdev;
+	dev_t rb = ((const DEVNODE *)b)->rdev;
+
+	return ra < rb ? -1 : ra > rb;
+}
+
+static bool devnode_matches(const char *path, dev_t rdev)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISBLK(st.st_mode) &&
+	       st.st_rdev == rdev;
+}
+
+/* Get the node name the kernel assigned to the device from its uevent
+ * file, e.g. DEVNAME=cciss/c0d0 for /sys/block/cciss!c0d0 */
+static bool devnode_from_uevent(unsigned int fmajor, unsigned int fminor,
+				char *fullname, unsigned int maxlen)
+{
+	char uevent[64];
+	char line[DEV_FILENAME_LEN + 16];
+	bool found = false;
+
+	(void)snprintf(uevent, sizeof(uevent), "%s/%u:%u/uevent",
+		       SYSDEVBLOCKDIR, fmajor, fminor);
+	FILE *fh = fopen(uevent, "r");
+	if (!fh) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), fh)) {
+		if (strncmp(line, "DEVNAME=", 8) != 0) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = 0;
+		(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR, line + 8);
+		found = devnode_matches(fullname, makedev(fmajor, fminor));
+		break;
+	}
+	(void)fclose(fh);
+	return found;
+}
+
+static void devnode_index_build(void)
+{
+	size_t size = 0;
+
+	devnodes_scanned = true;
 	DIR *devdir = opendir(DEVDIR);
 	if (!devdir) {
 		VERBOSE(stderr, "Failed to open %s\n", DEVDIR);
-		return result;
+		return;
 	}
 	struct dirent *devfile;
-	do {
-		devfile = readdir(devdir);
-		if (!devfile) {
-			break;
+	while ((devfile = readdir(devdir))) {
+		struct stat st;
+		if (fstatat(dirfd(devdir), devfile->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1 ||
+		    !S_ISBLK(st.st_mode)) {
+			continue;
 		}
-		(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR,
-			       devfile->d_name);
-		struct stat fstat;
-		if (stat(fullname, &fstat) == -1) {
-			VERBOSE(stderr, "stat failed on %s\n", fullname);
-			break;
+		if (num_devnodes == size) {
+			size_t new_size = size ? size * 2 : 64;
+			DEVNODE *n = realloc(devnodes,
+					     new_size * sizeof(DEVNODE));
+			if (!n) {
+				break;
+			}
+			devnodes = n;
+			size = new_size;
 		}
-		if (major(fstat.st_rdev) == fmajor &&
-		    minor(fstat.st_rdev) == fminor) {
-			VERBOSE(stdout, "Node found: %s\n", fullname);
-			result = 0;
+		devnodes[num_devnodes].name = strdup(devfile->d_name);
+		if (!devnodes[num_devnodes].name) {
 			break;
 		}
-	} while (devfile);
+		devnodes[num_devnodes++].rdev = st.st_rdev;
+	}
 	closedir(devdir);
+	qsort(devnodes, num_devnodes, sizeof(DEVNODE), devnode_cmp);
+}
 
-	return result;
+static void devnode_index_release(void)
+{
+	for (size_t i = 0; i < num_devnodes; i++) {
+		free(devnodes[i].name);
+	}
+	free(devnodes);
+	devnodes = NULL;
+	num_devnodes = 0;
+	devnodes_scanned = false;
+}
+
+static int find_devnode(unsigned int fmajor, unsigned int fminor,
+			char *fullname, unsigned int maxlen)
+{
+	if (devnode_from_uevent(fmajor, fminor, fullname, maxlen)) {
+		VERBOSE(stdout, "Node found: %s\n", fullname);
+		return 0;
+	}
+	if (!devnodes_scanned) {
+		devnode_index_build();
+	}
+	DEVNODE key = {.rdev = makedev(fmajor, fminor)};
+	DEVNODE *node = bsearch(&key, devnodes, num_devnodes, sizeof(DEVNODE),
+				devnode_cmp);
+	if (!node) {
+		return -1;
+	}
+	(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR, node->name);
+	VERBOSE(stdout, "Node found: %s\n", fullname);
+	return 0;
 }
 
 static int get_major_minor(char *filename, unsigned int *major, unsigned int *minor)
@@ -425,10 +669,364 @@ static int get_major_minor(char *filename, unsigned int *major, unsigned int *mi
 	return 0;
 }
 
+static unsigned int probe_device_ms = PED_PROBE_DEVICE_TIMEOUT_MS;
+static unsigned int probe_total_ms = PED_PROBE_TOTAL_TIMEOUT_MS;
+
+void ped_device_set_probe_timeouts(unsigned int device_ms,
+				   unsigned int total_ms)
+{
+	probe_device_ms = device_ms;
+	probe_total_ms = total_ms;
+}
+
+static void ped_device_destroy(PedDevice *d);
+
+typedef enum {
+	PROBE_QUEUED,
+	PROBE_RUNNING,
+	PROBE_DONE,
+	PROBE_ABANDONED
+} PROBE_STATE;
+
+/* Shared by the probing thread and the workers. A device whose probe is
+ * abandoned belongs to the worker still probing it, and the queue to the
+ * last of them to let go of it. */
+typedef struct {
+	PedDevice **devs;
+	PROBE_STATE *state;
+	PedProbeResult *result;
+	struct timespec *started;
+	size_t count;
+	size_t next;
+	size_t pending;
+	unsigned int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} PROBE_QUEUE;
+
+static uint64_t ms_since(const struct timespec *t, const struct timespec *now)
+{
+	return (uint64_t)(now->tv_sec - t->tv_sec) * 1000 +
+	       (now->tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void ms_add(struct timespec *t, uint64_t ms)
+{
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+static void probe_queue_free(PROBE_QUEUE *q)
+{
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q->devs);
+	free(q->state);
+	free(q->result);
+	free(q->started);
+	free(q);
+}
+
+static PROBE_QUEUE *probe_queue_new(PedDevice **devs, size_t count)
+{
+	pthread_condattr_t attr;
+	PROBE_QUEUE *q = calloc(1, sizeof(PROBE_QUEUE));
+	if (!q) {
+		return NULL;
+	}
+	q->devs = calloc(count, sizeof(PedDevice *));
+	q->state = calloc(count, sizeof(PROBE_STATE));
+	q->result = calloc(count, sizeof(PedProbeResult));
+	q->started = calloc(count, sizeof(struct timespec));
+	if (!q->devs || !q->state || !q->result || !q->started) {
+		free(q->devs);
+		free(q->state);
+		free(q->result);
+		free(q->started);
+		free(q);
+		return NULL;
+	}
+	memcpy(q->devs, devs, count * sizeof(PedDevice *));
+	q->count = count;
+	q->pending = count;
+	q->refs = 1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return q;
+}
+
+/* Drop a reference to the queue, with its lock held */
+static void probe_queue_put(PROBE_QUEUE *q)
+{
+	bool last = --q->refs == 0;
+
+	pthread_mutex_unlock(&q->lock);
+	if (last) {
+		probe_queue_free(q);
+	}
+}
+
+/* Check the partition tables of the queued devices until none is left, or
+ * until the probe of a device is abandoned, which another worker has
+ * been started to take over for then. */
+static void *probe_worker(void *arg)
+{
+	PROBE_QUEUE *q = arg;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->next < q->count) {
+		size_t i = q->next++;
+		q->state[i] = PROBE_RUNNING;
+		clock_gettime(CLOCK_MONOTONIC, &q->started[i]);
+		pthread_mutex_unlock(&q->lock);
+
+		bool found = check_partition_table(q->devs[i]);
+
+		pthread_mutex_lock(&q->lock);
+		if (q->state[i] == PROBE_ABANDONED) {
+			VERBOSE(stderr, "Probing %s finished too late\n",
+				q->devs[i]->path);
+			ped_device_destroy(q->devs[i]);
+			break;
+		}
+		q->state[i] = PROBE_DONE;
+		q->result[i] = found ? PED_PROBE_FOUND : PED_PROBE_NONE;
+		q->pending--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	probe_queue_put(q);
+	return NULL;
+}
+
+static bool probe_worker_start(PROBE_QUEUE *q)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	bool started;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	q->refs++;
+	started = pthread_create(&thread, &attr, probe_worker, q) == 0;
+	if (!started) {
+		q->refs--;
+	}
+	pthread_attr_destroy(&attr);
+	return started;
+}
+
+/* Give up on the device, counted as pending, with the queue locked. This is
+ * reported even when not verbose, as a config partition may be missed. */
+static void probe_abandon(PROBE_QUEUE *q, size_t i)
+{
+	fprintf(stderr, "Warning: skipping %s, probing it timed out\n",
+		q->devs[i]->path);
+	if (q->state[i] == PROBE_QUEUED) {
+		q->state[i] = PROBE_DONE;
+		ped_device_destroy(q->devs[i]);
+	} else {
+		q->state[i] = PROBE_ABANDONED;
+	}
+	q->result[i] = PED_PROBE_TIMEOUT;
+	q->pending--;
+}
+
+/* Check the partition tables of the devices with up to PED_PROBE_WORKERS
+ * threads, so that discovery takes about as long as the slowest device.
+ * A device not probed within the deadlines is reported as timed out and
+ * freed by the library then, as the probe may still be blocked on it. */
+void ped_device_probe(PedDevice **devs, PedProbeResult *result, size_t count)
+{
+	struct timespec start, now, wake;
+	unsigned int workers = 0;
+
+	if (count == 0) {
+		return;
+	}
+	PROBE_QUEUE *q = probe_queue_new(devs, count);
+	if (!q) {
+		for (size_t i = 0; i < count; i++) {
+			result[i] = PED_PROBE_NONE;
+		}
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&q->lock);
+	while (workers < count && workers < PED_PROBE_WORKERS &&
+	       probe_worker_start(q)) {
+		workers++;
+	}
+	if (workers == 0) {
+		/* probe in this thread, without a deadline */
+		q->refs++;
+		pthread_mutex_unlock(&q->lock);
+		probe_worker(q);
+		pthread_mutex_lock(&q->lock);
+	}
+	while (q->pending > 0) {
+		bool timed = false;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (probe_total_ms &&
+		    ms_since(&start, &now) >= probe_total_ms) {
+			for (size_t i = 0; i < count; i++) {
+				if (q->state[i] == PROBE_QUEUED ||
+				    q->state[i] == PROBE_RUNNING) {
+					probe_abandon(q, i);
+				}
+			}
+			q->next = count;
+			break;
+		}
+		if (probe_total_ms) {
+			wake = start;
+			ms_add(&wake, probe_total_ms);
+			timed = true;
+		}
+		for (size_t i = 0; probe_device_ms && i < count; i++) {
+			if (q->state[i] != PROBE_RUNNING) {
+				continue;
+			}
+			struct timespec t = q->started[i];
+			if (ms_since(&t, &now) >= probe_device_ms) {
+				probe_abandon(q, i);
+				/* the worker stays blocked on this device */
+				if (q->next < count) {
+					(void)probe_worker_start(q);
+				}
+				continue;
+			}
+			ms_add(&t, probe_device_ms);
+			if (!timed || t.tv_sec < wake.tv_sec ||
+			    (t.tv_sec == wake.tv_sec &&
+			     t.tv_nsec < wake.tv_nsec)) {
+				wake = t;
+				timed = true;
+			}
+		}
+		if (q->pending == 0) {
+			break;
+		}
+		if (timed) {
+			pthread_cond_timedwait(&q->cond, &q->lock, &wake);
+		} else {
+			pthread_cond_wait(&q->cond, &q->lock);
+		}
+	}
+	memcpy(result, q->result, count * sizeof(PedProbeResult));
+	probe_queue_put(q);
+}
+
+static bool sysfs_read_ull(const char *path, unsigned long long *value)
+{
+	FILE *fh = fopen(path, "r");
+	if (!fh) {
+		return false;
+	}
+	int res = fscanf(fh, "%llu", value);
+	(void)fclose(fh);
+	return res == 1;
+}
+
+/* Take the partitions of a disk from the kernel, which lists them in
+ * /sys/block/<disk>/<partition>, so that neither the partition table is
+ * read nor the names of the partition nodes have to be guessed. */
+static void sysfs_partitions(PedDevice *dev, const char *disk)
+{
+	char path[DEV_FILENAME_LEN * 2 + 32];
+	char node[DEV_FILENAME_LEN + 16];
+	struct dirent *entry;
+
+	(void)snprintf(path, sizeof(path), "%s/%s", SYSBLOCKDIR, disk);
+	DIR *diskdir = opendir(path);
+	if (!diskdir) {
+		return;
+	}
+	while ((entry = readdir(diskdir))) {
+		unsigned long long num, start;
+		unsigned int fmajor, fminor;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		(void)snprintf(path, sizeof(path), "%s/%s/%s/partition",
+			       SYSBLOCKDIR, disk, entry->d_name);
+		if (!sysfs_read_ull(path, &num) || num == 0 ||
+		    num > UINT16_MAX) {
+			continue;
+		}
+		(void)snprintf(path, sizeof(path), "%s/%s/%s/start",
+			       SYSBLOCKDIR, disk, entry->d_name);
+		if (!sysfs_read_ull(path, &start)) {
+			continue;
+		}
+		(void)snprintf(path, sizeof(path), "%s/%s/%s/dev", SYSBLOCKDIR,
+			       disk, entry->d_name);
+		if (get_major_minor(path, &fmajor, &fminor) < 0) {
+			continue;
+		}
+		(void)snprintf(node, sizeof(node), "%s/%s", DEVDIR,
+			       entry->d_name);
+		if (!devnode_matches(node, makedev(fmajor, fminor)) &&
+		    find_devnode(fmajor, fminor, node, sizeof(node)) != 0) {
+			VERBOSE(stderr, "No device node for partition %s\n",
+				entry->d_name);
+			continue;
+		}
+		PedPartition *p = calloc(sizeof(PedPartition), 1);
+		if (!p) {
+			break;
+		}
+		p->num = num;
+		p->start = start;
+		p->path = strdup(node);
+		if (!p->path) {
+			free(p);
+			break;
+		}
+		/* keep the partitions ordered by number */
+		PedPartition **pp = &dev->part_list;
+		while (*pp && (*pp)->num < p->num) {
+			pp = &(*pp)->next;
+		}
+		p->next = *pp;
+		*pp = p;
+	}
+	closedir(diskdir);
+}
+
+static PedDevice *new_block_dev(const char *path)
+{
+	PedDevice *dev = calloc(sizeof(PedDevice), 1);
+	if (!dev) {
+		return NULL;
+	}
+	if (asprintf(&dev->model, "%s", "N/A") == -1) {
+		free(dev);
+		return NULL;
+	}
+	if (asprintf(&dev->path, "%s", path) == -1) {
+		free(dev->model);
+		free(dev);
+		return NULL;
+	}
+	return dev;
+}
+
 void ped_device_probe_all(void)
 {
 	struct dirent *sysblockfile;
 	char fullname[DEV_FILENAME_LEN+16];
+	PedDevice **devs = NULL;
+	size_t num_devs = 0, size = 0;
 
 	DIR *sysblockdir = opendir(SYSBLOCKDIR);
 	if (!sysblockdir) {
@@ -459,39 +1057,49 @@ void ped_device_probe_all(void)
 		/* Check if this file is really in the dev directory */
 		(void)snprintf(fullname, sizeof(fullname), "%s/%s", DEVDIR,
 			 sysblockfile->d_name);
-		struct stat fstat;
-		if (stat(fullname, &fstat) == -1) {
-			/* Node with same name not found in /dev, thus search
-			* for node with identical Major and Minor revision */
-			if (scan_devdir(fmajor, fminor, fullname,
-					sizeof(fullname)) != 0) {
+		if (!devnode_matches(fullname, makedev(fmajor, fminor))) {
+			/* Node with same name not found in /dev, thus look up
+			 * the node with identical Major and Minor revision */
+			if (find_devnode(fmajor, fminor, fullname,
+					 sizeof(fullname)) != 0) {
 				continue;
 			}
 		}
-		/* This is a block device, so add it to the list*/
-		PedDevice *dev = calloc(sizeof(PedDevice), 1);
-		if (!dev) {
-			continue;
-		}
-		if (asprintf(&dev->model, "%s", "N/A") == -1) {
-			dev->model = NULL;
-			goto pedprobe_error;
-		}
-		if (asprintf(&dev->path, "%s", fullname) == -1) {
-			dev->path = NULL;
-			goto pedprobe_error;
+		if (num_devs == size) {
+			size_t new_size = size ? size * 2 : 16;
+			PedDevice **d = realloc(devs,
+						new_size * sizeof(PedDevice *));
+			if (!d) {
+				break;
+			}
+			devs = d;
+			size = new_size;
 		}
-		if (check_partition_table(dev)) {
-			add_block_dev(dev);
-			continue;
+		devs[num_devs] = new_block_dev(fullname);
+		if (devs[num_devs]) {
+			sysfs_partitions(devs[num_devs], sysblockfile->d_name);
+			num_devs++;
 		}
-pedprobe_error:
-		free(dev->model);
-		free(dev->path);
-		free(dev);
 	} while (sysblockfile);
 
 	closedir(sysblockdir);
+	devnode_index_release();
+
+	PedProbeResult *result = calloc(num_devs, sizeof(PedProbeResult));
+	if (result) {
+		ped_device_probe(devs, result, num_devs);
+	}
+	/* add the block devices with partitions in the order of the scan */
+	for (size_t i = 0; i < num_devs; i++) {
+		if (result && result[i] == PED_PROBE_FOUND) {
+			add_block_dev(devs[i]);
+		} else if (!result || result[i] == PED_PROBE_NONE) {
+			ped_device_destroy(devs[i]);
+		}
+		/* a timed out device is freed by the worker probing it */
+	}
+	free(result);
+	free(devs);
 }
 
 static void ped_partition_destroy(PedPartition *p)
@@ -503,6 +1111,7 @@ static void ped_partition_destroy(PedPartition *p)
 		free(p->fs_type->name);
 		free(p->fs_type);
 	}
+	free(p->path);
 	free(p);
 }
 
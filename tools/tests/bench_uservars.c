@@ -0,0 +1,472 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Microbenchmark and fuzzer for the user variable engine in env/uservars.c.
+ *
+ * The engine is linked with memmove and memcpy wrapped, so that the bytes
+ * it moves are counted next to the operations per second. The fuzz mode
+ * interprets corpus files (or random data) as operations and checks the
+ * region invariants after each of them.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <env_api.h>
+#include <uservars.h>
+
+bool bgenv_verbosity = false;
+
+void *__real_memmove(void *dest, const void *src, size_t n);
+void *__real_memcpy(void *dest, const void *src, size_t n);
+void *__wrap_memmove(void *dest, const void *src, size_t n);
+void *__wrap_memcpy(void *dest, const void *src, size_t n);
+
+static uint64_t bytes_moved;
+
+void *__wrap_memmove(void *dest, const void *src, size_t n)
+{
+	bytes_moved += n;
+	return __real_memmove(dest, src, n);
+}
+
+void *__wrap_memcpy(void *dest, const void *src, size_t n)
+{
+	bytes_moved += n;
+	return __real_memcpy(dest, src, n);
+}
+
+#define BENCH_MAX_VALUE 8192
+#define FUZZ_NUM_KEYS 64
+
+static BG_ENVDATA env;
+static bool indexed, deferred;
+static uint8_t value[BENCH_MAX_VALUE];
+static uint8_t readback[BENCH_MAX_VALUE];
+
+typedef struct {
+	uint64_t ops;
+	uint64_t failed;
+} BENCH_COUNT;
+
+typedef void (*bench_workload_t)(uint32_t num_ops, BENCH_COUNT *count);
+
+static void bench_reset(void)
+{
+	bgenv_drop_uservar_index(env.userdata);
+	memset(env.userdata, 0, ENV_MEM_USERVARS);
+	if (indexed) {
+		(void)bgenv_build_uservar_index(env.userdata);
+		(void)bgenv_defer_uservar_compaction(env.userdata, deferred);
+	}
+}
+
+static void bench_key(char *key, size_t size, uint32_t n)
+{
+	snprintf(key, size, "bench.key%u", n);
+}
+
+static void bench_set(char *key, uint32_t len, BENCH_COUNT *count)
+{
+	if (bgenv_set_uservar(env.userdata, key, USERVAR_TYPE_DEFAULT, value,
+			      len) != 0) {
+		count->failed++;
+	}
+	count->ops++;
+}
+
+static void bench_get(char *key, BENCH_COUNT *count)
+{
+	uint64_t type;
+
+	if (bgenv_get_uservar(env.userdata, key, &type, readback,
+			      sizeof(readback)) != 0) {
+		count->failed++;
+	}
+	count->ops++;
+}
+
+static void bench_del(char *key, BENCH_COUNT *count)
+{
+	uint8_t *var;
+
+	var = bgenv_find_uservar(env.userdata, key);
+	if (var) {
+		bgenv_del_uservar(env.userdata, var);
+	} else {
+		count->failed++;
+	}
+	count->ops++;
+}
+
+/* many small keys, each set once and read back twice */
+static void bench_small(uint32_t num_ops, BENCH_COUNT *count)
+{
+	uint32_t num_keys = ENV_MEM_USERVARS / 64;
+	char key[32];
+
+	while (count->ops < num_ops) {
+		for (uint32_t i = 0; i < num_keys; i++) {
+			bench_key(key, sizeof(key), i);
+			bench_set(key, 16, count);
+		}
+		for (uint32_t i = 0; i < 2 * num_keys; i++) {
+			bench_key(key, sizeof(key), (i * 7919) % num_keys);
+			bench_get(key, count);
+		}
+		(void)bgenv_user_free(env.userdata);
+		bench_reset();
+	}
+}
+
+/* few large values, rewritten with changing sizes */
+static void bench_large(uint32_t num_ops, BENCH_COUNT *count)
+{
+	uint32_t num_keys = ENV_MEM_USERVARS / (2 * BENCH_MAX_VALUE) + 1;
+	char key[32];
+
+	for (uint32_t n = 0; count->ops < num_ops; n++) {
+		bench_key(key, sizeof(key), n % num_keys);
+		bench_set(key,
+			  BENCH_MAX_VALUE / 2 + rand() % (BENCH_MAX_VALUE / 2),
+			  count);
+		bench_get(key, count);
+	}
+}
+
+/* random sets of existing keys with random sizes */
+static void bench_churn(uint32_t num_ops, BENCH_COUNT *count)
+{
+	uint32_t num_keys = ENV_MEM_USERVARS / 256;
+	char key[32];
+
+	while (count->ops < num_ops) {
+		bench_key(key, sizeof(key), rand() % num_keys);
+		bench_set(key, 1 + rand() % 128, count);
+		(void)bgenv_user_free(env.userdata);
+	}
+}
+
+/* fill the region and delete most of it again */
+static void bench_delete(uint32_t num_ops, BENCH_COUNT *count)
+{
+	uint32_t num_keys = ENV_MEM_USERVARS / 64;
+	char key[32];
+
+	while (count->ops < num_ops) {
+		for (uint32_t i = 0; i < num_keys; i++) {
+			bench_key(key, sizeof(key), i);
+			bench_set(key, 32, count);
+		}
+		for (uint32_t i = 0; i < num_keys; i++) {
+			bench_key(key, sizeof(key), (i * 7919) % num_keys);
+			if (i % 8) {
+				bench_del(key, count);
+			}
+		}
+		bench_reset();
+	}
+}
+
+static struct {
+	char *name;
+	bench_workload_t run;
+} workloads[] = {
+	{"small", bench_small},
+	{"large", bench_large},
+	{"churn", bench_churn},
+	{"delete", bench_delete},
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_run(char *name, bench_workload_t run, uint32_t num_ops)
+{
+	BENCH_COUNT count = {0};
+	double start, elapsed;
+
+	bench_reset();
+	bytes_moved = 0;
+	start = bench_now();
+	run(num_ops, &count);
+	elapsed = bench_now() - start;
+	printf("%-8s %-8s %12.0f ops/s %10.1f bytes moved/op %8llu failed\n",
+	       name, !indexed ? "walk" : deferred ? "deferred" : "indexed",
+	       count.ops / elapsed, (double)bytes_moved / count.ops,
+	       (unsigned long long)count.failed);
+	bgenv_drop_uservar_index(env.userdata);
+}
+
+/*
+ * Fuzz mode
+ */
+
+typedef struct {
+	bool set;
+	uint32_t len;
+	uint8_t fill;
+} FUZZ_MODEL;
+
+static FUZZ_MODEL model[FUZZ_NUM_KEYS];
+
+static void fuzz_fail(char *what, uint32_t step)
+{
+	fprintf(stderr, "fuzz: %s after operation %u\n", what, step);
+	abort();
+}
+
+static void fuzz_check(uint32_t step)
+{
+	uint32_t offset, rsize, dsize, live = 0;
+	ebgenv_user_stats_t stats;
+	uint8_t *val;
+	uint64_t type;
+	char key[32];
+	char *k;
+
+	/* records must tile the region up to a terminating zero */
+	for (offset = 0; offset < ENV_MEM_USERVARS && env.userdata[offset];
+	     offset += rsize) {
+		if (!memchr(env.userdata + offset, 0,
+			    ENV_MEM_USERVARS - offset)) {
+			fuzz_fail("unterminated key", step);
+		}
+		bgenv_map_uservar(env.userdata + offset, &k, &type, &val,
+				  &rsize, &dsize);
+		if (rsize == 0 || rsize > ENV_MEM_USERVARS - offset ||
+		    dsize > rsize) {
+			fuzz_fail("invalid record size", step);
+		}
+		if (!(type & USERVAR_TYPE_DELETED)) {
+			live += rsize;
+		}
+	}
+	if (offset >= ENV_MEM_USERVARS) {
+		fuzz_fail("missing terminator", step);
+	}
+	bgenv_uservar_stats(env.userdata, &stats);
+	if (stats.live != live ||
+	    stats.live + stats.dead + stats.slack + stats.free !=
+		    ENV_MEM_USERVARS) {
+		fuzz_fail("inconsistent statistics", step);
+	}
+
+	/* the region must hold exactly what the model says */
+	for (uint32_t i = 0; i < FUZZ_NUM_KEYS; i++) {
+		uint8_t *var;
+
+		bench_key(key, sizeof(key), i);
+		var = bgenv_find_uservar(env.userdata, key);
+		if (!model[i].set) {
+			if (var) {
+				fuzz_fail("deleted key found", step);
+			}
+			continue;
+		}
+		if (!var) {
+			fuzz_fail("key lost", step);
+		}
+		bgenv_map_uservar(var, NULL, NULL, &val, NULL, &dsize);
+		if (dsize != model[i].len) {
+			fuzz_fail("value size changed", step);
+		}
+		for (uint32_t j = 0; j < dsize; j++) {
+			if (val[j] != model[i].fill) {
+				fuzz_fail("value corrupted", step);
+			}
+		}
+	}
+}
+
+/* Each operation takes three input bytes: opcode, key and size. */
+static void fuzz_one(uint8_t *input, size_t size)
+{
+	uint32_t step = 0;
+	char key[32];
+	uint32_t len;
+	uint8_t *var;
+	int res;
+
+	memset(model, 0, sizeof(model));
+	indexed = true;
+	deferred = false;
+	bench_reset();
+
+	for (size_t i = 0; i + 3 <= size; i += 3, step++) {
+		uint8_t op = input[i], k = input[i + 1] % FUZZ_NUM_KEYS;
+
+		bench_key(key, sizeof(key), k);
+		len = 1 + input[i + 2] * (ENV_MEM_USERVARS / 1024);
+		if (len > BENCH_MAX_VALUE) {
+			len = BENCH_MAX_VALUE;
+		}
+		switch (op % 8) {
+		case 0:
+		case 1:
+		case 2:
+			memset(value, op, len);
+			res = bgenv_set_uservar(env.userdata, key,
+						USERVAR_TYPE_DEFAULT, value,
+						len);
+			if (res == 0) {
+				model[k].set = true;
+				model[k].len = len;
+				model[k].fill = op;
+			} else if (res == -ENOMEM) {
+				/* resizing may drop the old value */
+				model[k].set = model[k].set &&
+					       bgenv_find_uservar(env.userdata,
+								  key);
+			} else {
+				fuzz_fail("set failed", step);
+			}
+			break;
+		case 3:
+		case 4:
+			var = bgenv_find_uservar(env.userdata, key);
+			if (var) {
+				bgenv_del_uservar(env.userdata, var);
+			}
+			model[k].set = false;
+			break;
+		case 5:
+			(void)bgenv_defer_uservar_compaction(env.userdata,
+							     op & 0x80);
+			break;
+		case 6:
+			(void)bgenv_use_compact_uservars(env.userdata,
+							 op & 0x80);
+			break;
+		case 7:
+			bgenv_compact_uservars(env.userdata);
+			break;
+		}
+		fuzz_check(step);
+	}
+	bgenv_drop_uservar_index(env.userdata);
+}
+
+static uint8_t *fuzz_read(char *path, size_t *size)
+{
+	uint8_t *data = NULL;
+	long len;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 &&
+	    fseek(f, 0, SEEK_SET) == 0) {
+		data = malloc(len + 1);
+		if (data && fread(data, 1, len, f) != (size_t)len) {
+			free(data);
+			data = NULL;
+		}
+		*size = len;
+	}
+	fclose(f);
+	return data;
+}
+
+static int fuzz(int argc, char **argv, uint32_t runs)
+{
+	uint8_t input[3 * 512];
+	double start, elapsed;
+	uint64_t ops = 0;
+	size_t size;
+
+	start = bench_now();
+	for (int i = 0; i < argc; i++) {
+		uint8_t *data = fuzz_read(argv[i], &size);
+
+		if (!data) {
+			fprintf(stderr, "Cannot read %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+		fuzz_one(data, size);
+		ops += size / 3;
+		free(data);
+	}
+	for (uint32_t r = 0; r < runs; r++) {
+		for (size_t i = 0; i < sizeof(input); i++) {
+			input[i] = rand();
+		}
+		fuzz_one(input, sizeof(input));
+		ops += sizeof(input) / 3;
+	}
+	elapsed = bench_now() - start;
+	printf("fuzz: %u inputs, %.0f checked ops/s\n",
+	       (unsigned)(argc + runs), ops / elapsed);
+	return EXIT_SUCCESS;
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n OPS] [-s SEED] [WORKLOAD...]\n"
+		"       %s -f [-n RUNS] [-s SEED] [CORPUS-FILE...]\n"
+		"Workloads: small, large, churn, delete (default: all)\n",
+		name, name);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t num_ops = 200000, runs = 200;
+	bool fuzzing = false, found;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-f") == 0) {
+			fuzzing = true;
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			num_ops = runs = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			srand(strtoul(argv[++i], NULL, 0));
+		} else {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (fuzzing) {
+		return fuzz(argc - i, argv + i, runs);
+	}
+
+	for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		found = i == argc;
+		for (int j = i; j < argc; j++) {
+			found |= strcmp(argv[j], workloads[w].name) == 0;
+		}
+		if (!found) {
+			continue;
+		}
+		/* unindexed, indexed and deferred compaction */
+		for (int mode = 0; mode < 3; mode++) {
+			indexed = mode > 0;
+			deferred = mode > 1;
+			bench_run(workloads[w].name, workloads[w].run,
+				  num_ops);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -64,6 +64,11 @@ void add_fake_partition(int devnum)
 		goto allocate_fake_part_error;
 	}
 	(*pp)->num = num;
+	if (asprintf(&(*pp)->path, "%s%d", fake_devices[devnum].path, num)
+	    == -1) {
+		(*pp)->path = NULL;
+		goto allocate_fake_part_error;
+	}
 	(*pp)->fs_type =
 		(PedFileSystemType *)calloc(1, sizeof(PedFileSystemType));
 	if (!(*pp)->fs_type) {
@@ -90,6 +95,7 @@ void remove_fake_partitions(int n)
 			free(pp->fs_type->name);
 			free(pp->fs_type);
 		}
+		free(pp->path);
 		free(pp);
 		pp = next;
 	}
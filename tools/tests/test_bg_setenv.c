@@ -0,0 +1,128 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <env_config_file.h>
+
+/* the tool itself, with its main function renamed */
+#define main bg_setenv_main
+int bg_setenv_main(int argc, char **argv);
+#include "bg_setenv.c"
+#undef main
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+FAKE_VALUE_FUNC(bool, bgenv_init);
+FAKE_VALUE_FUNC(bool, write_env, CONFIG_PART *, BG_ENVDATA *);
+
+bool write_env_custom_fake(CONFIG_PART *part, BG_ENVDATA *env);
+
+bool write_env_custom_fake(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	return true;
+}
+
+CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+static void remove_dir(char *dir)
+{
+	uint32_t *ids, count;
+	CONFIG_PART part = {.mountpoint = dir};
+	char name[sizeof("00000000.BLB")];
+	char *path;
+
+	ck_assert(list_blob_files(&part, &ids, &count) == true);
+	for (uint32_t i = 0; i < count; i++) {
+		(void)snprintf(name, sizeof(name), BLOB_FILENAME_FORMAT,
+			       ids[i]);
+		ck_assert(asprintf(&path, "%s/%s", dir, name) > 0);
+		remove(path);
+		free(path);
+	}
+	free(ids);
+	rmdir(dir);
+}
+
+START_TEST(bg_setenv_update_blob)
+{
+	char dirs[ENV_NUM_CONFIG_PARTS][24];
+	char *argv[] = {"bg_setenv", "-u", NULL};
+	uint32_t *ids, count;
+	char buffer[16];
+	BGENV *env;
+	int res;
+
+	RESET_FAKE(bgenv_init);
+	RESET_FAKE(write_env);
+	bgenv_init_fake.return_val = true;
+	write_env_fake.custom_fake = write_env_custom_fake;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		strcpy(dirs[i], "/tmp/ebgenv-test-XXXXXX");
+		ck_assert(mkdtemp(dirs[i]) != NULL);
+		config_parts[i].mountpoint = dirs[i];
+		config_parts[i].not_mounted = false;
+		memset(&envdata[i], 0, sizeof(BG_ENVDATA));
+		(void)bgenv_build_uservar_index(envdata[i].userdata);
+	}
+	env = bgenv_open_by_index(0);
+	ck_assert(env != NULL);
+	env->data->revision = 1;
+	res = bgenv_set(env, "manifest", USERVAR_TYPE_BLOB, "value", 6);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_close(env) == true);
+
+	/* Test if the blob variables of the latest environment are
+	 * readable from the updated one, with the blob files copied to its
+	 * config partition
+	 */
+	res = bg_setenv_main(2, argv);
+	ck_assert_int_eq(res, 0);
+	env = bgenv_open_by_index(1);
+	ck_assert(env != NULL);
+	ck_assert_int_eq(env->data->revision, 2);
+	ck_assert(list_blob_files(&config_parts[1], &ids, &count) == true);
+	ck_assert_int_eq(count, 1);
+	free(ids);
+	res = bgenv_get(env, "manifest", NULL, buffer, sizeof(buffer));
+	ck_assert_int_eq(res, 0);
+	ck_assert(strcmp(buffer, "value") == 0);
+	ck_assert(bgenv_close(env) == true);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		remove_dir(dirs[i]);
+		config_parts[i].mountpoint = NULL;
+	}
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("bg_setenv");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, bg_setenv_update_blob);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -18,6 +18,7 @@
 #include <env_api.h>
 #include <env_config_file.h>
 #include <env_config_partitions.h>
+#include <ebgenv.h>
 
 DEFINE_FFF_GLOBALS;
 
@@ -28,6 +29,13 @@ bool read_env(CONFIG_PART *part, BG_ENVDATA *env);
 Suite *env_api_fat_suite(void);
 bool probe_config_partitions_custom_fake(CONFIG_PART *cfgpart);
 bool read_env_custom_fake(CONFIG_PART *cp, BG_ENVDATA *env);
+bool read_env_parallel_fake(CONFIG_PART *cp, BG_ENVDATA *env);
+bool probe_config_partitions_dir_fake(CONFIG_PART *cfgpart);
+
+static char mountpoints[ENV_NUM_CONFIG_PARTS][32];
+
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
 
 Suite *ebg_test_suite(void);
 
@@ -48,6 +56,52 @@ bool read_env_custom_fake(CONFIG_PART *cp, BG_ENVDATA *env)
 	return true;
 }
 
+/* Fills each environment with a valid one of its own, checked after
+ * reading in parallel. Even config partitions hold corrupt data. */
+bool read_env_parallel_fake(CONFIG_PART *cp, BG_ENVDATA *env)
+{
+	uint32_t index = cp - config_parts;
+
+	memset(env, 0, sizeof(BG_ENVDATA));
+	env->revision = index + 1;
+	env->crc32 = crc32(0, (Bytef *)env,
+			   sizeof(BG_ENVDATA) - sizeof(env->crc32));
+	if (index % 2 == 0) {
+		env->crc32++;
+	}
+	return true;
+}
+
+/* Config partitions mounted to directories holding an environment file,
+ * of which the one on even partitions has the highest revision and a
+ * failed update */
+bool probe_config_partitions_dir_fake(CONFIG_PART *cfgpart)
+{
+	BG_ENVDATA *env;
+	char *path;
+	FILE *f;
+
+	env = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(env != NULL);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		strcpy(mountpoints[i], "/tmp/ebgenv-test-XXXXXX");
+		ck_assert(mkdtemp(mountpoints[i]) != NULL);
+		cfgpart[i].devpath = devpath;
+		cfgpart[i].mountpoint = mountpoints[i];
+		env->revision = i % 2 ? 10 + i : 110;
+		env->ustate = i % 2 ? USTATE_OK : USTATE_FAILED;
+		ck_assert(asprintf(&path, "%s/" FAT_ENV_FILENAME,
+				   mountpoints[i]) > 0);
+		f = fopen(path, "wb");
+		ck_assert(f != NULL);
+		ck_assert(fwrite(env, sizeof(BG_ENVDATA), 1, f) == 1);
+		fclose(f);
+		free(path);
+	}
+	free(env);
+	return true;
+}
+
 FAKE_VALUE_FUNC(bool, probe_config_partitions, CONFIG_PART *);
 FAKE_VALUE_FUNC(bool, read_env, CONFIG_PART *, BG_ENVDATA *);
 
@@ -83,6 +137,94 @@ START_TEST(env_api_fat_test_bgenv_init_retval)
 }
 END_TEST
 
+START_TEST(env_api_fat_test_bgenv_init_parallel)
+{
+	bool result;
+
+	RESET_FAKE(probe_config_partitions);
+	RESET_FAKE(read_env);
+
+	/* Test if all environments are read and verified in parallel
+	 */
+	probe_config_partitions_fake.custom_fake = probe_config_partitions_custom_fake;
+	read_env_fake.custom_fake = read_env_parallel_fake;
+	bgenv_use_parallel_reads(true);
+	result = bgenv_init();
+	bgenv_use_parallel_reads(false);
+
+	ck_assert(result == true);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_int_eq(envdata[i].revision, i % 2 ? i + 1 : 0);
+		ck_assert_int_eq(envdata[i].crc32,
+				 crc32(0, (Bytef *)&envdata[i],
+				       sizeof(BG_ENVDATA) -
+				       sizeof(envdata[i].crc32)));
+	}
+}
+END_TEST
+
+START_TEST(env_api_fat_test_bgenv_init_lazy)
+{
+	ebgenv_summary_t summary;
+	ebgenv_t e = {0};
+	uint32_t latest_odd;
+	BGENV *env;
+	char *path;
+
+	RESET_FAKE(probe_config_partitions);
+	RESET_FAKE(read_env);
+
+	/* Test if only the fixed fields are read in lazy mode
+	 */
+	probe_config_partitions_fake.custom_fake =
+		probe_config_partitions_dir_fake;
+	read_env_fake.custom_fake = read_env_parallel_fake;
+	bgenv_use_lazy_loading(true);
+	ck_assert(bgenv_init() == true);
+	bgenv_use_lazy_loading(false);
+
+	ck_assert_int_eq(read_env_fake.call_count, 0);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert(bgenv_get_summary(i, &summary));
+		ck_assert_int_eq(summary.revision, i % 2 ? 10 + i : 110);
+		ck_assert(summary.verified == false);
+	}
+
+	/* Test if the global state is taken from the latest environment
+	 * that turns out to be valid when loading it
+	 */
+	ck_assert_int_eq(ebg_env_getglobalstate(&e), USTATE_OK);
+	latest_odd = (ENV_NUM_CONFIG_PARTS - 1) | 1;
+	if (latest_odd >= ENV_NUM_CONFIG_PARTS) {
+		latest_odd -= 2;
+	}
+	ck_assert(bgenv_get_summary(latest_odd, &summary));
+	ck_assert(summary.verified == true);
+
+	/* Test if opening the latest environment loads it, and selects
+	 * again if it turns out to be invalid
+	 */
+	env = bgenv_open_latest();
+	ck_assert(env != NULL);
+	ck_assert(env->data == &envdata[latest_odd]);
+	ck_assert_int_eq(env->data->revision, latest_odd + 1);
+	ck_assert_int_eq(read_env_fake.call_count,
+			 (ENV_NUM_CONFIG_PARTS + 1) / 2 + 1);
+	ck_assert(bgenv_get_summary(latest_odd, &summary));
+	ck_assert(summary.verified == true);
+	free(env);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert(asprintf(&path, "%s/" FAT_ENV_FILENAME,
+				   mountpoints[i]) > 0);
+		remove(path);
+		free(path);
+		rmdir(mountpoints[i]);
+		config_parts[i].mountpoint = NULL;
+	}
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -92,6 +234,8 @@ Suite *ebg_test_suite(void)
 
 	tc_core = tcase_create("Core");
 	tcase_add_test(tc_core, env_api_fat_test_bgenv_init_retval);
+	tcase_add_test(tc_core, env_api_fat_test_bgenv_init_parallel);
+	tcase_add_test(tc_core, env_api_fat_test_bgenv_init_lazy);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -383,6 +383,47 @@ START_TEST(ebgenv_api_ebg_env_user_free)
 }
 END_TEST
 
+START_TEST(ebgenv_api_ebg_env_iter)
+{
+	ebgenv_t e;
+	ebgenv_iter_t it;
+	char *key;
+	int ret;
+	memset(&e, 0, sizeof(e));
+
+	/* Check if starting an iteration fails with negative errno values,
+	 * like the rest of the iterator API
+	 */
+	ret = ebg_env_iter_begin(&e, NULL, NULL);
+	ck_assert_int_eq(ret, -EINVAL);
+	ret = ebg_env_iter_begin(&e, &it, NULL);
+	ck_assert_int_eq(ret, -EIO);
+
+	/* Check if the variables matching the prefix are visited
+	 */
+	e.bgenv = (BGENV *)calloc(1, sizeof(BGENV));
+	ck_assert(e.bgenv != NULL);
+	((BGENV *)e.bgenv)->data = (BG_ENVDATA *)calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(((BGENV *)e.bgenv)->data != NULL);
+	ret = ebg_env_set(&e, "app.a", "1");
+	ck_assert_int_eq(ret, 0);
+	ret = ebg_env_set(&e, "other", "2");
+	ck_assert_int_eq(ret, 0);
+
+	ret = ebg_env_iter_begin(&e, &it, "app.");
+	ck_assert_int_eq(ret, 0);
+	ret = ebg_env_iter_next(&it, &key, NULL, NULL, NULL);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(strcmp(key, "app.a") == 0);
+	ret = ebg_env_iter_next(&it, &key, NULL, NULL, NULL);
+	ck_assert_int_eq(ret, -ENOENT);
+	ebg_env_iter_end(&it);
+
+	free(((BGENV *)e.bgenv)->data);
+	free(e.bgenv);
+}
+END_TEST
+
 START_TEST(ebgenv_api_ebg_env_getglobalstate)
 {
 #if ENV_NUM_CONFIG_PARTS > 1
@@ -667,6 +708,62 @@ START_TEST(ebgenv_api_ebg_env_register_gc_var)
 }
 END_TEST
 
+START_TEST(ebgenv_api_ebg_env_register_gc_pattern)
+{
+	ebgenv_t e;
+	char key[16];
+	int ret;
+	memset(&e, 0, sizeof(e));
+
+	bgenv_write_fake.return_val = true;
+	bgenv_close_fake.return_val = true;
+
+	bgenv_init_fake.return_val = true;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envdata[i].revision = i + 1;
+	}
+
+	ret = ebg_env_create_new(&e);
+	ck_assert_int_eq(ret, 0);
+
+	/* Create many temporary variables and some to keep */
+	for (int i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "tmp%d", i);
+		ebg_env_set(&e, key, "x");
+		ck_assert_int_eq(ebg_env_register_gc_var(&e, key), 0);
+	}
+	ebg_env_set(&e, "swu.state", "1");
+	ebg_env_set(&e, "swu.step", "2");
+	ebg_env_set(&e, "log1", "a");
+	ebg_env_set(&e, "log2", "b");
+	ebg_env_set(&e, "keep", "c");
+
+	/* Register a duplicate key, a prefix and a glob */
+	ck_assert_int_eq(ebg_env_register_gc_var(&e, "tmp0"), 0);
+	ck_assert_int_eq(ebg_env_register_gc_pattern(&e, "swu.*"), 0);
+	ck_assert_int_eq(ebg_env_register_gc_pattern(&e, "log[0-9]"), 0);
+	ck_assert_int_eq(ebg_env_register_gc_pattern(&e, ""), EINVAL);
+
+	ret = ebg_env_finalize_update(&e);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(e.gc_registry == NULL);
+
+	/* Check if only matching variables are deleted */
+	for (int i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "tmp%d", i);
+		ck_assert_int_eq(ebg_env_get(&e, key, NULL), -ENOENT);
+	}
+	ck_assert_int_eq(ebg_env_get(&e, "swu.state", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "swu.step", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "log1", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "log2", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "keep", NULL), strlen("c") + 1);
+
+	ebg_env_close(&e);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -682,10 +779,12 @@ Suite *ebg_test_suite(void)
 		ebgenv_api_ebg_env_set_ex,
 		ebgenv_api_ebg_env_get_ex,
 		ebgenv_api_ebg_env_user_free,
+		ebgenv_api_ebg_env_iter,
 		ebgenv_api_ebg_env_getglobalstate,
 		ebgenv_api_ebg_env_setglobalstate,
 		ebgenv_api_ebg_env_close,
-		ebgenv_api_ebg_env_register_gc_var
+		ebgenv_api_ebg_env_register_gc_var,
+		ebgenv_api_ebg_env_register_gc_pattern
 	};
 
 	tc_core = tcase_create("Core");
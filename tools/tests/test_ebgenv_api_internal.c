@@ -19,6 +19,7 @@
 #include <env_config_file.h>
 #include <env_config_partitions.h>
 #include <ebgenv.h>
+#include <uservars.h>
 
 DEFINE_FFF_GLOBALS;
 
@@ -423,6 +424,812 @@ START_TEST(ebgenv_api_internal_uservars)
 }
 END_TEST
 
+START_TEST(ebgenv_api_internal_uservar_grow)
+{
+	uint8_t *udata = envdata[0].userdata;
+	/* key "a", size and type */
+	uint32_t overhead = 2 + sizeof(uint32_t) + sizeof(uint64_t);
+	uint8_t *big;
+	int res;
+
+	big = calloc(1, ENV_MEM_USERVARS);
+	ck_assert(big != NULL);
+
+	for (int indexed = 0; indexed < 2; indexed++) {
+		memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+		if (indexed) {
+			ck_assert(bgenv_build_uservar_index(udata) == true);
+		}
+		res = bgenv_set_uservar(udata, "a", USERVAR_TYPE_DEFAULT,
+					"1", 2);
+		ck_assert_int_eq(res, 0);
+
+		/* Test if growing a variable does not take the zero
+		 * terminating the user variables
+		 */
+		res = bgenv_set_uservar(udata, "a", USERVAR_TYPE_DEFAULT, big,
+					ENV_MEM_USERVARS - overhead);
+		ck_assert_int_eq(res, -ENOMEM);
+		ck_assert_int_eq(udata[ENV_MEM_USERVARS - 1], 0);
+
+		/* Test if the variable may fill all space but that zero
+		 */
+		res = bgenv_set_uservar(udata, "a", USERVAR_TYPE_DEFAULT,
+					"1", 2);
+		ck_assert_int_eq(res, 0);
+		res = bgenv_set_uservar(udata, "a", USERVAR_TYPE_DEFAULT, big,
+					ENV_MEM_USERVARS - overhead - 1);
+		ck_assert_int_eq(res, 0);
+		ck_assert_int_eq(udata[ENV_MEM_USERVARS - 1], 0);
+		ck_assert_int_eq(bgenv_user_free(udata), 1);
+		bgenv_drop_uservar_index(udata);
+	}
+	free(big);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_uservar_index)
+{
+	uint8_t *udata = envdata[0].userdata;
+	uint8_t *var;
+	char *key;
+	int res;
+
+	memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+	res = bgenv_set_uservar(udata, "var1", USERVAR_TYPE_STRING_ASCII,
+				"a", 2);
+	ck_assert_int_eq(res, 0);
+
+	/* Test if the index picks up variables present at build time
+	 */
+	ck_assert(bgenv_build_uservar_index(udata) == true);
+	var = bgenv_find_uservar(udata, "var1");
+	ck_assert(var == udata);
+
+	/* Test if the index follows records moved by resizing and deleting
+	 * other variables
+	 */
+	res = bgenv_set_uservar(udata, "var2", USERVAR_TYPE_STRING_ASCII,
+				"bb", 3);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar(udata, "var3", USERVAR_TYPE_STRING_ASCII,
+				"ccc", 4);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar(udata, "var1", USERVAR_TYPE_STRING_ASCII,
+				"aaaa", 5);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar(udata, "var2", USERVAR_TYPE_DELETED, "", 1);
+	ck_assert_int_eq(res, 0);
+
+	ck_assert(bgenv_find_uservar(udata, "var2") == NULL);
+	var = bgenv_find_uservar(udata, "var3");
+	ck_assert(var == udata);
+	var = bgenv_find_uservar(udata, "var1");
+	ck_assert(var == bgenv_next_uservar(udata));
+	bgenv_map_uservar(var, &key, NULL, NULL, NULL, NULL);
+	ck_assert(strcmp(key, "var1") == 0);
+
+	/* Test if the cached end of the region matches the records
+	 */
+	ck_assert_int_eq(bgenv_user_free(udata), ENV_MEM_USERVARS - 43);
+	bgenv_drop_uservar_index(udata);
+	ck_assert_int_eq(bgenv_user_free(udata), ENV_MEM_USERVARS - 43);
+	var = bgenv_find_uservar(udata, "var1");
+	ck_assert(var == bgenv_next_uservar(udata));
+
+	/* Test if building the index fails for a record exceeding the
+	 * region
+	 */
+	uint32_t payload_size = ENV_MEM_USERVARS;
+
+	var = udata + ENV_MEM_USERVARS - bgenv_user_free(udata);
+	memcpy(var, "x", 2);
+	memcpy(var + 2, &payload_size, sizeof(payload_size));
+	ck_assert(bgenv_build_uservar_index(udata) == false);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_set_many)
+{
+	BGENV *handle = bgenv_open_latest();
+	uint8_t *udata;
+	uint8_t *var;
+	char *key, *value;
+	int res;
+
+	ck_assert(handle != NULL);
+	udata = handle->data->userdata;
+	memset(handle->data, 0, sizeof(BG_ENVDATA));
+
+	ebgenv_var_t vars[] = {
+		{"var1", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"a", 2},
+		{"var2", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"b", 2},
+		{"var3", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"c", 2},
+		{"watchdog_timeout_sec", 0, (uint8_t *)"44", 3},
+		{"var1", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"new", 4},
+	};
+
+	/* Test if bgenv_set_many sets pre-defined and user variables and
+	 * if the last occurrence of a key wins
+	 */
+	res = bgenv_set_many(handle, vars, 5);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(handle->data->watchdog_timeout_sec, 44);
+
+	var = bgenv_find_uservar(udata, "var1");
+	ck_assert(var == udata);
+	bgenv_map_uservar(var, &key, NULL, (uint8_t **)&value, NULL, NULL);
+	ck_assert(strcmp(value, "new") == 0);
+
+	/* Test if deleted variables are removed and remaining variables keep
+	 * their order
+	 */
+	vars[0].type = USERVAR_TYPE_DELETED;
+	res = bgenv_set_many(handle, vars, 1);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_find_uservar(udata, "var1") == NULL);
+	bgenv_map_uservar(udata, &key, NULL, NULL, NULL, NULL);
+	ck_assert(strcmp(key, "var2") == 0);
+	bgenv_map_uservar(bgenv_next_uservar(udata), &key, NULL, NULL, NULL,
+			  NULL);
+	ck_assert(strcmp(key, "var3") == 0);
+
+	/* Test if user variables are left untouched if they do not fit
+	 */
+	BG_ENVDATA *copy = malloc(sizeof(BG_ENVDATA));
+	uint8_t *big = calloc(1, ENV_MEM_USERVARS);
+
+	ck_assert(copy != NULL && big != NULL);
+	memcpy(copy, handle->data, sizeof(BG_ENVDATA));
+	ebgenv_var_t too_big[] = {
+		{"var2", USERVAR_TYPE_DELETED, (uint8_t *)"", 1},
+		{"var4", USERVAR_TYPE_DEFAULT, big, ENV_MEM_USERVARS},
+	};
+	res = bgenv_set_many(handle, too_big, 2);
+	ck_assert_int_eq(res, -ENOMEM);
+	ck_assert(memcmp(copy, handle->data, sizeof(BG_ENVDATA)) == 0);
+
+	free(big);
+	free(copy);
+	free(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_deferred_compaction)
+{
+	uint8_t *udata = envdata[0].userdata;
+	ebgenv_user_stats_t stats;
+	uint8_t *big;
+	char *key;
+	int res;
+
+	memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+	ck_assert(bgenv_build_uservar_index(udata) == true);
+	ck_assert(bgenv_defer_uservar_compaction(udata, true) == true);
+
+	res = bgenv_set_uservar(udata, "var1", USERVAR_TYPE_STRING_ASCII,
+				"a", 2);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar(udata, "var2", USERVAR_TYPE_STRING_ASCII,
+				"b", 2);
+	ck_assert_int_eq(res, 0);
+
+	/* Test if a growing variable stays in place and uses its slack
+	 */
+	res = bgenv_set_uservar(udata, "var1", USERVAR_TYPE_STRING_ASCII,
+				"aaaa", 5);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_find_uservar(udata, "var1") == udata);
+	ck_assert(bgenv_find_uservar(udata, "var2") == udata + 51);
+
+	/* Test if deleted variables are kept as dead space
+	 */
+	res = bgenv_set_uservar(udata, "var2", USERVAR_TYPE_DELETED, "", 1);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_find_uservar(udata, "var2") == NULL);
+	bgenv_uservar_stats(udata, &stats);
+	ck_assert_int_eq(stats.live, 22);
+	ck_assert_int_eq(stats.dead, 19);
+	ck_assert_int_eq(stats.slack, 61);
+	ck_assert_int_eq(stats.free, ENV_MEM_USERVARS - 102);
+	ck_assert_int_eq(bgenv_user_free(udata), ENV_MEM_USERVARS - 22);
+
+	/* Test if running out of space compacts the variables
+	 */
+	big = calloc(1, ENV_MEM_USERVARS);
+	ck_assert(big != NULL);
+	res = bgenv_set_uservar(udata, "var3", USERVAR_TYPE_DEFAULT, big,
+				ENV_MEM_USERVARS - 40);
+	free(big);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_find_uservar(udata, "var1") == udata);
+	ck_assert(bgenv_find_uservar(udata, "var3") == udata + 22);
+	bgenv_uservar_stats(udata, &stats);
+	ck_assert_int_eq(stats.dead + stats.slack, 0);
+	ck_assert_int_eq(stats.free, 1);
+
+	/* Test if compaction leaves only live variables
+	 */
+	res = bgenv_set_uservar(udata, "var3", USERVAR_TYPE_DELETED, "", 1);
+	ck_assert_int_eq(res, 0);
+	bgenv_compact_uservars(udata);
+	bgenv_uservar_stats(udata, &stats);
+	ck_assert_int_eq(stats.live, 22);
+	ck_assert_int_eq(stats.dead + stats.slack, 0);
+	bgenv_map_uservar(udata, &key, NULL, NULL, NULL, NULL);
+	ck_assert(strcmp(key, "var1") == 0);
+	ck_assert_int_eq(*bgenv_next_uservar(udata), 0);
+
+	/* Test if a region without an index, e.g. a damaged one, is left
+	 * alone by compaction
+	 */
+	bgenv_drop_uservar_index(udata);
+	memset(udata, 0, ENV_MEM_USERVARS);
+	memcpy(udata, "var1\0\xff\xff\xff\xff", 9);
+	bgenv_compact_uservars(udata);
+	ck_assert(memcmp(udata, "var1\0\xff\xff\xff\xff", 9) == 0);
+	ck_assert_int_eq(udata[9], 0);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_compact_records)
+{
+	uint8_t *udata = envdata[0].userdata;
+	ebgenv_user_stats_t stats;
+	uint32_t blob = 0x12345678;
+	uint8_t *var;
+	uint64_t type;
+	char buf[8];
+	int res;
+
+	memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+	ck_assert(bgenv_build_uservar_index(udata) == true);
+
+	/* Test if compact records are written next to legacy records
+	 */
+	res = bgenv_set_uservar(udata, "var1", USERVAR_TYPE_STRING_ASCII,
+				"a", 2);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_use_compact_uservars(udata, true) == true);
+	res = bgenv_set_uservar(udata, "var2", USERVAR_TYPE_STRING_ASCII,
+				"b", 2);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(udata[19], USERVAR_COMPACT);
+	ck_assert_int_eq(bgenv_user_free(udata), ENV_MEM_USERVARS - 29);
+
+	/* Test if types above the single byte range are kept
+	 */
+	res = bgenv_set_uservar(udata, "var3",
+				USERVAR_TYPE_BLOB | USERVAR_TYPE_UINT32,
+				&blob, sizeof(blob));
+	ck_assert_int_eq(res, 0);
+	var = bgenv_find_uservar(udata, "var3");
+	ck_assert(var == udata + 29);
+	bgenv_map_uservar(var, NULL, &type, NULL, NULL, NULL);
+	ck_assert(type == (USERVAR_TYPE_BLOB | USERVAR_TYPE_UINT32));
+
+	res = bgenv_get_uservar(udata, "var2", &type, buf, sizeof(buf));
+	ck_assert_int_eq(res, 0);
+	ck_assert(type == USERVAR_TYPE_STRING_ASCII);
+	ck_assert(strcmp(buf, "b") == 0);
+
+	/* Test if reserved keys are rejected
+	 */
+	res = bgenv_set_uservar(udata, "\xfevar", USERVAR_TYPE_DEFAULT, "", 1);
+	ck_assert_int_eq(res, -EINVAL);
+
+	/* Test if deleted compact records become tombstones
+	 */
+	ck_assert(bgenv_defer_uservar_compaction(udata, true) == true);
+	res = bgenv_set_uservar(udata, "var2", USERVAR_TYPE_DELETED, "", 1);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(udata[19], USERVAR_COMPACT_DELETED);
+	ck_assert(bgenv_find_uservar(udata, "var2") == NULL);
+	bgenv_uservar_stats(udata, &stats);
+	ck_assert_int_eq(stats.dead, 10);
+
+	/* Test if compaction converts legacy records
+	 */
+	bgenv_compact_uservars(udata);
+	ck_assert_int_eq(udata[0], USERVAR_COMPACT);
+	bgenv_uservar_stats(udata, &stats);
+	ck_assert_int_eq(stats.live, 10 + 21);
+	ck_assert_int_eq(stats.dead + stats.slack, 0);
+
+	/* Test if compact records are found without an index
+	 */
+	bgenv_drop_uservar_index(udata);
+	res = bgenv_get_uservar(udata, "var1", &type, buf, sizeof(buf));
+	ck_assert_int_eq(res, 0);
+	ck_assert(strcmp(buf, "a") == 0);
+	ck_assert(bgenv_find_uservar(udata, "var3") == udata + 10);
+	ck_assert_int_eq(bgenv_user_free(udata), ENV_MEM_USERVARS - 31);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_uservar_iter)
+{
+	uint8_t *udata = envdata[0].userdata;
+	char *keys[] = {"swu.b", "app.x", "swu.a", "swua", "app.y", "swu.c"};
+	uint32_t pos;
+	uint8_t *var;
+	int res;
+
+	memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+	for (int i = 0; i < sizeof(keys) / sizeof(char *); i++) {
+		res = bgenv_set_uservar(udata, keys[i],
+					USERVAR_TYPE_STRING_ASCII, "v", 2);
+		ck_assert_int_eq(res, 0);
+	}
+
+	/* Test if iterating without index visits matching keys in storage
+	 * order
+	 */
+	pos = 0;
+	var = bgenv_iter_uservar(udata, "swu.", &pos);
+	ck_assert(var && strcmp((char *)var, "swu.b") == 0);
+	var = bgenv_iter_uservar(udata, "swu.", &pos);
+	ck_assert(var && strcmp((char *)var, "swu.a") == 0);
+	var = bgenv_iter_uservar(udata, "swu.", &pos);
+	ck_assert(var && strcmp((char *)var, "swu.c") == 0);
+	ck_assert(bgenv_iter_uservar(udata, "swu.", &pos) == NULL);
+
+	/* Test if iterating with index visits matching keys sorted and skips
+	 * deleted ones
+	 */
+	ck_assert(bgenv_build_uservar_index(udata) == true);
+	res = bgenv_set_uservar(udata, "swu.a", USERVAR_TYPE_DELETED, "", 1);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar(udata, "swu.0", USERVAR_TYPE_STRING_ASCII,
+				"v", 2);
+	ck_assert_int_eq(res, 0);
+	pos = 0;
+	var = bgenv_iter_uservar(udata, "swu.", &pos);
+	ck_assert(var && strcmp((char *)var, "swu.0") == 0);
+	var = bgenv_iter_uservar(udata, "swu.", &pos);
+	ck_assert(var && strcmp((char *)var, "swu.b") == 0);
+	var = bgenv_iter_uservar(udata, "swu.", &pos);
+	ck_assert(var && strcmp((char *)var, "swu.c") == 0);
+	ck_assert(bgenv_iter_uservar(udata, "swu.", &pos) == NULL);
+
+	/* Test if an empty prefix visits all keys
+	 */
+	pos = 0;
+	res = 0;
+	while (bgenv_iter_uservar(udata, NULL, &pos)) {
+		res++;
+	}
+	ck_assert_int_eq(res, 6);
+
+	bgenv_drop_uservar_index(udata);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_compress_env)
+{
+	BG_ENVDATA *env, *copy;
+	char key[16];
+	int res;
+
+	env = calloc(1, sizeof(BG_ENVDATA));
+	copy = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(env != NULL && copy != NULL);
+
+	env->revision = 7;
+	for (int i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "app.key%d", i);
+		res = bgenv_set_uservar(env->userdata, key,
+					USERVAR_TYPE_STRING_ASCII, "value", 6);
+		ck_assert_int_eq(res, 0);
+	}
+	env->crc32 = crc32(0, (Bytef *)env,
+			   sizeof(BG_ENVDATA) - sizeof(env->crc32));
+	memcpy(copy, env, sizeof(BG_ENVDATA));
+
+	/* Test if compressed user variables are marked, smaller and carry
+	 * a valid checksum
+	 */
+	ck_assert(compress_env(copy) == true);
+	ck_assert_int_eq(copy->userdata[0], USERDATA_ZLIB);
+	ck_assert_int_eq(copy->revision, 7);
+	ck_assert(copy->userdata[ENV_MEM_USERVARS / 8] == 0);
+	ck_assert(copy->crc32 == crc32(0, (Bytef *)copy, sizeof(BG_ENVDATA) -
+						       sizeof(copy->crc32)));
+
+	/* Test if decompressing restores the original environment
+	 */
+	ck_assert(decompress_env(copy) == true);
+	ck_assert(memcmp(copy, env, sizeof(BG_ENVDATA)) == 0);
+
+	/* Test if plain environments are left untouched and corrupt
+	 * compressed data is rejected
+	 */
+	ck_assert(decompress_env(copy) == true);
+	ck_assert(memcmp(copy, env, sizeof(BG_ENVDATA)) == 0);
+	ck_assert(compress_env(copy) == true);
+	copy->userdata[USERDATA_ZLIB_HEADER_SIZE + 2] ^= 0xFF;
+	ck_assert(decompress_env(copy) == false);
+
+	/* Test if keys clashing with the marker are rejected
+	 */
+	res = bgenv_set_uservar(env->userdata, "\xff", USERVAR_TYPE_DEFAULT,
+				"", 1);
+	ck_assert_int_eq(res, -EINVAL);
+
+	free(copy);
+	free(env);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_get_view)
+{
+	BGENV *handle = bgenv_open_latest();
+	uint8_t *value;
+	uint32_t datalen;
+	uint64_t type;
+	char buffer[8];
+	int res;
+
+	ck_assert(handle != NULL);
+	memset(handle->data, 0, sizeof(BG_ENVDATA));
+	res = bgenv_set(handle, "cert", USERVAR_TYPE_DEFAULT, "abcdef", 7);
+	ck_assert_int_eq(res, 0);
+	handle->dirty = false;
+
+	/* Test if a read-only view points into the environment and leaves
+	 * it clean
+	 */
+	res = bgenv_get_view(handle, "cert", &type, &value, &datalen, false);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(datalen, 7);
+	ck_assert(type == USERVAR_TYPE_DEFAULT);
+	ck_assert(value > handle->data->userdata);
+	ck_assert(value < handle->data->userdata + ENV_MEM_USERVARS);
+	ck_assert(strcmp((char *)value, "abcdef") == 0);
+	ck_assert(handle->dirty == false);
+
+	/* Test if changes through a writable view are visible and mark the
+	 * environment dirty
+	 */
+	res = bgenv_get_view(handle, "cert", NULL, &value, NULL, true);
+	ck_assert_int_eq(res, 0);
+	ck_assert(handle->dirty == true);
+	value[0] = 'X';
+	res = bgenv_get(handle, "cert", NULL, buffer, sizeof(buffer));
+	ck_assert_int_eq(res, 0);
+	ck_assert(strcmp(buffer, "Xbcdef") == 0);
+
+	/* Test if missing and pre-defined variables are rejected
+	 */
+	res = bgenv_get_view(handle, "nope", NULL, &value, NULL, false);
+	ck_assert_int_eq(res, -ENOENT);
+	res = bgenv_get_view(handle, "kernelfile", NULL, &value, NULL, false);
+	ck_assert_int_eq(res, -EINVAL);
+
+	free(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_blob)
+{
+	BGENV *handle = bgenv_open_latest();
+	char mountpoint[] = "/tmp/ebgenv-test-XXXXXX";
+	CONFIG_PART *part;
+	uint32_t *ids, count;
+	uint8_t *value, *buffer;
+	uint64_t type;
+	int res;
+
+	RESET_FAKE(write_env);
+	write_env_fake.custom_fake = write_env_custom_fake;
+
+	ck_assert(handle != NULL);
+	memset(handle->data, 0, sizeof(BG_ENVDATA));
+	part = (CONFIG_PART *)handle->desc;
+	ck_assert(mkdtemp(mountpoint) != NULL);
+	part->mountpoint = mountpoint;
+	part->not_mounted = false;
+
+	value = malloc(ENV_MEM_USERVARS * 2);
+	buffer = malloc(ENV_MEM_USERVARS * 2);
+	ck_assert(value != NULL && buffer != NULL);
+	for (int i = 0; i < ENV_MEM_USERVARS * 2; i++) {
+		value[i] = i;
+	}
+
+	/* Test if values larger than the user variable memory are stored
+	 * in a separate file
+	 */
+	res = bgenv_set(handle, "manifest", USERVAR_TYPE_BLOB, value,
+			ENV_MEM_USERVARS * 2);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_user_free(handle->data->userdata) >
+		  ENV_MEM_USERVARS - 64);
+	res = bgenv_get(handle, "manifest", &type, NULL,
+			ENV_MEM_USERVARS * 2);
+	ck_assert_int_eq(res, ENV_MEM_USERVARS * 2);
+	res = bgenv_get(handle, "manifest", &type, buffer,
+			ENV_MEM_USERVARS * 2);
+	ck_assert_int_eq(res, 0);
+	ck_assert(type & USERVAR_TYPE_BLOB);
+	ck_assert(memcmp(value, buffer, ENV_MEM_USERVARS * 2) == 0);
+
+	/* Test if replaced blob files are removed after writing
+	 */
+	res = bgenv_set(handle, "manifest", USERVAR_TYPE_BLOB, "new", 4);
+	ck_assert_int_eq(res, 0);
+	ck_assert(list_blob_files(part, &ids, &count) == true);
+	ck_assert_int_eq(count, 2);
+	free(ids);
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert(list_blob_files(part, &ids, &count) == true);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(ids[0], 2);
+	free(ids);
+	res = bgenv_get(handle, "manifest", NULL, buffer, 4);
+	ck_assert_int_eq(res, 0);
+	ck_assert(strcmp((char *)buffer, "new") == 0);
+
+	/* Test if deleting the variable removes the blob file
+	 */
+	res = bgenv_set(handle, "manifest", USERVAR_TYPE_DELETED, "", 1);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert(list_blob_files(part, &ids, &count) == true);
+	ck_assert_int_eq(count, 0);
+	free(ids);
+
+	/* Test if no blob is written when the existing ones cannot be
+	 * listed, as its id could be taken
+	 */
+	rmdir(mountpoint);
+	res = bgenv_set(handle, "manifest", USERVAR_TYPE_BLOB, "new", 4);
+	ck_assert_int_eq(res, -EIO);
+	ck_assert(list_blob_files(part, &ids, &count) == false);
+	ck_assert(ids == NULL);
+
+	part->mountpoint = NULL;
+	free(buffer);
+	free(value);
+	free(handle);
+}
+END_TEST
+
+static void write_file(char *dir, char *name, char *contents)
+{
+	char *path;
+	FILE *f;
+
+	ck_assert(asprintf(&path, "%s/%s", dir, name) > 0);
+	f = fopen(path, "w");
+	ck_assert(f != NULL);
+	ck_assert(fputs(contents, f) >= 0);
+	ck_assert(fclose(f) == 0);
+	free(path);
+}
+
+static void remove_files(char *dir)
+{
+	uint32_t *ids, count;
+	CONFIG_PART part = {.mountpoint = dir};
+	char name[sizeof("00000000.BLB")];
+	char *path;
+
+	ck_assert(list_blob_files(&part, &ids, &count) == true);
+	for (uint32_t i = 0; i < count; i++) {
+		(void)snprintf(name, sizeof(name), BLOB_FILENAME_FORMAT,
+			       ids[i]);
+		ck_assert(asprintf(&path, "%s/%s", dir, name) > 0);
+		remove(path);
+		free(path);
+	}
+	free(ids);
+	rmdir(dir);
+}
+
+START_TEST(ebgenv_api_internal_copy_blobs)
+{
+	BGENV *src = bgenv_open_by_index(0);
+	BGENV *dst = bgenv_open_by_index(1);
+	char src_dir[] = "/tmp/ebgenv-test-XXXXXX";
+	char dst_dir[] = "/tmp/ebgenv-test-XXXXXX";
+	CONFIG_PART *src_part, *dst_part;
+	uint32_t *ids, count;
+	char buffer[16];
+	int res;
+
+	ck_assert(src != NULL && dst != NULL);
+	memset(src->data, 0, sizeof(BG_ENVDATA));
+	src_part = (CONFIG_PART *)src->desc;
+	dst_part = (CONFIG_PART *)dst->desc;
+	ck_assert(mkdtemp(src_dir) != NULL);
+	ck_assert(mkdtemp(dst_dir) != NULL);
+	src_part->mountpoint = src_dir;
+	src_part->not_mounted = false;
+	dst_part->mountpoint = dst_dir;
+	dst_part->not_mounted = false;
+
+	res = bgenv_set(src, "manifest", USERVAR_TYPE_BLOB, "value", 6);
+	ck_assert_int_eq(res, 0);
+	/* referred to by the environment on disk of the target */
+	write_file(dst_dir, "00000001.BLB", "old");
+
+	/* Test if blobs are copied to fresh files, leaving files on the
+	 * target in place
+	 */
+	memcpy(dst->data, src->data, sizeof(BG_ENVDATA));
+	(void)bgenv_build_uservar_index(dst->data->userdata);
+	dst->blobs_changed = false;
+	ck_assert(bgenv_copy_blobs(dst, src) == true);
+	ck_assert(dst->blobs_changed == true);
+	ck_assert(list_blob_files(dst_part, &ids, &count) == true);
+	ck_assert_int_eq(count, 2);
+	free(ids);
+	res = bgenv_get(dst, "manifest", NULL, buffer, sizeof(buffer));
+	ck_assert_int_eq(res, 0);
+	ck_assert(strcmp(buffer, "value") == 0);
+
+	/* Test if a failed copy leaves no files behind and does not have
+	 * the blobs of the target cleaned up
+	 */
+	remove_files(src_dir);
+	ck_assert(mkdtemp(strcpy(src_dir, "/tmp/ebgenv-test-XXXXXX")));
+	memcpy(dst->data, src->data, sizeof(BG_ENVDATA));
+	(void)bgenv_build_uservar_index(dst->data->userdata);
+	dst->blobs_changed = false;
+	ck_assert(bgenv_copy_blobs(dst, src) == false);
+	ck_assert(dst->blobs_changed == false);
+	ck_assert(list_blob_files(dst_part, &ids, &count) == true);
+	ck_assert_int_eq(count, 2);
+	free(ids);
+
+	/* Test if environments without blobs do not have blob files
+	 * cleaned up, which needs the partition mounted
+	 */
+	ck_assert(bgenv_has_blobs(dst) == true);
+	memset(dst->data, 0, sizeof(BG_ENVDATA));
+	(void)bgenv_build_uservar_index(dst->data->userdata);
+	ck_assert(bgenv_has_blobs(dst) == false);
+	ck_assert(bgenv_copy_blobs(dst, src) == true);
+	ck_assert(dst->blobs_changed == false);
+
+	remove_files(src_dir);
+	remove_files(dst_dir);
+	src_part->mountpoint = NULL;
+	dst_part->mountpoint = NULL;
+	free(src);
+	free(dst);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_dirty_write)
+{
+	BGENV *handle = bgenv_open_by_index(0);
+	char mountpoint[] = "/tmp/ebgenv-test-XXXXXX";
+	BG_ENVDATA *disk;
+	CONFIG_PART *part;
+	char *path;
+	FILE *config;
+	char buffer[8];
+	int res;
+
+	RESET_FAKE(write_env);
+	write_env_fake.custom_fake = write_env_custom_fake;
+
+	ck_assert(handle != NULL);
+	disk = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(disk != NULL);
+	memset(handle->data, 0, sizeof(BG_ENVDATA));
+	ck_assert(bgenv_build_uservar_index(handle->data->userdata));
+	part = (CONFIG_PART *)handle->desc;
+	ck_assert(mkdtemp(mountpoint) != NULL);
+	part->mountpoint = mountpoint;
+	part->not_mounted = false;
+	ck_assert(asprintf(&path, "%s/" FAT_ENV_FILENAME, mountpoint) > 0);
+
+	res = bgenv_set(handle, "first", 0, "1111", 5);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set(handle, "second", 0, "2222", 5);
+	ck_assert_int_eq(res, 0);
+
+	/* Test if the whole file is written if it does not exist
+	 */
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+
+	/* Test if only changed bytes and the checksum are written, leaving
+	 * a marker outside of them untouched
+	 */
+	memcpy(disk, handle->data, sizeof(BG_ENVDATA));
+	disk->kernelparams[0] = 'X';
+	config = fopen(path, "wb");
+	ck_assert(config != NULL);
+	ck_assert(fwrite(disk, sizeof(BG_ENVDATA), 1, config) == 1);
+	fclose(config);
+
+	res = bgenv_set(handle, "ustate", 0, "2", 2);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set(handle, "second", 0, "3333", 5);
+	ck_assert_int_eq(res, 0);
+	handle->data->crc32 = crc32(0, (Bytef *)handle->data,
+		sizeof(BG_ENVDATA) - sizeof(handle->data->crc32));
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+
+	config = fopen(path, "rb");
+	ck_assert(config != NULL);
+	ck_assert(fread(disk, sizeof(BG_ENVDATA), 1, config) == 1);
+	fclose(config);
+	ck_assert_int_eq(disk->kernelparams[0], 'X');
+	ck_assert_int_eq(disk->ustate, 2);
+	ck_assert_int_eq(disk->crc32, handle->data->crc32);
+	ck_assert(bgenv_get_uservar(disk->userdata, "second", NULL, buffer,
+				    sizeof(buffer)) == 0);
+	ck_assert(strcmp(buffer, "3333") == 0);
+
+	/* Test if compressed environments are rewritten completely
+	 */
+	bgenv_be_compressing(true);
+	res = bgenv_set(handle, "first", 0, "4444", 5);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert_int_eq(write_env_fake.call_count, 2);
+	bgenv_be_compressing(false);
+
+	remove(path);
+	rmdir(mountpoint);
+	part->mountpoint = NULL;
+	free(path);
+	free(disk);
+	free(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_skip_unchanged)
+{
+	BGENV *handle = bgenv_open_by_index(0);
+	uint32_t skipped;
+	int res;
+
+	RESET_FAKE(write_env);
+	write_env_fake.custom_fake = write_env_custom_fake;
+
+	ck_assert(handle != NULL);
+	memset(handle->data, 0, sizeof(BG_ENVDATA));
+	ck_assert(bgenv_build_uservar_index(handle->data->userdata));
+	res = bgenv_set(handle, "key", 0, "value", 6);
+	ck_assert_int_eq(res, 0);
+	skipped = bgenv_get_skipped_writes();
+
+	/* Test if an environment not known to be stored is written
+	 */
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+
+	/* Test if writing unchanged data, also after setting variables to
+	 * their current values, is skipped and counted
+	 */
+	ck_assert(bgenv_write(handle) == true);
+	res = bgenv_set(handle, "key", 0, "value", 6);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set(handle, "ustate", 0, "0", 2);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+	ck_assert_int_eq(bgenv_get_skipped_writes(), skipped + 2);
+
+	/* Test if changed data is written again
+	 */
+	res = bgenv_set(handle, "key", 0, "other", 6);
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_write(handle) == true);
+	ck_assert_int_eq(write_env_fake.call_count, 2);
+	ck_assert_int_eq(bgenv_get_skipped_writes(), skipped + 2);
+
+	free(handle);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -441,7 +1248,19 @@ Suite *ebg_test_suite(void)
 		ebgenv_api_internal_bgenv_create_new,
 		ebgenv_api_internal_bgenv_get,
 		ebgenv_api_internal_bgenv_set,
-		ebgenv_api_internal_uservars
+		ebgenv_api_internal_uservars,
+		ebgenv_api_internal_uservar_grow,
+		ebgenv_api_internal_uservar_index,
+		ebgenv_api_internal_bgenv_set_many,
+		ebgenv_api_internal_deferred_compaction,
+		ebgenv_api_internal_compact_records,
+		ebgenv_api_internal_uservar_iter,
+		ebgenv_api_internal_compress_env,
+		ebgenv_api_internal_bgenv_get_view,
+		ebgenv_api_internal_blob,
+		ebgenv_api_internal_copy_blobs,
+		ebgenv_api_internal_dirty_write,
+		ebgenv_api_internal_skip_unchanged
 	};
 
 	tc_core = tcase_create("Core");
@@ -0,0 +1,288 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <check.h>
+#include <fff.h>
+#include <ebgpart.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __wrap_read(int fd, void *buf, size_t count);
+
+#define SLOW_READ_MS 2000
+
+static char dir[] = "/tmp/ebgpart-XXXXXX";
+
+/* Empty files stand in for stalled devices, reading them takes long */
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0) {
+		struct timespec t = {.tv_sec = SLOW_READ_MS / 1000};
+
+		nanosleep(&t, NULL);
+		return 0;
+	}
+	return __real_read(fd, buf, count);
+}
+
+static PedDevice *fake_device(char *name, uint8_t part_type)
+{
+	uint8_t mbr[512] = {0};
+	PedDevice *dev = calloc(1, sizeof(PedDevice));
+
+	ck_assert(dev != NULL);
+	ck_assert(asprintf(&dev->model, "%s", "Fake Device") > 0);
+	ck_assert(asprintf(&dev->path, "%s/%s", dir, name) > 0);
+
+	FILE *f = fopen(dev->path, "w");
+	ck_assert(f != NULL);
+	if (part_type) {
+		mbr[446 + 4] = part_type;
+		mbr[510] = 0x55;
+		mbr[511] = 0xaa;
+		ck_assert(fwrite(mbr, sizeof(mbr), 1, f) == 1);
+	}
+	ck_assert(fclose(f) == 0);
+	return dev;
+}
+
+static void free_device(PedDevice *dev)
+{
+	remove(dev->path);
+	while (dev->part_list) {
+		PedPartition *p = dev->part_list;
+
+		dev->part_list = p->next;
+		if (p->fs_type) {
+			free(p->fs_type->name);
+			free(p->fs_type);
+		}
+		free(p->path);
+		free(p);
+	}
+	free(dev->model);
+	free(dev->path);
+	free(dev);
+}
+
+/* A partition as listed by the kernel, starting at sector start */
+static void kernel_partition(PedDevice *dev, uint16_t num, uint64_t start,
+			     char *fat)
+{
+	PedPartition **pp = &dev->part_list;
+	uint8_t sector[512] = {0};
+
+	while (*pp) {
+		pp = &(*pp)->next;
+	}
+	*pp = calloc(1, sizeof(PedPartition));
+	ck_assert(*pp != NULL);
+	(*pp)->num = num;
+	(*pp)->start = start;
+	ck_assert(asprintf(&(*pp)->path, "%s-part%u", dev->path, num) > 0);
+
+	if (fat) {
+		memcpy(sector + (strcmp(fat, "FAT32   ") == 0 ? 0x52 : 0x36),
+		       fat, 8);
+	}
+	sector[510] = 0x55;
+	sector[511] = 0xaa;
+	FILE *f = fopen(dev->path, "r+");
+	ck_assert(f != NULL);
+	ck_assert(fseek(f, start * 512, SEEK_SET) == 0);
+	ck_assert(fwrite(sector, sizeof(sector), 1, f) == 1);
+	ck_assert(fclose(f) == 0);
+}
+
+/* A disk with a GPT listing FAT partitions, not in the order of their
+ * position, and one whose boot sector lies behind the end of the disk */
+static PedDevice *fake_GPT_device(char *name)
+{
+	uint8_t fat_guid[16] = GPT_PARTITION_GUID_FAT_NTFS;
+	struct EFIpartitionentry e[5] = {0};
+	struct EFIHeader hdr = {0};
+	uint8_t sector[512] = {0};
+	uint32_t start_LBA = 1;
+	PedDevice *dev = fake_device(name, 0xee);
+	FILE *f;
+
+	memcpy(e[0].type_GUID, fat_guid, 16);
+	e[0].start_LBA = 40;
+	memset(e[2].type_GUID, 0x11, 16);
+	e[2].start_LBA = 50;
+	memcpy(e[3].type_GUID, fat_guid, 16);
+	e[3].start_LBA = 30;
+	memcpy(e[4].type_GUID, fat_guid, 16);
+	e[4].start_LBA = 1000;
+	memcpy(hdr.signature, "EFI PART", 8);
+	hdr.partitiontable_LBA = 2;
+	hdr.partitions = 5;
+	hdr.partitionentrysize = sizeof(struct EFIpartitionentry);
+
+	f = fopen(dev->path, "r+");
+	ck_assert(f != NULL);
+	ck_assert(fseek(f, 446 + 8, SEEK_SET) == 0);
+	ck_assert(fwrite(&start_LBA, sizeof(start_LBA), 1, f) == 1);
+	ck_assert(fseek(f, 512, SEEK_SET) == 0);
+	ck_assert(fwrite(&hdr, 512, 1, f) == 1);
+	ck_assert(fwrite(e, sizeof(e), 1, f) == 1);
+	memcpy(sector + 0x36, "FAT16   ", 8);
+	ck_assert(fseek(f, 40 * 512, SEEK_SET) == 0);
+	ck_assert(fwrite(sector, sizeof(sector), 1, f) == 1);
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector + 0x52, "FAT32   ", 8);
+	ck_assert(fseek(f, 30 * 512, SEEK_SET) == 0);
+	ck_assert(fwrite(sector, sizeof(sector), 1, f) == 1);
+	ck_assert(fseek(f, 60 * 512 - 1, SEEK_SET) == 0);
+	ck_assert(fputc(0, f) == 0);
+	ck_assert(fclose(f) == 0);
+	return dev;
+}
+
+static uint64_t elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+START_TEST(ebgpart_probe_devices)
+{
+	PedDevice *devs[PED_PROBE_WORKERS + 2];
+	PedProbeResult result[PED_PROBE_WORKERS + 2];
+	struct timespec start;
+	char name[64];
+
+	ck_assert(mkdtemp(dir) != NULL);
+
+	/* Test if devices are probed without deadlines
+	 */
+	devs[0] = fake_device("fat", 0x0e);
+	devs[1] = fake_device("missing", 0);
+	remove(devs[1]->path);
+	ped_device_set_probe_timeouts(0, 0);
+	ped_device_probe(devs, result, 2);
+	ck_assert_int_eq(result[0], PED_PROBE_FOUND);
+	ck_assert(devs[0]->part_list != NULL);
+	ck_assert(strcmp(devs[0]->part_list->fs_type->name, "fat16") == 0);
+	(void)snprintf(name, sizeof(name), "%s/fat1", dir);
+	ck_assert(strcmp(devs[0]->part_list->path, name) == 0);
+	ck_assert_int_eq(result[1], PED_PROBE_NONE);
+	free_device(devs[0]);
+	free_device(devs[1]);
+
+	/* Test if the FAT partitions of a GPT are told apart by their boot
+	 * sectors, dropping those which cannot be read
+	 */
+	devs[0] = fake_GPT_device("gpt");
+	ped_device_probe(devs, result, 1);
+	ck_assert_int_eq(result[0], PED_PROBE_FOUND);
+	PedPartition *p = devs[0]->part_list;
+	ck_assert_int_eq(p->num, 1);
+	ck_assert(strcmp(p->fs_type->name, "fat16") == 0);
+	ck_assert_int_eq(p->next->num, 3);
+	ck_assert(strcmp(p->next->fs_type->name, "not supported") == 0);
+	ck_assert_int_eq(p->next->next->num, 4);
+	ck_assert(strcmp(p->next->next->fs_type->name, "fat32") == 0);
+	ck_assert(p->next->next->next == NULL);
+	free_device(devs[0]);
+
+	/* Test if partitions listed by the kernel are told apart by their
+	 * boot sectors, without reading the partition table
+	 */
+	devs[0] = fake_device("listed", 0);
+	kernel_partition(devs[0], 1, 2, "FAT16   ");
+	kernel_partition(devs[0], 2, 4, "FAT32   ");
+	kernel_partition(devs[0], 5, 6, NULL);
+	ped_device_probe(devs, result, 1);
+	ck_assert_int_eq(result[0], PED_PROBE_FOUND);
+	p = devs[0]->part_list;
+	ck_assert(strcmp(p->fs_type->name, "fat16") == 0);
+	ck_assert(strcmp(p->next->fs_type->name, "fat32") == 0);
+	ck_assert(strcmp(p->next->next->fs_type->name, "not supported") == 0);
+	free_device(devs[0]);
+
+	/* Test if a stalled device is skipped after the deadline per
+	 * device, while the others are probed
+	 */
+	devs[0] = fake_device("fat0", 0x0e);
+	devs[1] = fake_device("stalled", 0);
+	devs[2] = fake_device("fat2", 0x0c);
+	ped_device_set_probe_timeouts(100, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ped_device_probe(devs, result, 3);
+	ck_assert(elapsed_ms(&start) < SLOW_READ_MS / 2);
+	ck_assert_int_eq(result[0], PED_PROBE_FOUND);
+	ck_assert_int_eq(result[1], PED_PROBE_TIMEOUT);
+	ck_assert_int_eq(result[2], PED_PROBE_FOUND);
+	ck_assert(strcmp(devs[2]->part_list->fs_type->name, "fat32") == 0);
+	/* partitions of disks with names ending in a digit get a "p" */
+	(void)snprintf(name, sizeof(name), "%s/fat0p1", dir);
+	ck_assert(strcmp(devs[0]->part_list->path, name) == 0);
+	free_device(devs[0]);
+	free_device(devs[2]);
+
+	/* Test if the total deadline also covers devices no worker got to,
+	 * as all of them are stalled
+	 */
+	for (int i = 0; i < PED_PROBE_WORKERS + 1; i++) {
+		(void)snprintf(name, sizeof(name), "stalled%d", i);
+		devs[i] = fake_device(name, 0);
+	}
+	devs[PED_PROBE_WORKERS + 1] = fake_device("late", 0x0e);
+	ped_device_set_probe_timeouts(0, 200);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ped_device_probe(devs, result, PED_PROBE_WORKERS + 2);
+	ck_assert(elapsed_ms(&start) < SLOW_READ_MS / 2);
+	for (int i = 0; i < PED_PROBE_WORKERS + 2; i++) {
+		ck_assert_int_eq(result[i], PED_PROBE_TIMEOUT);
+	}
+
+	/* the stalled devices are freed by the workers once done */
+	ped_device_set_probe_timeouts(PED_PROBE_DEVICE_TIMEOUT_MS,
+				      PED_PROBE_TOTAL_TIMEOUT_MS);
+	for (int i = 0; i < PED_PROBE_WORKERS + 1; i++) {
+		(void)snprintf(name, sizeof(name), "%s/stalled%d", dir, i);
+		remove(name);
+	}
+	(void)snprintf(name, sizeof(name), "%s/stalled", dir);
+	remove(name);
+	(void)snprintf(name, sizeof(name), "%s/late", dir);
+	remove(name);
+	rmdir(dir);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("ebgpart");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, ebgpart_probe_devices);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,170 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <env_disk_utils.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+static void write_mountinfo(char *path, char *contents)
+{
+	FILE *info = fopen(path, "w");
+
+	ck_assert(info != NULL);
+	ck_assert(fputs(contents, info) >= 0);
+	ck_assert(fclose(info) == 0);
+}
+
+START_TEST(env_disk_utils_get_mountpoint)
+{
+	char dir[] = "/tmp/ebgmnt-XXXXXX";
+	char *info, *node, *alias, *other, *mnt;
+	FILE *f;
+
+	ck_assert(mkdtemp(dir) != NULL);
+	ck_assert(asprintf(&info, "%s/mountinfo", dir) > 0);
+	ck_assert(asprintf(&node, "%s/sdx1", dir) > 0);
+	ck_assert(asprintf(&alias, "%s/by-label", dir) > 0);
+	ck_assert(asprintf(&other, "%s/sdx2", dir) > 0);
+	write_mountinfo(info,
+			"20 1 8:17 /boot /mnt/bind rw - vfat /dev/sdx1 rw\n"
+			"21 1 8:17 / /mnt/with\\040space rw - vfat "
+			"/dev/sdx1 rw\n"
+			"22 1 8:17 / /mnt/second rw - vfat /dev/sdx1 rw\n"
+			"23 1 0:22 / /proc rw - proc proc rw\n");
+	mountinfo_path = info;
+	mount_table_release();
+
+	/* Test if paths that are no block devices are not looked up
+	 */
+	ck_assert(get_mountpoint(info) == NULL);
+	ck_assert(get_mountpoint("/nonexistent") == NULL);
+
+	if (mknod(node, S_IFBLK | 0600, makedev(8, 17)) ||
+	    mknod(alias, S_IFBLK | 0600, makedev(8, 17)) ||
+	    mknod(other, S_IFBLK | 0600, makedev(8, 18))) {
+		/* creating device nodes needs privileges */
+		goto cleanup;
+	}
+
+	/* Test if the first mount of the file system root is found by the
+	 * device number, for every alias of the device node
+	 */
+	mnt = get_mountpoint(node);
+	ck_assert(mnt != NULL);
+	ck_assert(strcmp(mnt, "/mnt/with space") == 0);
+	free(mnt);
+	mnt = get_mountpoint(alias);
+	ck_assert(mnt != NULL);
+	ck_assert(strcmp(mnt, "/mnt/with space") == 0);
+	free(mnt);
+	ck_assert(get_mountpoint(other) == NULL);
+
+	/* Test if the snapshot is kept until it is released
+	 */
+	write_mountinfo(info,
+			"24 1 8:18 / /mnt/other rw - vfat /dev/sdx2 rw\n");
+	ck_assert(get_mountpoint(other) == NULL);
+	mount_table_release();
+	mnt = get_mountpoint(other);
+	ck_assert(mnt != NULL);
+	ck_assert(strcmp(mnt, "/mnt/other") == 0);
+	free(mnt);
+	ck_assert(get_mountpoint(node) == NULL);
+
+	/* Test if the table grows with the mounts read, keeping the mounts
+	 * found before
+	 */
+	f = fopen(info, "w");
+	ck_assert(f != NULL);
+	fprintf(f, "24 1 8:18 / /mnt/other rw - vfat /dev/sdx2 rw\n");
+	for (int i = 0; i < 100; i++) {
+		fprintf(f, "%d 1 9:%d / /mnt/md%d rw - ext4 /dev/md%d rw\n",
+			30 + i, i, i, i);
+	}
+	fprintf(f, "200 1 8:17 / /mnt/last rw - vfat /dev/sdx1 rw\n");
+	ck_assert(fclose(f) == 0);
+	mount_table_release();
+	mnt = get_mountpoint(other);
+	ck_assert(mnt != NULL);
+	ck_assert(strcmp(mnt, "/mnt/other") == 0);
+	free(mnt);
+	mnt = get_mountpoint(node);
+	ck_assert(mnt != NULL);
+	ck_assert(strcmp(mnt, "/mnt/last") == 0);
+	free(mnt);
+
+cleanup:
+	mount_table_release();
+	mountinfo_path = "/proc/self/mountinfo";
+	remove(node);
+	remove(alias);
+	remove(other);
+	remove(info);
+	rmdir(dir);
+	free(node);
+	free(alias);
+	free(other);
+	free(info);
+}
+END_TEST
+
+START_TEST(env_disk_utils_unmount_owner)
+{
+	char dir[] = "/tmp/ebgmnt-XXXXXX";
+	CONFIG_PART part = {0};
+	struct stat st;
+
+	ck_assert(mkdtemp(dir) != NULL);
+
+	/* Test if a temporary mount of another process, e.g. the parent of
+	 * a forked one, is left alone
+	 */
+	part.mountpoint = strdup(dir);
+	ck_assert(part.mountpoint != NULL);
+	part.mount_owner = getpid() + 1;
+	unmount_partition(&part);
+	ck_assert(part.mountpoint != NULL);
+	ck_assert(stat(dir, &st) == 0);
+
+	/* Test if the owner removes it
+	 */
+	part.mount_owner = getpid();
+	unmount_partition(&part);
+	ck_assert(part.mountpoint == NULL);
+	ck_assert(stat(dir, &st) == -1);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_disk_utils");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_disk_utils_get_mountpoint);
+	tcase_add_test(tc_core, env_disk_utils_unmount_owner);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
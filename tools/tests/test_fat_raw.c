@@ -0,0 +1,412 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017
+ *
+ * Authors:
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <env_fat_raw.h>
+#include <uservars.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+extern bool read_env(CONFIG_PART *part, BG_ENVDATA *env);
+extern bool write_env(CONFIG_PART *part, BG_ENVDATA *env);
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+#define SECTOR_SIZE 512
+#define FILE_CLUSTERS ((sizeof(BG_ENVDATA) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define GAP_MARKER 0xAB
+
+typedef struct {
+	uint8_t type;
+	uint32_t num_clusters;
+	uint32_t reserved;
+	uint32_t root_entries;
+	uint32_t fat_sectors;
+	uint64_t fat_offset;
+	uint64_t root_offset;
+	uint64_t data_offset;
+	int fd;
+} TEST_IMAGE;
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static uint64_t cluster_offset(TEST_IMAGE *img, uint32_t cluster)
+{
+	return img->data_offset + (uint64_t)(cluster - 2) * SECTOR_SIZE;
+}
+
+/* Clusters of the environment file, with a gap every 100 clusters */
+static uint32_t file_cluster(uint32_t i)
+{
+	return 10 + i + (i / 100) * 3;
+}
+
+static void set_fat(TEST_IMAGE *img, uint32_t cluster, uint32_t value)
+{
+	uint8_t entry[4] = {0};
+	uint64_t offset;
+	uint16_t v;
+
+	if (img->type == 12) {
+		offset = img->fat_offset + cluster + cluster / 2;
+		ck_assert(pread(img->fd, entry, 2, offset) == 2);
+		v = entry[0] | entry[1] << 8;
+		if (cluster & 1) {
+			v = (v & 0x000F) | (value << 4);
+		} else {
+			v = (v & 0xF000) | (value & 0x0FFF);
+		}
+		put_le16(entry, v);
+		ck_assert(pwrite(img->fd, entry, 2, offset) == 2);
+		return;
+	}
+	offset = img->fat_offset + cluster * img->type / 8;
+	if (img->type == 16) {
+		put_le16(entry, value);
+	} else {
+		put_le32(entry, value);
+	}
+	ck_assert(pwrite(img->fd, entry, img->type / 8, offset) ==
+		  img->type / 8);
+}
+
+static void put_dirent(uint8_t *e, char *name, uint8_t attr,
+		       uint32_t cluster, uint32_t size)
+{
+	memcpy(e, name, 11);
+	e[11] = attr;
+	put_le16(e + 20, cluster >> 16);
+	put_le16(e + 26, cluster);
+	put_le32(e + 28, size);
+}
+
+static void create_image(TEST_IMAGE *img, char *path, uint8_t type,
+			 uint32_t num_clusters)
+{
+	uint8_t sector[SECTOR_SIZE] = {0};
+	uint8_t dir[2 * SECTOR_SIZE] = {0};
+	uint32_t root_sectors, total, eoc, i;
+	uint8_t *entry;
+
+	memset(img, 0, sizeof(TEST_IMAGE));
+	img->type = type;
+	img->num_clusters = num_clusters;
+	img->reserved = type == 32 ? 32 : 1;
+	img->root_entries = type == 32 ? 0 : 512;
+	img->fat_sectors = ((num_clusters + 2) * type / 8 + SECTOR_SIZE) /
+			   SECTOR_SIZE;
+	root_sectors = img->root_entries * 32 / SECTOR_SIZE;
+	total = img->reserved + 2 * img->fat_sectors + root_sectors +
+		num_clusters;
+	img->fat_offset = img->reserved * SECTOR_SIZE;
+	img->root_offset = img->fat_offset + 2 * img->fat_sectors * SECTOR_SIZE;
+	img->data_offset = img->root_offset + root_sectors * SECTOR_SIZE;
+	eoc = type == 12 ? 0xFFF : type == 16 ? 0xFFFF : 0x0FFFFFFF;
+
+	img->fd = mkstemp(path);
+	ck_assert(img->fd >= 0);
+	ck_assert(ftruncate(img->fd, (uint64_t)total * SECTOR_SIZE) == 0);
+
+	/* boot sector */
+	sector[0] = 0xEB;
+	sector[1] = 0x3C;
+	sector[2] = 0x90;
+	put_le16(sector + 11, SECTOR_SIZE);
+	sector[13] = 1;
+	put_le16(sector + 14, img->reserved);
+	sector[16] = 2;
+	put_le16(sector + 17, img->root_entries);
+	if (total < 0x10000) {
+		put_le16(sector + 19, total);
+	} else {
+		put_le32(sector + 32, total);
+	}
+	if (type == 32) {
+		put_le32(sector + 36, img->fat_sectors);
+		put_le32(sector + 44, 2);
+	} else {
+		put_le16(sector + 22, img->fat_sectors);
+	}
+	sector[510] = 0x55;
+	sector[511] = 0xAA;
+	ck_assert(pwrite(img->fd, sector, SECTOR_SIZE, 0) == SECTOR_SIZE);
+
+	/* file data, and markers in the gaps between its clusters */
+	for (i = 0; i < FILE_CLUSTERS; i++) {
+		memset(sector, i, SECTOR_SIZE);
+		ck_assert(pwrite(img->fd, sector, SECTOR_SIZE,
+				 cluster_offset(img, file_cluster(i))) ==
+			  SECTOR_SIZE);
+		set_fat(img, file_cluster(i),
+			i + 1 < FILE_CLUSTERS ? file_cluster(i + 1) : eoc);
+		if (file_cluster(i) + 1 != file_cluster(i + 1) &&
+		    i + 1 < FILE_CLUSTERS) {
+			memset(sector, GAP_MARKER, SECTOR_SIZE);
+			ck_assert(pwrite(img->fd, sector, SECTOR_SIZE,
+					 cluster_offset(img,
+							file_cluster(i) + 1)) ==
+				  SECTOR_SIZE);
+		}
+	}
+
+	/* root directory with entries to skip before the file */
+	put_dirent(dir, "EFIBOOTGRD ", 0x08, 0, 0);
+	put_dirent(dir + 32, "B\0G\0E\0N\0V\0\0", 0x0F, 0, 0);
+	put_dirent(dir + 64, "\xE5GENV   DAT", 0x20, 3, 100);
+	put_dirent(dir + 96, "BGENV      ", 0x10, 4, 0);
+	put_dirent(dir + 128, "OTHER   DAT", 0x20, 5, 100);
+	entry = dir + 160;
+	if (type == 32) {
+		/* make the root directory span two clusters */
+		for (; entry < dir + SECTOR_SIZE; entry += 32) {
+			put_dirent(entry, "FILLER  TXT", 0x20, 6, 1);
+		}
+		set_fat(img, 2, 3);
+		set_fat(img, 3, eoc);
+	}
+	put_dirent(entry, "BGENV   DAT", 0x20, file_cluster(0),
+		   sizeof(BG_ENVDATA));
+	ck_assert(pwrite(img->fd, dir, sizeof(dir),
+			 type == 32 ? cluster_offset(img, 2)
+				    : img->root_offset) == sizeof(dir));
+}
+
+static void check_image(uint8_t type, uint32_t num_clusters)
+{
+	char path[] = "/tmp/ebgfat-XXXXXX";
+	BG_ENVDATA *data, *env;
+	uint8_t sector[SECTOR_SIZE];
+	FAT_RAW_FILE file;
+	TEST_IMAGE img;
+	CONFIG_PART part;
+	FAT_RAW fs;
+
+	create_image(&img, path, type, num_clusters);
+	data = calloc(1, sizeof(BG_ENVDATA));
+	env = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(data && env);
+
+	/* Test if the file system and the file are found
+	 */
+	ck_assert(fat_raw_open(&fs, path, false));
+	ck_assert_int_eq(fs.type, type);
+	ck_assert_int_eq(fs.num_clusters, num_clusters);
+	ck_assert(fat_raw_lookup(&fs, "MISSING.DAT", &file) == false);
+	ck_assert(fat_raw_lookup(&fs, "bgenv.dat", &file) == true);
+	ck_assert_int_eq(file.cluster, file_cluster(0));
+	ck_assert_int_eq(file.size, sizeof(BG_ENVDATA));
+
+	/* Test if the fragmented file is read completely
+	 */
+	ck_assert(fat_raw_read(&fs, &file, data, sizeof(BG_ENVDATA)));
+	for (uint32_t i = 0; i < sizeof(BG_ENVDATA); i++) {
+		ck_assert_int_eq(((uint8_t *)data)[i],
+				 (uint8_t)(i / SECTOR_SIZE));
+	}
+	ck_assert(fat_raw_read(&fs, &file, data, sizeof(BG_ENVDATA) + 1) ==
+		  false);
+	fat_raw_close(&fs);
+
+	/* Test if an environment is written in place and read back
+	 */
+	memset(&part, 0, sizeof(part));
+	part.devpath = path;
+	part.raw = true;
+	memset(env, 0, sizeof(BG_ENVDATA));
+	env->revision = 42;
+	env->crc32 = crc32(0, (Bytef *)env,
+			   sizeof(BG_ENVDATA) - sizeof(env->crc32));
+	ck_assert(write_env(&part, env));
+	memset(data, 0xFF, sizeof(BG_ENVDATA));
+	ck_assert(read_env(&part, data));
+	ck_assert(memcmp(data, env, sizeof(BG_ENVDATA)) == 0);
+
+	/* Test if an environment of variable size is padded to the file,
+	 * which cannot grow or shrink
+	 */
+	BGENV handle = {.desc = &part, .data = &envdata[0]};
+	memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+	envdata[0].revision = 43;
+	ck_assert(bgenv_build_uservar_index(envdata[0].userdata));
+	ck_assert(bgenv_set_capacity(&handle, 1024));
+	ck_assert_int_eq(bgenv_set(&handle, "key", 0, "value", 6), 0);
+	ck_assert(write_env(&part, &envdata[0]));
+	ck_assert(fat_raw_probe_file(path, FAT_ENV_FILENAME, &file.size));
+	ck_assert_int_eq(file.size, sizeof(BG_ENVDATA));
+	memset(data, 0xFF, sizeof(BG_ENVDATA));
+	ck_assert(read_env(&part, data));
+	ck_assert(memcmp(data, &envdata[0], offsetof(BG_ENVDATA, crc32)) == 0);
+	ck_assert(bgenv_set_capacity(&handle, 0));
+	bgenv_drop_uservar_index(envdata[0].userdata);
+
+	/* Test if clusters outside of the chain are untouched
+	 */
+	ck_assert(pread(img.fd, sector, SECTOR_SIZE,
+			cluster_offset(&img, file_cluster(99) + 1)) ==
+		  SECTOR_SIZE);
+	ck_assert_int_eq(sector[0], GAP_MARKER);
+	ck_assert_int_eq(sector[SECTOR_SIZE - 1], GAP_MARKER);
+
+	close(img.fd);
+	remove(path);
+	free(data);
+	free(env);
+}
+
+START_TEST(env_file_variable_size)
+{
+	char mountpoint[] = "/tmp/ebgenv-test-XXXXXX";
+	BGENV handle;
+	CONFIG_PART part;
+	BG_ENVDATA *data;
+	BG_ENVFOOTER footer;
+	char big[2048];
+	struct stat st;
+	char *path;
+	FILE *f;
+
+	data = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(data != NULL);
+	ck_assert(mkdtemp(mountpoint) != NULL);
+	ck_assert(asprintf(&path, "%s/" FAT_ENV_FILENAME, mountpoint) > 0);
+	memset(&part, 0, sizeof(part));
+	part.devpath = "/dev/nobrain";
+	part.mountpoint = mountpoint;
+	handle.desc = &part;
+	handle.data = &envdata[0];
+	memset(&envdata[0], 0, sizeof(BG_ENVDATA));
+	envdata[0].revision = 7;
+	ck_assert(bgenv_build_uservar_index(envdata[0].userdata));
+
+	/* Test if the capacity limits the user variables
+	 */
+	ck_assert(bgenv_set_capacity(&handle, 1024));
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = 0;
+	ck_assert(bgenv_set(&handle, "big", 0, big, sizeof(big)) != 0);
+	ck_assert_int_eq(bgenv_set(&handle, "key", 0, "value", 6), 0);
+	ck_assert(bgenv_set_capacity(&handle, ENV_MEM_USERVARS + 1) == false);
+	ck_assert_int_eq(errno, EINVAL);
+
+	/* Test if the file holds only the used user variables
+	 */
+	ck_assert(write_env(&part, &envdata[0]));
+	ck_assert(stat(path, &st) == 0);
+	ck_assert(st.st_size > ENV_HEADER_SIZE + sizeof(BG_ENVFOOTER));
+	ck_assert(st.st_size < ENV_HEADER_SIZE + 64 + sizeof(BG_ENVFOOTER));
+	memset(data, 0xFF, sizeof(BG_ENVDATA));
+	ck_assert(read_env(&part, data));
+	ck_assert(memcmp(data, &envdata[0], offsetof(BG_ENVDATA, crc32)) == 0);
+	ck_assert_int_eq(data->crc32,
+			 crc32(0, (Bytef *)data, offsetof(BG_ENVDATA, crc32)));
+
+	/* Test if a truncated file is rejected
+	 */
+	ck_assert(truncate(path, st.st_size - 1) == 0);
+	ck_assert(read_env(&part, data) == false);
+
+	/* Test if files of fixed size are written again without capacity
+	 */
+	ck_assert(bgenv_set_capacity(&handle, 0));
+	ck_assert(write_env(&part, &envdata[0]));
+	ck_assert(stat(path, &st) == 0);
+	ck_assert_int_eq(st.st_size, sizeof(BG_ENVDATA));
+
+	/* Test if compressed user variables are written to a file of
+	 * variable size holding only the stream, with a footer marking them
+	 */
+	for (int i = 0; i < 100; i++) {
+		(void)snprintf(big, sizeof(big), "app.key%d", i);
+		ck_assert_int_eq(bgenv_set(&handle, big, 0, "value", 6), 0);
+	}
+	bgenv_be_compressing(true);
+	ck_assert(write_env(&part, &envdata[0]));
+	bgenv_be_compressing(false);
+	ck_assert(stat(path, &st) == 0);
+	ck_assert(st.st_size < ENV_HEADER_SIZE + 1024);
+	f = fopen(path, "rb");
+	ck_assert(f != NULL);
+	ck_assert(fseek(f, -(long)sizeof(BG_ENVFOOTER), SEEK_END) == 0);
+	ck_assert(fread(&footer, sizeof(footer), 1, f) == 1);
+	fclose(f);
+	ck_assert_int_eq(footer.magic, ENV_FOOTER_MAGIC_ZLIB);
+	memset(data, 0xFF, sizeof(BG_ENVDATA));
+	ck_assert(read_env(&part, data));
+	ck_assert(memcmp(data, &envdata[0], offsetof(BG_ENVDATA, crc32)) == 0);
+
+	bgenv_drop_uservar_index(envdata[0].userdata);
+	remove(path);
+	rmdir(mountpoint);
+	free(path);
+	free(data);
+}
+END_TEST
+
+START_TEST(env_fat_raw_fat12)
+{
+	check_image(12, 2000);
+}
+END_TEST
+
+START_TEST(env_fat_raw_fat16)
+{
+	check_image(16, 5000);
+}
+END_TEST
+
+START_TEST(env_fat_raw_fat32)
+{
+	check_image(32, 70000);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_fat_raw");
+
+	TFun tfuncs[] = {
+		env_fat_raw_fat12,
+		env_fat_raw_fat16,
+		env_fat_raw_fat32,
+		env_file_variable_size
+	};
+
+	tc_core = tcase_create("Core");
+
+	for (int i = 0; i < sizeof(tfuncs)/sizeof(void *); i++) {
+		tcase_add_test(tc_core, tfuncs[i]);
+	}
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -13,6 +13,7 @@
  */
 
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <check.h>
 #include <fff.h>
 #include <env_api.h>
@@ -82,6 +83,96 @@ START_TEST(env_api_fat_test_probe_config_partitions)
 }
 END_TEST
 
+static void write_cache(char *path, char *contents, mode_t mode)
+{
+	FILE *cache = fopen(path, "w");
+
+	ck_assert(cache != NULL);
+	ck_assert(fputs(contents, cache) >= 0);
+	ck_assert(fclose(cache) == 0);
+	ck_assert(chmod(path, mode) == 0);
+}
+
+START_TEST(env_api_fat_test_discovery_cache)
+{
+	char dir[] = "/tmp/ebgcache-XXXXXX";
+	char entries[256] = {0};
+	char contents[512];
+	struct stat st;
+	char *path, *seqnum;
+
+	ck_assert(mkdtemp(dir) != NULL);
+	ck_assert(asprintf(&path, "%s/config_parts", dir) > 0);
+	ck_assert(asprintf(&seqnum, "%s/uevent_seqnum", dir) > 0);
+	bgenv_use_discovery_cache(path);
+	write_cache(seqnum, "42\n", 0644);
+	uevent_seqnum_path = seqnum;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		snprintf(entries + strlen(entries),
+			 sizeof(entries) - strlen(entries),
+			 "/dev/nobrain_a%d /dev/nobrain_a %d 801 "
+			 "01234567-%02d 0\n",
+			 i + 1, i + 1, i + 1);
+	}
+
+	/* Test if a cache of partitions that do not exist anymore leads to
+	 * a full scan and is removed
+	 */
+	snprintf(contents, sizeof(contents), "EBGCACHE 3\n%d 42\n%s",
+		 ENV_NUM_CONFIG_PARTS, entries);
+	write_cache(path, contents, 0644);
+	RESET_FAKE(ped_device_probe_all);
+	RESET_FAKE(ped_device_get_next);
+	ped_device_get_next_fake.return_val = NULL;
+	ck_assert(bgenv_init() == false);
+	ck_assert_int_eq(ped_device_probe_all_fake.call_count, 1);
+	ck_assert(stat(path, &st) == -1 && errno == ENOENT);
+
+	/* Test if a cache for another number of config partitions or one
+	 * writable by others is not used
+	 */
+	snprintf(contents, sizeof(contents), "EBGCACHE 3\n%d 42\n%s",
+		 ENV_NUM_CONFIG_PARTS + 1, entries);
+	write_cache(path, contents, 0644);
+	RESET_FAKE(ped_device_probe_all);
+	ck_assert(bgenv_init() == false);
+	ck_assert_int_eq(ped_device_probe_all_fake.call_count, 1);
+	ck_assert(stat(path, &st) == -1 && errno == ENOENT);
+
+	snprintf(contents, sizeof(contents), "EBGCACHE 3\n%d 42\n%s",
+		 ENV_NUM_CONFIG_PARTS, entries);
+	write_cache(path, contents, 0666);
+	RESET_FAKE(ped_device_probe_all);
+	ck_assert(bgenv_init() == false);
+	ck_assert_int_eq(ped_device_probe_all_fake.call_count, 1);
+
+	/* Test if a cache taken before block devices changed is not used,
+	 * as config partitions may have been added
+	 */
+	snprintf(contents, sizeof(contents), "EBGCACHE 3\n%d 41\n%s",
+		 ENV_NUM_CONFIG_PARTS, entries);
+	write_cache(path, contents, 0644);
+	RESET_FAKE(ped_device_probe_all);
+	ck_assert(bgenv_init() == false);
+	ck_assert_int_eq(ped_device_probe_all_fake.call_count, 1);
+	ck_assert(stat(path, &st) == -1 && errno == ENOENT);
+
+	/* Test if the cache can be dropped explicitly
+	 */
+	write_cache(path, contents, 0644);
+	bgenv_drop_discovery_cache();
+	ck_assert(stat(path, &st) == -1 && errno == ENOENT);
+
+	bgenv_use_discovery_cache(NULL);
+	uevent_seqnum_path = "/sys/kernel/uevent_seqnum";
+	remove(path);
+	remove(seqnum);
+	rmdir(dir);
+	free(path);
+	free(seqnum);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -91,6 +182,7 @@ Suite *ebg_test_suite(void)
 
 	tc_core = tcase_create("Core");
 	tcase_add_test(tc_core, env_api_fat_test_probe_config_partitions);
+	tcase_add_test(tc_core, env_api_fat_test_discovery_cache);
 	suite_add_tcase(s, tc_core);
 
 	return s;